@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ari.h"
+#include "curlwrap.h"
+#include "msg.h"
+#include "state.h"
+
+static char *ari_file(const char *confdir, const char *certdir,
+        struct stat *st)
+{
+    char *certfile = NULL;
+    if (asprintf(&certfile, "%s/cert.pem", certdir) < 0)
+    {
+        warnx("ari_file: asprintf failed");
+        return NULL;
+    }
+    int r = stat(certfile, st);
+    free(certfile);
+    if (r < 0)
+    {
+        return NULL;
+    }
+    char *idxfile = NULL;
+    if (asprintf(&idxfile, "%s/" ARI_FILE, confdir) < 0)
+    {
+        warnx("ari_file: asprintf failed");
+        return NULL;
+    }
+    return idxfile;
+}
+
+bool ari_lookup(const char *confdir, const char *certdir, ari_t *ari)
+{
+    bool found = false;
+    struct stat st;
+    char *idxfile = ari_file(confdir, certdir, &st);
+    if (!idxfile)
+    {
+        return false;
+    }
+    char *value = state_read(idxfile, certdir);
+    if (value)
+    {
+        long long refresh, start, end, renew, mtime, size;
+        unsigned long long dev, ino;
+        found = sscanf(value, "%lld %lld %lld %lld %llu %llu %lld %lld",
+                &refresh, &start, &end, &renew, &dev, &ino, &mtime,
+                &size) == 8 &&
+            dev == (unsigned long long)st.st_dev &&
+            ino == (unsigned long long)st.st_ino &&
+            mtime == (long long)st.st_mtime &&
+            size == (long long)st.st_size;
+        if (found)
+        {
+            ari->refresh = refresh;
+            ari->start = start;
+            ari->end = end;
+            ari->renew = renew;
+        }
+        free(value);
+    }
+    free(idxfile);
+    return found;
+}
+
+void ari_store(const char *confdir, const char *certdir, const ari_t *ari)
+{
+    struct stat st;
+    char *idxfile = ari_file(confdir, certdir, &st);
+    if (!idxfile)
+    {
+        return;
+    }
+    state_t *s = state_load(idxfile, true);
+    if (!s || !state_set(s, certdir, "%lld %lld %lld %lld %llu %llu %lld %lld",
+                (long long)ari->refresh, (long long)ari->start,
+                (long long)ari->end, (long long)ari->renew,
+                (unsigned long long)st.st_dev,
+                (unsigned long long)st.st_ino,
+                (long long)st.st_mtime, (long long)st.st_size) ||
+            !state_save(s))
+    {
+        warnx("failed to update %s", idxfile);
+    }
+    else
+    {
+        msg(2, "updated %s entry for %s", idxfile, certdir);
+    }
+    state_free(s);
+    free(idxfile);
+}
+
+bool ari_unsupported(const char *confdir, const char *directory)
+{
+    char *idxfile = NULL;
+    if (asprintf(&idxfile, "%s/" ARI_FILE, confdir) < 0)
+    {
+        warnx("ari_unsupported: asprintf failed");
+        return false;
+    }
+    char *value = state_read(idxfile, directory);
+    long long until = 0;
+    bool unsupported = value && sscanf(value, "%lld", &until) == 1 &&
+        until > (long long)time(NULL);
+    if (unsupported)
+    {
+        msg(2, "%s provides no renewal information", directory);
+    }
+    free(value);
+    free(idxfile);
+    return unsupported;
+}
+
+void ari_directory(const char *confdir, const char *directory,
+        bool supported)
+{
+    char *idxfile = NULL;
+    if (asprintf(&idxfile, "%s/" ARI_FILE, confdir) < 0)
+    {
+        warnx("ari_directory: asprintf failed");
+        return;
+    }
+    // only rewritten when the answer changed or the record expired
+    char *value = state_read(idxfile, directory);
+    long long until = 0;
+    bool found = value != NULL;
+    bool fresh = found && sscanf(value, "%lld", &until) == 1 &&
+        until > (long long)time(NULL);
+    free(value);
+    if (supported ? found : !fresh)
+    {
+        state_t *s = state_load(idxfile, true);
+        if (s && supported)
+        {
+            state_del(s, directory);
+        }
+        if (!s || (!supported && !state_set(s, directory, "%lld",
+                        (long long)time(NULL) + ARI_UNSUPPORTED)) ||
+                !state_save(s))
+        {
+            warnx("failed to update %s", idxfile);
+        }
+        state_free(s);
+    }
+    free(idxfile);
+}
+
+// Parses an RFC 3339 timestamp, fractional seconds are dropped
+static bool ari_time(const char *s, time_t *t)
+{
+    struct tm tm;
+    int n = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (!s || sscanf(s, "%4d-%2d-%2d%*1[Tt ]%2d:%2d:%2d%n", &tm.tm_year,
+                &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+                &tm.tm_sec, &n) != 6 || n == 0)
+    {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    s += n;
+    if (*s == '.')
+    {
+        while (isdigit((unsigned char)*++s));
+    }
+    long offset = 0;
+    if (*s == '+' || *s == '-')
+    {
+        int h, m;
+        if (sscanf(s + 1, "%2d:%2d", &h, &m) != 2)
+        {
+            return false;
+        }
+        offset = (*s == '-' ? -1 : 1) * (h * 3600L + m * 60L);
+    }
+    else if (*s != 'Z' && *s != 'z')
+    {
+        return false;
+    }
+    *t = timegm(&tm) - offset;
+    return true;
+}
+
+static time_t ari_retry(const char *s, time_t now)
+{
+    time_t t = curl_retry_after(s);
+    time_t retry = t ? t - now : ARI_RETRY;
+    if (retry < ARI_RETRY_MIN)
+    {
+        retry = ARI_RETRY_MIN;
+    }
+    else if (retry > ARI_RETRY_MAX)
+    {
+        retry = ARI_RETRY_MAX;
+    }
+    return now + retry;
+}
+
+bool ari_update(ari_t *ari, const json_value_t *json,
+        const char *retry_after)
+{
+    time_t now = time(NULL);
+    const json_value_t *w = json_find(json, "suggestedWindow");
+    time_t start, end;
+    ari->refresh = ari_retry(retry_after, now);
+    if (!ari_time(json_find_string(w, "start"), &start) ||
+            !ari_time(json_find_string(w, "end"), &end) || end < start)
+    {
+        warnx("invalid suggested renewal window");
+        return false;
+    }
+    // keep the time picked earlier unless the CA moved the window
+    if (start != ari->start || end != ari->end || ari->renew < start ||
+            ari->renew > end)
+    {
+        ari->start = start;
+        ari->end = end;
+        if (end <= now)
+        {
+            ari->renew = now;
+        }
+        else
+        {
+            if (start < now)
+            {
+                start = now;
+            }
+            ari->renew = start + (time_t)(random() %
+                    ((long long)(end - start) + 1));
+        }
+    }
+    const char *explanation = json_find_string(json, "explanationURL");
+    if (explanation)
+    {
+        msg(1, "renewal window explained at %s", explanation);
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ARI_H__
+#define __ARI_H__
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "json.h"
+
+/*
+ * ACME renewal information (RFC 9773) kept in CONFDIR/renewal.idx, one
+ * record per certificate directory with the dev/inode/mtime/size of its
+ * cert.pem, the time after which the CA should be asked again, the
+ * suggested window and the renewal time picked at random inside it.
+ * A record with an empty window means that the CA offered none, which
+ * spares directory lookups until the record is due for a refresh.
+ *
+ * A directory URL without renewalInfo is recorded there as well, keyed
+ * by the URL, so that certificates whose record is stale do not make the
+ * next ARI_UNSUPPORTED seconds of runs fetch the directory only to find
+ * out again.
+ */
+#define ARI_FILE "renewal.idx"
+#define ARI_RETRY 21600
+#define ARI_RETRY_MIN 60
+#define ARI_RETRY_MAX 86400
+#define ARI_UNSUPPORTED 604800
+
+typedef struct ari
+{
+    time_t refresh;
+    time_t start;
+    time_t end;
+    time_t renew;
+} ari_t;
+
+bool ari_lookup(const char *confdir, const char *certdir, ari_t *ari);
+void ari_store(const char *confdir, const char *certdir, const ari_t *ari);
+bool ari_update(ari_t *ari, const json_value_t *json,
+        const char *retry_after);
+bool ari_unsupported(const char *confdir, const char *directory);
+void ari_directory(const char *confdir, const char *directory,
+        bool supported);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backoff.h"
+#include "msg.h"
+#include "state.h"
+
+static state_t *backoff_load(const char *confdir, bool lock)
+{
+    char *path = NULL;
+    if (asprintf(&path, "%s/" BACKOFF_FILE, confdir) < 0)
+    {
+        warnx("backoff_load: asprintf failed");
+        return NULL;
+    }
+    state_t *s = state_load(path, lock);
+    free(path);
+    return s;
+}
+
+static void backoff_save(const char *confdir, state_t *s, bool ok)
+{
+    if (!ok || !state_save(s))
+    {
+        warnx("failed to update %s/" BACKOFF_FILE, confdir);
+    }
+    state_free(s);
+}
+
+static const char *backoff_key(const char *name)
+{
+    return name[0] == '*' && name[1] == '.' ? name + 2 : name;
+}
+
+static bool backoff_parse(const char *value, unsigned int *failures,
+        time_t *until)
+{
+    long long t;
+    if (!value || sscanf(value, "%u %lld", failures, &t) != 2)
+    {
+        return false;
+    }
+    *until = (time_t)t;
+    return true;
+}
+
+// Returns how long to wait before any of names may be attempted again,
+// 0 if all of them may be attempted now
+time_t backoff_wait(const char *confdir, const char * const *names)
+{
+    time_t now = time(NULL), wait = 0, until;
+    unsigned int failures;
+    state_t *s = backoff_load(confdir, false);
+    if (!s)
+    {
+        return 0;
+    }
+    for (size_t i = 0; names && names[i]; i++)
+    {
+        const char *key = backoff_key(names[i]);
+        if (!backoff_parse(state_get(s, key), &failures, &until))
+        {
+            continue;
+        }
+        if (until > now)
+        {
+            msg(1, "validation of %s failed %u times in a row, next attempt "
+                    "in %lld seconds", key, failures, (long long)(until - now));
+            wait = until - now > wait ? until - now : wait;
+        }
+        else
+        {
+            msg(1, "probing %s after %u failed validations", key, failures);
+        }
+    }
+    state_free(s);
+    return wait;
+}
+
+void backoff_failed(const char *confdir, const char *name)
+{
+    time_t until, delay = BACKOFF_MIN;
+    unsigned int failures = 0;
+    const char *key = backoff_key(name);
+    state_t *s = backoff_load(confdir, true);
+    if (!s)
+    {
+        return;
+    }
+    backoff_parse(state_get(s, key), &failures, &until);
+    failures++;
+    for (unsigned int i = 1; i < failures && delay < BACKOFF_MAX; i++)
+    {
+        delay *= 2;
+    }
+    if (delay > BACKOFF_MAX)
+    {
+        delay = BACKOFF_MAX;
+    }
+    until = time(NULL) + delay;
+    msg(1, "not attempting %s again for %lld seconds", key,
+            (long long)delay);
+    backoff_save(confdir, s, state_set(s, key, "%u %lld", failures,
+                (long long)until));
+}
+
+void backoff_passed(const char *confdir, const char *name)
+{
+    time_t until;
+    unsigned int failures;
+    const char *key = backoff_key(name);
+    state_t *s = backoff_load(confdir, false);
+    bool found = s && backoff_parse(state_get(s, key), &failures, &until);
+    state_free(s);
+    if (!found)
+    {
+        return;
+    }
+    s = backoff_load(confdir, true);
+    if (s)
+    {
+        state_del(s, key);
+        backoff_save(confdir, s, true);
+    }
+}
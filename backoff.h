@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BACKOFF_H__
+#define __BACKOFF_H__
+
+#include <time.h>
+
+/*
+ * Circuit breaker for identifiers whose validation keeps failing, kept in
+ * CONFDIR/backoff.idx as "FAILURES UNTIL" per identifier. After a failure
+ * no attempt is made for the identifier until UNTIL, BACKOFF_MIN seconds
+ * doubling with every consecutive failure up to BACKOFF_MAX. Once UNTIL
+ * has passed the next attempt is a probe: failing again reopens the
+ * breaker for twice as long, a successful validation removes the record.
+ * Wildcard names share the record of their base name, as their
+ * authorizations do.
+ */
+#define BACKOFF_FILE "backoff.idx"
+#define BACKOFF_MIN 3600
+#define BACKOFF_MAX 86400
+
+time_t backoff_wait(const char *confdir, const char * const *names);
+void backoff_failed(const char *confdir, const char *name);
+void backoff_passed(const char *confdir, const char *name);
+
+#endif
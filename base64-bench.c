@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks every base64 kernel available on this CPU against the scalar
+ * code on random inputs, clean, with line breaks, corrupted and truncated,
+ * in all four variants, then prints the throughput of each kernel for
+ * inputs of 50 bytes to 8 KB. Built with "make base64-bench", exits with
+ * 1 if any kernel disagrees with the scalar code.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base64.h"
+
+#define BENCH_ROUNDS 20000
+#define BENCH_MAX 9000
+#define BENCH_SECONDS 0.2
+
+static const char *kernels[] = {"ssse3", "avx2", "neon"};
+static const int variants[] =
+{
+    base64_VARIANT_ORIGINAL,
+    base64_VARIANT_ORIGINAL_NO_PADDING,
+    base64_VARIANT_URLSAFE,
+    base64_VARIANT_URLSAFE_NO_PADDING
+};
+static const size_t sizes[] = {50, 200, 1024, 8192};
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t bench_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)(rng >> 32);
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct result
+{
+    int ret;
+    size_t len;
+    ptrdiff_t end;
+    unsigned char *bin;
+} result_t;
+
+static void decode(const char *kernel, const char *b64, size_t len,
+        const char *ignore, bool end, int variant, result_t *r)
+{
+    const char *b64_end = NULL;
+    base64_kernel(kernel);
+    r->len = (size_t)-1;
+    memset(r->bin, 0xa5, BENCH_MAX);
+    r->ret = base642bin(r->bin, BENCH_MAX, b64, len, ignore, &r->len,
+            end ? &b64_end : NULL, variant);
+    r->end = b64_end ? b64_end - b64 : -1;
+}
+
+static bool compare(const char *kernel, const char *b64, size_t len,
+        const char *ignore, bool end, int variant, result_t *ref,
+        result_t *res)
+{
+    decode("none", b64, len, ignore, end, variant, ref);
+    decode(kernel, b64, len, ignore, end, variant, res);
+    if (ref->ret != res->ret || ref->len != res->len ||
+            ref->end != res->end ||
+            memcmp(ref->bin, res->bin, BENCH_MAX) != 0)
+    {
+        warnx("%s: decoding mismatch, variant %d, %zu characters",
+                kernel, variant, len);
+        return false;
+    }
+    return true;
+}
+
+static bool check(const char *kernel)
+{
+    bool ok = true;
+    unsigned char *bin = malloc(BENCH_MAX);
+    char *ref = malloc(2 * BENCH_MAX);
+    char *res = malloc(2 * BENCH_MAX);
+    char *lines = malloc(3 * BENCH_MAX);
+    result_t r1 = {0, 0, 0, malloc(BENCH_MAX)};
+    result_t r2 = {0, 0, 0, malloc(BENCH_MAX)};
+    if (!bin || !ref || !res || !lines || !r1.bin || !r2.bin)
+    {
+        err(2, "malloc failed");
+    }
+    for (int i = 0; ok && i < BENCH_ROUNDS; i++)
+    {
+        int variant = variants[i % 4];
+        size_t len = bench_rand() % (i < BENCH_ROUNDS / 2 ? 100 :
+                BENCH_MAX * 3 / 4);
+        for (size_t j = 0; j < len; j++)
+        {
+            bin[j] = bench_rand();
+        }
+
+        // bin2base64() clears the whole buffer past the output
+        size_t size = base64_ENCODED_LEN(len, variant);
+        base64_kernel("none");
+        bin2base64(ref, size, bin, len, variant);
+        base64_kernel(kernel);
+        bin2base64(res, size, bin, len, variant);
+        if (strcmp(ref, res) != 0)
+        {
+            warnx("%s: encoding mismatch, variant %d, %zu bytes", kernel,
+                    variant, len);
+            ok = false;
+            break;
+        }
+        size_t n = strlen(ref);
+
+        // clean, truncated, and in PEM lines ignoring line breaks
+        ok = compare(kernel, ref, n, NULL, i & 1, variant, &r1, &r2) &&
+            compare(kernel, ref, n ? bench_rand() % n : 0, NULL, true,
+                    variant, &r1, &r2);
+        size_t m = 0;
+        for (size_t j = 0; j < n; j++)
+        {
+            lines[m++] = ref[j];
+            if (j % 64 == 63)
+            {
+                lines[m++] = '\n';
+            }
+        }
+        ok = ok && compare(kernel, lines, m, "\n", i & 1, variant, &r1,
+                &r2);
+
+        // a random character anywhere, often outside the alphabet
+        if (ok && m > 0)
+        {
+            lines[bench_rand() % m] = bench_rand() % 128;
+            ok = compare(kernel, lines, m, "\n", true, variant, &r1, &r2);
+        }
+    }
+    free(bin);
+    free(ref);
+    free(res);
+    free(lines);
+    free(r1.bin);
+    free(r2.bin);
+    return ok;
+}
+
+static void bench(const char *kernel)
+{
+    unsigned char bin[8192];
+    unsigned char out[8192];
+    char b64[base64_ENCODED_LEN(8192, base64_VARIANT_ORIGINAL)];
+    for (size_t i = 0; i < sizeof(bin); i++)
+    {
+        bin[i] = bench_rand();
+    }
+    base64_kernel(kernel);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t len = sizes[i], out_len, total = 0;
+        size_t size = base64_ENCODED_LEN(len, base64_VARIANT_ORIGINAL);
+        double start = bench_now(), enc, dec;
+        do
+        {
+            for (int k = 0; k < 1000; k++)
+            {
+                bin2base64(b64, size, bin, len, base64_VARIANT_ORIGINAL);
+            }
+            total += 1000 * len;
+        } while ((enc = bench_now() - start) < BENCH_SECONDS);
+        enc = total / enc / 1e6;
+
+        size_t n = strlen(b64);
+        total = 0;
+        start = bench_now();
+        do
+        {
+            for (int k = 0; k < 1000; k++)
+            {
+                base642bin(out, sizeof(out), b64, n, NULL, &out_len, NULL,
+                        base64_VARIANT_ORIGINAL);
+            }
+            total += 1000 * len;
+        } while ((dec = bench_now() - start) < BENCH_SECONDS);
+        dec = total / dec / 1e6;
+
+        printf("%-6s %6zu %10.0f %10.0f\n", kernel, len, enc, dec);
+    }
+}
+
+int main(void)
+{
+    int ret = 0;
+    printf("%-6s %6s %10s %10s\n", "kernel", "bytes", "enc MB/s",
+            "dec MB/s");
+    bench("none");
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (base64_kernel(kernels[i]) < 0)
+        {
+            continue;
+        }
+        if (!check(kernels[i]))
+        {
+            ret = 1;
+        }
+        bench(kernels[i]);
+    }
+    return ret;
+}
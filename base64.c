@@ -193,6 +193,386 @@ static unsigned int b64_urlsafe_char_to_byte(int c)
 #define VARIANT_NO_PADDING_MASK 0x2U
 #define VARIANT_URLSAFE_MASK    0x4U
 
+/*
+ * Vectorized kernels. They only ever process whole groups of 3 input
+ * bytes / 4 characters, so the scalar code below picks up exactly where
+ * they stop with an empty accumulator. Character mapping is done with
+ * compares, arithmetic and in-register shuffles only (no data dependent
+ * memory accesses or branches within a block), so the constant-time
+ * property of the scalar routines is preserved. Decoding stops at the
+ * first block containing a character outside the alphabet and leaves
+ * padding, ignored characters and errors to the scalar code.
+ */
+typedef size_t (*b64_enc_fn)(char *, const unsigned char *, size_t, int);
+typedef size_t (*b64_dec_fn)(unsigned char *, size_t, const char *, size_t,
+        int, size_t *);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_B64_X86 1
+#include <immintrin.h>
+
+__attribute__ ((target("ssse3"), always_inline))
+static inline __m128i b64_enc_sse_map(__m128i idx, int urlsafe)
+{
+    const __m128i lut = urlsafe ?
+        _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '-' - 62, '_' - 63, 'A', 0, 0) :
+        _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '+' - 62, '/' - 63, 'A', 0, 0);
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i lt = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    r = _mm_or_si128(r, _mm_and_si128(lt, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(lut, r), idx);
+}
+
+__attribute__ ((target("ssse3"), always_inline))
+static inline size_t b64_enc_sse(char *dst, const unsigned char *src, size_t len,
+        int urlsafe)
+{
+    size_t i = 0;
+    // 16 byte loads, 12 bytes consumed per iteration
+    while (len - i >= 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                    4, 5, 3, 4, 1, 2, 0, 1));
+        __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        __m128i out = b64_enc_sse_map(_mm_or_si128(t1, t3), urlsafe);
+        _mm_storeu_si128((__m128i *)dst, out);
+        dst += 16;
+        i += 12;
+    }
+    return i;
+}
+
+__attribute__ ((target("avx2")))
+static size_t b64_enc_avx2(char *dst, const unsigned char *src, size_t len,
+        int urlsafe)
+{
+    const __m256i lut = urlsafe ?
+        _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '-' - 62, '_' - 63, 'A', 0, 0,
+                'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '-' - 62, '_' - 63, 'A', 0, 0) :
+        _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '+' - 62, '/' - 63, 'A', 0, 0,
+                'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '+' - 62, '/' - 63, 'A', 0, 0);
+    const __m256i shuf = _mm256_set_epi8(
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    size_t i = 0;
+    // two 16 byte loads at offsets 0 and 12, 24 bytes consumed
+    while (len - i >= 28)
+    {
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((const __m128i *)(src + i))),
+                _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+        in = _mm256_shuffle_epi8(in, shuf);
+        __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t1, t3);
+        __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        __m256i lt = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+        r = _mm256_or_si256(r, _mm256_and_si256(lt, _mm256_set1_epi8(13)));
+        r = _mm256_add_epi8(_mm256_shuffle_epi8(lut, r), idx);
+        _mm256_storeu_si256((__m256i *)dst, r);
+        dst += 32;
+        i += 24;
+    }
+    return i + b64_enc_sse(dst, src + i, len - i, urlsafe);
+}
+
+#define B64_IN_RANGE(c, lo, hi) _mm_and_si128( \
+        _mm_cmpgt_epi8(c, _mm_set1_epi8((lo) - 1)), \
+        _mm_cmpgt_epi8(_mm_set1_epi8((hi) + 1), c))
+
+__attribute__ ((target("ssse3"), always_inline))
+static inline int b64_dec_sse_map(__m128i c, int urlsafe, __m128i *val)
+{
+    __m128i az = B64_IN_RANGE(c, 'A', 'Z');
+    __m128i lz = B64_IN_RANGE(c, 'a', 'z');
+    __m128i dg = B64_IN_RANGE(c, '0', '9');
+    __m128i s62 = _mm_cmpeq_epi8(c, _mm_set1_epi8(urlsafe ? '-' : '+'));
+    __m128i s63 = _mm_cmpeq_epi8(c, _mm_set1_epi8(urlsafe ? '_' : '/'));
+    __m128i v = _mm_and_si128(az, _mm_sub_epi8(c, _mm_set1_epi8('A')));
+    v = _mm_or_si128(v, _mm_and_si128(lz,
+                _mm_sub_epi8(c, _mm_set1_epi8('a' - 26))));
+    v = _mm_or_si128(v, _mm_and_si128(dg,
+                _mm_sub_epi8(c, _mm_set1_epi8('0' - 52))));
+    v = _mm_or_si128(v, _mm_and_si128(s62, _mm_set1_epi8(62)));
+    v = _mm_or_si128(v, _mm_and_si128(s63, _mm_set1_epi8(63)));
+    *val = v;
+    __m128i ok = _mm_or_si128(_mm_or_si128(az, lz),
+            _mm_or_si128(dg, _mm_or_si128(s62, s63)));
+    return _mm_movemask_epi8(ok) == 0xFFFF;
+}
+
+__attribute__ ((target("ssse3"), always_inline))
+static inline size_t b64_dec_sse(unsigned char *dst, size_t dst_max,
+        const char *src, size_t len, int urlsafe, size_t *dst_len)
+{
+    size_t i = 0;
+    size_t o = 0;
+    while (len - i >= 16 && dst_max - o >= 12)
+    {
+        __m128i v;
+        if (!b64_dec_sse_map(_mm_loadu_si128((const __m128i *)(src + i)),
+                    urlsafe, &v))
+        {
+            break;
+        }
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                    14, 13, 12, -1, -1, -1, -1));
+        unsigned char tmp[16];
+        _mm_storeu_si128((__m128i *)tmp, v);
+        memcpy(dst + o, tmp, 12);
+        o += 12;
+        i += 16;
+    }
+    *dst_len = o;
+    return i;
+}
+
+#define B64_IN_RANGE256(c, lo, hi) _mm256_and_si256( \
+        _mm256_cmpgt_epi8(c, _mm256_set1_epi8((lo) - 1)), \
+        _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), c))
+
+__attribute__ ((target("avx2")))
+static size_t b64_dec_avx2(unsigned char *dst, size_t dst_max,
+        const char *src, size_t len, int urlsafe, size_t *dst_len)
+{
+    const __m256i c62 = _mm256_set1_epi8(urlsafe ? '-' : '+');
+    const __m256i c63 = _mm256_set1_epi8(urlsafe ? '_' : '/');
+    size_t i = 0;
+    size_t o = 0;
+    while (len - i >= 32 && dst_max - o >= 24)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i az = B64_IN_RANGE256(c, 'A', 'Z');
+        __m256i lz = B64_IN_RANGE256(c, 'a', 'z');
+        __m256i dg = B64_IN_RANGE256(c, '0', '9');
+        __m256i s62 = _mm256_cmpeq_epi8(c, c62);
+        __m256i s63 = _mm256_cmpeq_epi8(c, c63);
+        __m256i ok = _mm256_or_si256(_mm256_or_si256(az, lz),
+                _mm256_or_si256(dg, _mm256_or_si256(s62, s63)));
+        if (_mm256_movemask_epi8(ok) != -1)
+        {
+            break;
+        }
+        __m256i v = _mm256_and_si256(az,
+                _mm256_sub_epi8(c, _mm256_set1_epi8('A')));
+        v = _mm256_or_si256(v, _mm256_and_si256(lz,
+                    _mm256_sub_epi8(c, _mm256_set1_epi8('a' - 26))));
+        v = _mm256_or_si256(v, _mm256_and_si256(dg,
+                    _mm256_sub_epi8(c, _mm256_set1_epi8('0' - 52))));
+        v = _mm256_or_si256(v, _mm256_and_si256(s62,
+                    _mm256_set1_epi8(62)));
+        v = _mm256_or_si256(v, _mm256_and_si256(s63,
+                    _mm256_set1_epi8(63)));
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+                    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        v = _mm256_permutevar8x32_epi32(v,
+                _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        unsigned char tmp[32];
+        _mm256_storeu_si256((__m256i *)tmp, v);
+        memcpy(dst + o, tmp, 24);
+        o += 24;
+        i += 32;
+    }
+    size_t n = 0;
+    i += b64_dec_sse(dst + o, dst_max - o, src + i, len - i, urlsafe, &n);
+    *dst_len = o + n;
+    return i;
+}
+#undef B64_IN_RANGE256
+#undef B64_IN_RANGE
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_B64_NEON 1
+#include <arm_neon.h>
+
+static size_t b64_enc_neon(char *dst, const unsigned char *src, size_t len,
+        int urlsafe)
+{
+    static const char std[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static const char url[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    // the whole alphabet lives in registers, tbl lookups are constant-time
+    const uint8_t *a = (const uint8_t *)(urlsafe ? url : std);
+    const uint8x16x4_t lut = {{vld1q_u8(a), vld1q_u8(a + 16),
+        vld1q_u8(a + 32), vld1q_u8(a + 48)}};
+    const uint8x16_t m6 = vdupq_n_u8(0x3f);
+    size_t i = 0;
+    while (len - i >= 48)
+    {
+        uint8x16x3_t in = vld3q_u8(src + i);
+        uint8x16x4_t out;
+        out.val[0] = vshrq_n_u8(in.val[0], 2);
+        out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4),
+                    vshrq_n_u8(in.val[1], 4)), m6);
+        out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2),
+                    vshrq_n_u8(in.val[2], 6)), m6);
+        out.val[3] = vandq_u8(in.val[2], m6);
+        out.val[0] = vqtbl4q_u8(lut, out.val[0]);
+        out.val[1] = vqtbl4q_u8(lut, out.val[1]);
+        out.val[2] = vqtbl4q_u8(lut, out.val[2]);
+        out.val[3] = vqtbl4q_u8(lut, out.val[3]);
+        vst4q_u8((uint8_t *)dst, out);
+        dst += 64;
+        i += 48;
+    }
+    return i;
+}
+
+static inline uint8x16_t b64_dec_neon_map(uint8x16_t c, int urlsafe,
+        uint8x16_t *bad)
+{
+    uint8x16_t az = vandq_u8(vcgeq_u8(c, vdupq_n_u8('A')),
+            vcleq_u8(c, vdupq_n_u8('Z')));
+    uint8x16_t lz = vandq_u8(vcgeq_u8(c, vdupq_n_u8('a')),
+            vcleq_u8(c, vdupq_n_u8('z')));
+    uint8x16_t dg = vandq_u8(vcgeq_u8(c, vdupq_n_u8('0')),
+            vcleq_u8(c, vdupq_n_u8('9')));
+    uint8x16_t s62 = vceqq_u8(c, vdupq_n_u8(urlsafe ? '-' : '+'));
+    uint8x16_t s63 = vceqq_u8(c, vdupq_n_u8(urlsafe ? '_' : '/'));
+    uint8x16_t v = vandq_u8(az, vsubq_u8(c, vdupq_n_u8('A')));
+    v = vorrq_u8(v, vandq_u8(lz, vsubq_u8(c, vdupq_n_u8('a' - 26))));
+    v = vorrq_u8(v, vandq_u8(dg, vaddq_u8(c, vdupq_n_u8(52 - '0'))));
+    v = vorrq_u8(v, vandq_u8(s62, vdupq_n_u8(62)));
+    v = vorrq_u8(v, vandq_u8(s63, vdupq_n_u8(63)));
+    *bad = vorrq_u8(*bad, vmvnq_u8(vorrq_u8(vorrq_u8(az, lz),
+                    vorrq_u8(dg, vorrq_u8(s62, s63)))));
+    return v;
+}
+
+static size_t b64_dec_neon(unsigned char *dst, size_t dst_max,
+        const char *src, size_t len, int urlsafe, size_t *dst_len)
+{
+    size_t i = 0;
+    size_t o = 0;
+    while (len - i >= 64 && dst_max - o >= 48)
+    {
+        uint8x16x4_t in = vld4q_u8((const uint8_t *)src + i);
+        uint8x16_t bad = vdupq_n_u8(0);
+        uint8x16_t a = b64_dec_neon_map(in.val[0], urlsafe, &bad);
+        uint8x16_t b = b64_dec_neon_map(in.val[1], urlsafe, &bad);
+        uint8x16_t c = b64_dec_neon_map(in.val[2], urlsafe, &bad);
+        uint8x16_t d = b64_dec_neon_map(in.val[3], urlsafe, &bad);
+        if (vmaxvq_u8(bad))
+        {
+            break;
+        }
+        uint8x16x3_t out;
+        out.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+        out.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+        out.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+        vst3q_u8(dst + o, out);
+        o += 48;
+        i += 64;
+    }
+    *dst_len = o;
+    return i;
+}
+#endif
+
+static size_t b64_enc_none(char *dst, const unsigned char *src, size_t len,
+        int urlsafe)
+{
+    (void)dst;
+    (void)src;
+    (void)len;
+    (void)urlsafe;
+    return 0;
+}
+
+static size_t b64_dec_none(unsigned char *dst, size_t dst_max,
+        const char *src, size_t len, int urlsafe, size_t *dst_len)
+{
+    (void)dst;
+    (void)dst_max;
+    (void)src;
+    (void)len;
+    (void)urlsafe;
+    *dst_len = 0;
+    return 0;
+}
+
+static b64_enc_fn b64_enc_fast = NULL;
+static b64_dec_fn b64_dec_fast = NULL;
+
+static void b64_select(void)
+{
+    b64_enc_fast = b64_enc_none;
+    b64_dec_fast = b64_dec_none;
+#if defined(HAVE_B64_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        b64_enc_fast = b64_enc_avx2;
+        b64_dec_fast = b64_dec_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        b64_enc_fast = b64_enc_sse;
+        b64_dec_fast = b64_dec_sse;
+    }
+#elif defined(HAVE_B64_NEON)
+    b64_enc_fast = b64_enc_neon;
+    b64_dec_fast = b64_dec_neon;
+#endif
+}
+
+int base64_kernel(const char *name)
+{
+    b64_select();
+    if (strcmp(name, "none") == 0)
+    {
+        b64_enc_fast = b64_enc_none;
+        b64_dec_fast = b64_dec_none;
+        return 0;
+    }
+#if defined(HAVE_B64_X86)
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        b64_enc_fast = b64_enc_avx2;
+        b64_dec_fast = b64_dec_avx2;
+        return 0;
+    }
+    if (strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3"))
+    {
+        b64_enc_fast = b64_enc_sse;
+        b64_dec_fast = b64_dec_sse;
+        return 0;
+    }
+#elif defined(HAVE_B64_NEON)
+    if (strcmp(name, "neon") == 0)
+    {
+        b64_enc_fast = b64_enc_neon;
+        b64_dec_fast = b64_dec_neon;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
 static void base64_check_variant(const int variant)
 {
     if ((((unsigned int) variant) & ~ 0x6U) != 0x1U)
@@ -234,6 +614,12 @@ char *bin2base64(char * const b64, const size_t b64_maxlen,
     {
         errx(2, "bin2base64: maxlen < len");
     }
+    if (!b64_enc_fast) {
+        b64_select();
+    }
+    bin_pos = b64_enc_fast(b64, bin, bin_len,
+            ((unsigned int) variant) & VARIANT_URLSAFE_MASK);
+    b64_pos = (bin_pos / 3) * 4;
     if ((((unsigned int) variant) & VARIANT_URLSAFE_MASK) != 0U) {
         while (bin_pos < bin_len) {
             acc = (acc << 8) + bin[bin_pos++];
@@ -309,6 +695,11 @@ int base642bin(unsigned char * const bin, const size_t bin_maxlen,
 
     base64_check_variant(variant);
     is_urlsafe = ((unsigned int) variant) & VARIANT_URLSAFE_MASK;
+    if (!b64_dec_fast) {
+        b64_select();
+    }
+    b64_pos = b64_dec_fast(bin, bin_maxlen, b64, b64_len, is_urlsafe,
+            &bin_pos);
     while (b64_pos < b64_len) {
         c = b64[b64_pos];
         if (is_urlsafe) {
@@ -319,6 +710,13 @@ int base642bin(unsigned char * const bin, const size_t bin_maxlen,
         if (d == 0xFF) {
             if (ignore != NULL && strchr(ignore, c) != NULL) {
                 b64_pos++;
+                if (acc_len == 0) {
+                    size_t n;
+                    b64_pos += b64_dec_fast(bin + bin_pos,
+                            bin_maxlen - bin_pos, b64 + b64_pos,
+                            b64_len - b64_pos, is_urlsafe, &n);
+                    bin_pos += n;
+                }
                 continue;
             }
             break;
@@ -82,4 +82,11 @@ int base642bin(unsigned char * const bin, const size_t bin_maxlen,
 
 char *encode_base64url(const char *str);
 
+/*
+ * Forces the vectorized kernel used by the routines above, "none" for the
+ * scalar code alone, "ssse3", "avx2" or "neon", instead of the one picked
+ * for this CPU. Meant for base64-bench. Returns -1 if it is not available.
+ */
+int base64_kernel(const char *name);
+
 #endif
@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "certidx.h"
+#include "crypto.h"
+#include "msg.h"
+#include "state.h"
+
+static int names_cmp(const void *a, const void *b)
+{
+    return strcasecmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+uint64_t names_hash(const char * const *names)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t count = 0;
+    while (names && names[count])
+    {
+        count++;
+    }
+    const char **sorted = calloc(count + 1, sizeof(char *));
+    if (!sorted)
+    {
+        warn("names_hash: calloc failed");
+        return 0;
+    }
+    memcpy(sorted, names, count * sizeof(char *));
+    qsort(sorted, count, sizeof(char *), names_cmp);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i > 0 && strcasecmp(sorted[i], sorted[i-1]) == 0)
+        {
+            continue;
+        }
+        for (const char *c = sorted[i]; *c; c++)
+        {
+            h ^= (unsigned char)tolower(*c);
+            h *= 0x100000001b3ULL;
+        }
+        h ^= '\n';
+        h *= 0x100000001b3ULL;
+    }
+    free(sorted);
+    return h;
+}
+
+static bool names_contain(const char * const *names, const char * const *in)
+{
+    for (size_t i = 0; names && names[i]; i++)
+    {
+        size_t j = 0;
+        while (in && in[j] && strcasecmp(names[i], in[j]) != 0)
+        {
+            j++;
+        }
+        if (!in || !in[j])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool names_equal(const char * const *a, const char * const *b)
+{
+    return names_contain(a, b) && names_contain(b, a);
+}
+
+char *names_join(const char * const *names)
+{
+    size_t len = 1;
+    for (const char * const *n = names; n && *n; n++)
+    {
+        len += strlen(*n) + 1;
+    }
+    char *ret = calloc(1, len);
+    if (!ret)
+    {
+        warn("names_join: calloc failed");
+        return NULL;
+    }
+    for (const char * const *n = names; n && *n; n++)
+    {
+        if (n != names)
+        {
+            strcat(ret, ",");
+        }
+        strcat(ret, *n);
+    }
+    return ret;
+}
+
+char **names_split(const char *names)
+{
+    size_t n = 0;
+    for (const char *p = names; *p; p++)
+    {
+        n += *p == ',';
+    }
+    char **ret = calloc(n + 2, sizeof(char *));
+    char *dup = strdup(names);
+    if (!ret || !dup)
+    {
+        warn("names_split: allocation failed");
+        free(ret);
+        free(dup);
+        return NULL;
+    }
+    n = 0;
+    for (char *p = dup, *tok; (tok = strsep(&p, ",")); )
+    {
+        if (*tok && !(ret[n++] = strdup(tok)))
+        {
+            warn("names_split: strdup failed");
+            names_free(ret);
+            ret = NULL;
+            break;
+        }
+    }
+    free(dup);
+    return ret;
+}
+
+static uint64_t account_fnv(const char *thumbprint)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = thumbprint; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint64_t account_hash(const char *confdir)
+{
+    char *idxfile = NULL;
+    if (asprintf(&idxfile, "%s/" ACCOUNT_FILE, confdir) < 0)
+    {
+        warnx("account_hash: asprintf failed");
+        return 0;
+    }
+    char *thumbprint = state_read(idxfile, ACCOUNT_KEY);
+    uint64_t h = thumbprint ? account_fnv(thumbprint) : 0;
+    free(thumbprint);
+    free(idxfile);
+    return h;
+}
+
+uint64_t account_cache(const char *confdir, const char *thumbprint)
+{
+    char *idxfile = NULL;
+    if (asprintf(&idxfile, "%s/" ACCOUNT_FILE, confdir) < 0)
+    {
+        warnx("account_cache: asprintf failed");
+        return account_fnv(thumbprint);
+    }
+    // only rewritten for a new account or after a key change
+    char *value = state_read(idxfile, ACCOUNT_KEY);
+    if (!value || strcmp(value, thumbprint) != 0)
+    {
+        state_t *s = state_load(idxfile, true);
+        if (!s || !state_set(s, ACCOUNT_KEY, "%s", thumbprint) ||
+                !state_save(s))
+        {
+            warnx("failed to update %s", idxfile);
+        }
+        state_free(s);
+    }
+    free(value);
+    free(idxfile);
+    return account_fnv(thumbprint);
+}
+
+time_t cert_jitter(const char * const *names, uint64_t account, int hours)
+{
+    if (hours <= 0)
+    {
+        return 0;
+    }
+    // splitmix64 finalizer, so that similar names land far apart
+    uint64_t h = names_hash(names) ^ account;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (time_t)(h % ((uint64_t)hours * 3600));
+}
+
+char **cert_file_info(const char *certfile, time_t *expiration,
+        struct stat *st)
+{
+    char **names = NULL;
+    int fd = open(certfile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            msg(1, "%s does not exist", certfile);
+        }
+        else
+        {
+            warn("failed to open %s", certfile);
+        }
+        return NULL;
+    }
+    if (fstat(fd, st) < 0)
+    {
+        warn("failed to stat %s", certfile);
+        close(fd);
+        return NULL;
+    }
+    if (st->st_size == 0)
+    {
+        warnx("%s is empty", certfile);
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        warn("failed to map %s", certfile);
+        return NULL;
+    }
+    names = cert_info(data, st->st_size, expiration);
+    munmap(data, st->st_size);
+    if (!names)
+    {
+        warnx("failed to load %s", certfile);
+    }
+    return names;
+}
+
+static bool names_covered(char * const *certnames, const char * const *names,
+        const char *certfile)
+{
+    while (names && *names)
+    {
+        char * const *n = certnames;
+        while (*n && strcasecmp(*n, *names))
+        {
+            n++;
+        }
+        if (!*n)
+        {
+            msg(1, "%s does not include %s", certfile, *names);
+            return false;
+        }
+        names++;
+    }
+    return true;
+}
+
+// Appends the record rather than rewriting the whole index, so that a
+// pass over many changed certificates stays linear. certidx_compact()
+// drops the superseded records later.
+static void certidx_store(const char *confdir, const char *certdir,
+        const struct stat *st, time_t expiration, uint64_t hash,
+        const char * const *list)
+{
+    char *idxfile = NULL;
+    char *names = names_join(list);
+    if (!names)
+    {
+        return;
+    }
+    if (asprintf(&idxfile, "%s/" CERTIDX_FILE, confdir) < 0)
+    {
+        warnx("certidx_store: asprintf failed");
+        free(names);
+        return;
+    }
+    if (!state_append(idxfile, certdir, "%lld %016llx %llu %llu %lld %lld %s",
+                (long long)expiration, (unsigned long long)hash,
+                (unsigned long long)st->st_dev,
+                (unsigned long long)st->st_ino,
+                (long long)st->st_mtime, (long long)st->st_size, names))
+    {
+        warnx("failed to update %s", idxfile);
+    }
+    else
+    {
+        msg(2, "updated %s entry for %s", idxfile, certdir);
+    }
+    free(idxfile);
+    free(names);
+}
+
+void certidx_compact(const state_t *idx)
+{
+    // only once the superseded records outnumber the live ones, so that
+    // the rewrites cost no more than the appends did
+    if (idx->stale <= idx->count)
+    {
+        return;
+    }
+    state_t *s = state_load(idx->path, true);
+    if (!s || !state_save(s))
+    {
+        warnx("failed to compact %s", idx->path);
+    }
+    else
+    {
+        msg(2, "dropped %zu stale records from %s", s->stale, s->path);
+    }
+    state_free(s);
+}
+
+bool certidx_parse(const char *value, const struct stat *st,
+        time_t *expiration, uint64_t *hash, const char **names)
+{
+    long long exp, mtime, size;
+    unsigned long long h, dev, ino;
+    int n = 0;
+    if (sscanf(value, "%lld %llx %llu %llu %lld %lld %n", &exp, &h,
+                &dev, &ino, &mtime, &size, &n) != 6 ||
+            dev != (unsigned long long)st->st_dev ||
+            ino != (unsigned long long)st->st_ino ||
+            mtime != (long long)st->st_mtime ||
+            size != (long long)st->st_size)
+    {
+        return false;
+    }
+    *expiration = exp;
+    if (hash)
+    {
+        *hash = h;
+    }
+    if (names)
+    {
+        *names = n > 0 && value[n] ? value + n : NULL;
+    }
+    return true;
+}
+
+static bool certidx_lookup(const char *confdir, const char *certdir,
+        const struct stat *st, uint64_t hash, time_t *expiration)
+{
+    bool found = false;
+    char *idxfile = NULL;
+    if (asprintf(&idxfile, "%s/" CERTIDX_FILE, confdir) < 0)
+    {
+        warnx("certidx_lookup: asprintf failed");
+        return false;
+    }
+    char *value = state_read(idxfile, certdir);
+    if (value)
+    {
+        uint64_t h;
+        found = certidx_parse(value, st, expiration, &h, NULL) && h == hash;
+        free(value);
+    }
+    free(idxfile);
+    return found;
+}
+
+bool cert_valid(const char *confdir, const char *certdir,
+        const char * const *names, int validity, time_t jitter)
+{
+    char *certfile = NULL;
+    char **certnames = NULL;
+    time_t expiration = 0;
+    bool valid = false;
+    struct stat st;
+    uint64_t hash = names_hash(names);
+
+    if (asprintf(&certfile, "%s/cert.pem", certdir) < 0)
+    {
+        warnx("cert_valid: asprintf failed");
+        return false;
+    }
+
+    if (stat(certfile, &st) < 0)
+    {
+        if (errno == ENOENT)
+        {
+            msg(1, "%s does not exist", certfile);
+        }
+        else
+        {
+            warn("failed to stat %s", certfile);
+        }
+        goto out;
+    }
+
+    if (certidx_lookup(confdir, certdir, &st, hash, &expiration))
+    {
+        msg(2, "%s found in " CERTIDX_FILE, certfile);
+    }
+    else
+    {
+        certnames = cert_file_info(certfile, &expiration, &st);
+        if (!certnames || !names_covered(certnames, names, certfile))
+        {
+            goto out;
+        }
+        certidx_store(confdir, certdir, &st, expiration, hash, names);
+    }
+
+    time_t left = expiration - time(NULL);
+    msg(1, "%s expires in %d days", certfile, (int)(left/(24*3600)));
+    if (jitter)
+    {
+        msg(2, "renewing %s %lld seconds early", certfile, (long long)jitter);
+    }
+    if (left < (time_t)validity*24*3600 + jitter)
+    {
+        msg(1, "%s is due for renewal", certfile);
+        goto out;
+    }
+    valid = true;
+out:
+    names_free(certnames);
+    free(certfile);
+    return valid;
+}
+
+bool certidx_update(const char *confdir, const char *certdir,
+        const char * const *names)
+{
+    char *certfile = NULL;
+    char **certnames = NULL;
+    time_t expiration = 0;
+    bool success = false;
+    struct stat st;
+
+    if (asprintf(&certfile, "%s/cert.pem", certdir) < 0)
+    {
+        warnx("certidx_update: asprintf failed");
+        return false;
+    }
+    certnames = cert_file_info(certfile, &expiration, &st);
+    if (certnames && names_covered(certnames, names, certfile))
+    {
+        certidx_store(confdir, certdir, &st, expiration, names_hash(names),
+                names);
+        success = true;
+    }
+    names_free(certnames);
+    free(certfile);
+    return success;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CERTIDX_H__
+#define __CERTIDX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "state.h"
+
+/*
+ * Expiry index kept in CONFDIR/expiry.idx, one record per certificate
+ * directory with the inode/mtime/size of its cert.pem, the notAfter time,
+ * a hash of the set of names known to be covered and the names themselves.
+ * Lookups only need a stat() of cert.pem, X.509 parsing happens when the
+ * file has changed. New records are appended, the scan and the daemon
+ * rewrite the index through certidx_compact() when it has grown too much.
+ *
+ * Renewals can be spread over a window of hours before the usual validity
+ * threshold: cert_jitter() derives a stable offset from the names of a
+ * certificate and a hash of the account key thumbprint, so that every run
+ * agrees on when a certificate is due while hosts with their own accounts
+ * drift apart without coordinating. The thumbprint is public and cached in
+ * CONFDIR/account.idx whenever the account key is loaded, so that checks
+ * from cron never read the private key.
+ */
+#define CERTIDX_FILE "expiry.idx"
+#define ACCOUNT_FILE "account.idx"
+#define ACCOUNT_KEY "thumbprint"
+
+uint64_t names_hash(const char * const *names);
+bool names_equal(const char * const *a, const char * const *b);
+char *names_join(const char * const *names);
+char **names_split(const char *names);
+uint64_t account_hash(const char *confdir);
+uint64_t account_cache(const char *confdir, const char *thumbprint);
+time_t cert_jitter(const char * const *names, uint64_t account, int hours);
+bool certidx_parse(const char *value, const struct stat *st,
+        time_t *expiration, uint64_t *hash, const char **names);
+char **cert_file_info(const char *certfile, time_t *expiration,
+        struct stat *st);
+bool cert_valid(const char *confdir, const char *certdir,
+        const char * const *names, int validity, time_t jitter);
+void certidx_compact(const state_t *idx);
+bool certidx_update(const char *confdir, const char *certdir,
+        const char * const *names);
+
+#endif
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -49,6 +50,7 @@
 #include <openssl/engine.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/opensslv.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
@@ -186,15 +188,27 @@ bool crypto_init(void)
 #endif
     mbedtls_entropy_init(&entropy);
     mbedtls_ctr_drbg_init(&ctr_drbg);
-    int r = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func,
-            &entropy, NULL, 0);
-    if (r)
+    return true;
+}
+
+// Seeding gathers entropy, which is only worth doing when a key is
+// generated or something is signed, so it is deferred to the first use
+static int ctr_drbg_random(void *p_rng, unsigned char *output, size_t len)
+{
+    static bool seeded = false;
+    if (!seeded)
     {
-        warnx("crypto_init: mbedtls_ctr_dbg_seed failed: %s",
-                _mbedtls_strerror(r));
-        return false;
+        int r = mbedtls_ctr_drbg_seed(p_rng, mbedtls_entropy_func,
+                &entropy, NULL, 0);
+        if (r)
+        {
+            warnx("ctr_drbg_random: mbedtls_ctr_dbg_seed failed: %s",
+                    _mbedtls_strerror(r));
+            return r;
+        }
+        seeded = true;
     }
-    return true;
+    return mbedtls_ctr_drbg_random(p_rng, output, len);
 }
 
 void crypto_deinit(void)
@@ -319,6 +333,170 @@ out:
     return encoded_hash;
 }
 
+bool key_auth_sha256_batch(size_t n, const char * const *tokens,
+        const char *thumbprint, char (*key_auths)[KEY_AUTH_SHA256_LEN])
+{
+    bool success = false;
+    unsigned char hash[32];
+    size_t tlen = strlen(thumbprint);
+#if defined(USE_GNUTLS)
+    gnutls_hash_hd_t ctx = NULL;
+    int r = gnutls_hash_init(&ctx, GNUTLS_DIG_SHA256);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("key_auth_sha256_batch: gnutls_hash_init failed: %s",
+                gnutls_strerror(r));
+        ctx = NULL;
+        goto out;
+    }
+#elif defined(USE_OPENSSL)
+    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+    if (!ctx)
+    {
+        openssl_error("key_auth_sha256_batch");
+        goto out;
+    }
+#elif defined(USE_MBEDTLS)
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init(&ctx);
+    int r = mbedtls_md_setup(&ctx,
+            mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    if (r)
+    {
+        warnx("key_auth_sha256_batch: mbedtls_md_setup failed: %s",
+                _mbedtls_strerror(r));
+        goto out;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+    {
+#if defined(USE_GNUTLS)
+        // gnutls_hash_output also resets the context for the next token
+        if (gnutls_hash(ctx, tokens[i], strlen(tokens[i])) ||
+                gnutls_hash(ctx, ".", 1) ||
+                gnutls_hash(ctx, thumbprint, tlen))
+        {
+            warnx("key_auth_sha256_batch: gnutls_hash failed");
+            goto out;
+        }
+        gnutls_hash_output(ctx, hash);
+#elif defined(USE_OPENSSL)
+        if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) ||
+                !EVP_DigestUpdate(ctx, tokens[i], strlen(tokens[i])) ||
+                !EVP_DigestUpdate(ctx, ".", 1) ||
+                !EVP_DigestUpdate(ctx, thumbprint, tlen) ||
+                !EVP_DigestFinal_ex(ctx, hash, NULL))
+        {
+            openssl_error("key_auth_sha256_batch");
+            goto out;
+        }
+#elif defined(USE_MBEDTLS)
+        if ((r = mbedtls_md_starts(&ctx)) ||
+                (r = mbedtls_md_update(&ctx,
+                    (const unsigned char *)tokens[i], strlen(tokens[i]))) ||
+                (r = mbedtls_md_update(&ctx,
+                    (const unsigned char *)".", 1)) ||
+                (r = mbedtls_md_update(&ctx,
+                    (const unsigned char *)thumbprint, tlen)) ||
+                (r = mbedtls_md_finish(&ctx, hash)))
+        {
+            warnx("key_auth_sha256_batch: mbedtls_md failed: %s",
+                    _mbedtls_strerror(r));
+            goto out;
+        }
+#endif
+        bin2base64(key_auths[i], KEY_AUTH_SHA256_LEN, hash, sizeof(hash),
+                base64_VARIANT_URLSAFE_NO_PADDING);
+    }
+    success = true;
+out:
+#if defined(USE_GNUTLS)
+    if (ctx) gnutls_hash_deinit(ctx, NULL);
+#elif defined(USE_OPENSSL)
+    if (ctx) EVP_MD_CTX_destroy(ctx);
+#elif defined(USE_MBEDTLS)
+    mbedtls_md_free(&ctx);
+#endif
+    return success;
+}
+
+bool key_auth_sha256(char *key_auth, const char *token,
+        const char *thumbprint)
+{
+    return key_auth_sha256_batch(1, &token, thumbprint,
+            (char (*)[KEY_AUTH_SHA256_LEN])key_auth);
+}
+
+// Computes the HMAC-SHA2 of data with the given key, returning the length
+// of the MAC stored in mac (which must hold bits/8 bytes) or 0 on failure
+size_t hmac_sha2(size_t bits, const void *key, size_t keylen,
+        const void *data, size_t len, unsigned char *mac)
+{
+#if defined(USE_GNUTLS)
+    gnutls_mac_algorithm_t type;
+#elif defined(USE_OPENSSL)
+    const EVP_MD *type;
+#elif defined(USE_MBEDTLS)
+    mbedtls_md_type_t type;
+#endif
+    switch (bits)
+    {
+        case 256:
+#if defined(USE_GNUTLS)
+            type = GNUTLS_MAC_SHA256;
+#elif defined(USE_OPENSSL)
+            type = EVP_sha256();
+#elif defined(USE_MBEDTLS)
+            type = MBEDTLS_MD_SHA256;
+#endif
+            break;
+
+        case 512:
+#if defined(USE_GNUTLS)
+            type = GNUTLS_MAC_SHA512;
+#elif defined(USE_OPENSSL)
+            type = EVP_sha512();
+#elif defined(USE_MBEDTLS)
+            type = MBEDTLS_MD_SHA512;
+#endif
+            break;
+
+        default:
+            warnx("hmac_sha2: invalid hash bit length");
+            return 0;
+    }
+
+#if defined(USE_GNUTLS)
+    int r = gnutls_hmac_fast(type, key, keylen, data, len, mac);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("hmac_sha2: gnutls_hmac_fast failed: %s", gnutls_strerror(r));
+        return 0;
+    }
+#elif defined(USE_OPENSSL)
+    if (!HMAC(type, key, keylen, data, len, mac, NULL))
+    {
+        openssl_error("hmac_sha2");
+        return 0;
+    }
+#elif defined(USE_MBEDTLS)
+    const mbedtls_md_info_t *mdi = mbedtls_md_info_from_type(type);
+    if (!mdi)
+    {
+        warnx("hmac_sha2: md_info not found");
+        return 0;
+    }
+    int r = mbedtls_md_hmac(mdi, key, keylen, data, len, mac);
+    if (r != 0)
+    {
+        warnx("hmac_sha2: mbedtls_md_hmac failed: %s",
+                _mbedtls_strerror(r));
+        return 0;
+    }
+#endif
+    return bits/8;
+}
+
 static char *bn2str(const unsigned char *data, size_t data_len, size_t pad_len)
 {
     char *ret = NULL;
@@ -1493,7 +1671,7 @@ char *jws_encode(const char *protected, const char *payload,
         goto out;
     }
     r = mbedtls_pk_sign(key, hash_type, hash, hash_size, signature,
-            &signature_size, mbedtls_ctr_drbg_random, &ctr_drbg);
+            &signature_size, ctr_drbg_random, &ctr_drbg);
     if (r != 0)
     {
         warnx("jws_encode: mbedtls_pk_sign failed: %s",
@@ -1727,7 +1905,7 @@ static bool key_gen(keytype_t type, int bits, const char *keyfile)
         case PK_RSA:
             msg(1, "generating new %d-bit RSA key", bits);
             r = mbedtls_rsa_gen_key(mbedtls_pk_rsa(key),
-                    mbedtls_ctr_drbg_random, &ctr_drbg, bits, 65537);
+                    ctr_drbg_random, &ctr_drbg, bits, 65537);
             if (r)
             {
                 warnx("key_gen: mbedtls_rsa_gen_key failed: %s",
@@ -1742,14 +1920,14 @@ static bool key_gen(keytype_t type, int bits, const char *keyfile)
                 case 256:
                     msg(1, "generating new %d-bit EC key", bits);
                     r = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1,
-                            mbedtls_pk_ec(key), mbedtls_ctr_drbg_random,
+                            mbedtls_pk_ec(key), ctr_drbg_random,
                             &ctr_drbg);
                     break;
 
                 case 384:
                     msg(1, "generating new %d-bit EC key", bits);
                     r = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP384R1,
-                            mbedtls_pk_ec(key), mbedtls_ctr_drbg_random,
+                            mbedtls_pk_ec(key), ctr_drbg_random,
                             &ctr_drbg);
                     break;
 
@@ -2549,7 +2727,7 @@ char *csr_gen(const char * const *names, bool status_req, privkey_t key)
     while (1)
     {
         r = mbedtls_x509write_csr_der(&csr, buf, buflen,
-                mbedtls_ctr_drbg_random, &ctr_drbg);
+                ctr_drbg_random, &ctr_drbg);
         if (r > 0)
         {
             break;
@@ -2743,184 +2921,229 @@ out:
     return crt;
 }
 
-bool cert_valid(const char *certdir, const char * const *names, int validity)
+static bool names_add(char ***names, size_t *count, const char *name,
+        size_t len)
+{
+    char **tmp = realloc(*names, (*count + 2) * sizeof(char *));
+    if (!tmp)
+    {
+        warn("names_add: realloc failed");
+        return false;
+    }
+    *names = tmp;
+    tmp[*count] = strndup(name, len);
+    if (!tmp[*count])
+    {
+        warn("names_add: strndup failed");
+        return false;
+    }
+    tmp[++(*count)] = NULL;
+    return true;
+}
+
+void names_free(char **names)
+{
+    if (!names) return;
+    for (char **n = names; *n; n++)
+    {
+        free(*n);
+    }
+    free(names);
+}
+
+char **cert_info(const void *data, size_t size, time_t *expiration)
 {
-    bool valid = false;
+    size_t count = 0;
+    bool success = false;
+    char **names = calloc(1, sizeof(char *));
+    if (!names)
+    {
+        warn("cert_info: calloc failed");
+        return NULL;
+    }
 #if defined(USE_GNUTLS)
-    gnutls_x509_crt_t crt = cert_load("%s/cert.pem", certdir);
-    if (!crt)
+    gnutls_x509_crt_t crt = NULL;
+    gnutls_datum_t d = {(unsigned char *)data, size};
+    int r = gnutls_x509_crt_init(&crt);
+    if (r != GNUTLS_E_SUCCESS)
     {
+        warnx("cert_info: gnutls_x509_crt_init: %s", gnutls_strerror(r));
+        crt = NULL;
         goto out;
     }
-
-    time_t expiration = gnutls_x509_crt_get_expiration_time(crt);
-    if (expiration == (time_t)-1)
+    r = gnutls_x509_crt_import(crt, &d, GNUTLS_X509_FMT_PEM);
+    if (r != GNUTLS_E_SUCCESS)
     {
-        warnx("cert_valid: gnutls_x509_crt_get_expiration_time failed");
+        warnx("cert_info: gnutls_x509_crt_import: %s", gnutls_strerror(r));
         goto out;
     }
-
-    int days_left = (expiration - time(NULL))/(24*3600);
-    msg(1, "%s/cert.pem expires in %d days", certdir, days_left);
-    if (days_left < validity)
+    *expiration = gnutls_x509_crt_get_expiration_time(crt);
+    if (*expiration == (time_t)-1)
     {
-        msg(1, "%s/cert.pem is due for renewal", certdir);
+        warnx("cert_info: gnutls_x509_crt_get_expiration_time failed");
         goto out;
     }
-
-    while (names && *names)
+    for (unsigned int i = 0; ; i++)
     {
-        if (!gnutls_x509_crt_check_hostname2(crt, *names,
-                    GNUTLS_VERIFY_DO_NOT_ALLOW_WILDCARDS))
+        char buf[0x100];
+        size_t len = sizeof(buf);
+        r = gnutls_x509_crt_get_subject_alt_name(crt, i, buf, &len, NULL);
+        if (r == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE)
+        {
+            break;
+        }
+        else if (r == GNUTLS_SAN_DNSNAME)
+        {
+            if (!names_add(&names, &count, buf, len))
+            {
+                goto out;
+            }
+        }
+        else if (r < 0 && r != GNUTLS_E_SHORT_MEMORY_BUFFER)
         {
-            msg(1, "%s/cert.pem does not include %s", certdir, *names);
+            warnx("cert_info: gnutls_x509_crt_get_subject_alt_name: %s",
+                    gnutls_strerror(r));
             goto out;
         }
-        names++;
     }
-    valid = true;
-out:
-    if (crt)
+    if (count == 0)
     {
-        gnutls_x509_crt_deinit(crt);
+        char buf[0x100];
+        size_t len = sizeof(buf);
+        r = gnutls_x509_crt_get_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME,
+                0, 0, buf, &len);
+        if (r == GNUTLS_E_SUCCESS && !names_add(&names, &count, buf, len))
+        {
+            goto out;
+        }
     }
 #elif defined(USE_OPENSSL)
-    GENERAL_NAMES* san = NULL;
-    X509 *crt = cert_load("%s/cert.pem", certdir);
-    if (!crt)
+    X509 *crt = NULL;
+    GENERAL_NAMES *san = NULL;
+    BIO *bio = BIO_new_mem_buf(data, size);
+    if (!bio)
     {
+        openssl_error("cert_info");
         goto out;
     }
-    int days_left, sec;
-    const ASN1_TIME *tm = X509_get0_notAfter(crt);
-    if (!tm || !ASN1_TIME_diff(&days_left, &sec, NULL, tm))
+    crt = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    if (!crt)
     {
-        warnx("cert_valid: invalid expiration time format in %s/cert.pem", certdir);
+        openssl_error("cert_info");
         goto out;
     }
-    msg(1, "%s/cert.pem expires in %d days", certdir, days_left);
-    if (days_left < validity)
+    int days, secs;
+    const ASN1_TIME *tm = X509_get0_notAfter(crt);
+    if (!tm || !ASN1_TIME_diff(&days, &secs, NULL, tm))
     {
-        msg(1, "%s/cert.pem is due for renewal", certdir);
+        warnx("cert_info: invalid expiration time format");
         goto out;
     }
-
+    *expiration = time(NULL) + (time_t)days*24*3600 + secs;
     san = X509_get_ext_d2i(crt, NID_subject_alt_name, NULL, NULL);
-    if (!san)
-    {
-        openssl_error("cert_valid");
-        goto out;
-    }
-
-    while (names && *names)
+    for (int i = 0; san && i < sk_GENERAL_NAME_num(san); i++)
     {
-        bool found = false;
-        int count = sk_GENERAL_NAME_num(san);
-        while (count-- && !found)
+        GENERAL_NAME *name = sk_GENERAL_NAME_value(san, i);
+        if (name && name->type == GEN_DNS)
         {
-            GENERAL_NAME* name = sk_GENERAL_NAME_value(san, count);
-            if (name && name->type == GEN_DNS)
+            unsigned char *s = NULL;
+            int len = ASN1_STRING_to_UTF8(&s, name->d.dNSName);
+            if (s)
             {
-                unsigned char *s = NULL;
-                int len = ASN1_STRING_to_UTF8(&s, name->d.dNSName);
-                if (s)
+                bool ok = len < 0 || (int)strlen((char *)s) != len ||
+                    names_add(&names, &count, (char *)s, len);
+                OPENSSL_free(s);
+                if (!ok)
                 {
-                    char *ss = (char *)s;
-                    if ((int)strlen(ss) == len && strcasecmp(ss, *names) == 0)
-                    {
-                        found = true;
-                    }
-                    OPENSSL_free(s);
+                    goto out;
                 }
             }
         }
-        if (!found)
+    }
+    if (count == 0)
+    {
+        char buf[0x100];
+        int len = X509_NAME_get_text_by_NID(X509_get_subject_name(crt),
+                NID_commonName, buf, sizeof(buf));
+        if (len > 0 && !names_add(&names, &count, buf, len))
         {
-            msg(1, "%s/cert.pem does not include %s", certdir, *names);
             goto out;
         }
-        names++;
     }
-
-    valid = true;
-out:
-    if (crt) X509_free(crt);
-    if (san) GENERAL_NAMES_free(san);
 #elif defined(USE_MBEDTLS)
-    mbedtls_x509_crt *crt = cert_load("%s/cert.pem", certdir);
-    if (!crt)
+    mbedtls_x509_crt crt;
+    mbedtls_x509_crt_init(&crt);
+    // PEM parsing requires a null terminated buffer
+    unsigned char *buf = calloc(1, size + 1);
+    if (!buf)
     {
+        warn("cert_info: calloc failed");
         goto out;
     }
-
-    struct tm texp =
-    {
-        .tm_sec = crt->valid_to.sec,
-        .tm_min = crt->valid_to.min,
-        .tm_hour = crt->valid_to.hour,
-        .tm_mday = crt->valid_to.day,
-        .tm_mon = crt->valid_to.mon - 1,
-        .tm_year = crt->valid_to.year - 1900,
-        .tm_isdst = -1
-    };
-
-    time_t expiration = mktime(&texp);
-    if (expiration == (time_t)-1)
+    memcpy(buf, data, size);
+    int r = mbedtls_x509_crt_parse(&crt, buf, size + 1);
+    free(buf);
+    if (r < 0)
     {
-        warnx("cert_valid: failed to determine expiration time");
+        warnx("cert_info: mbedtls_x509_crt_parse failed: %s",
+                _mbedtls_strerror(r));
         goto out;
     }
-
-    int days_left = (expiration - time(NULL))/(24*3600);
-    msg(1, "%s/cert.pem expires in %d days", certdir, days_left);
-    if (days_left < validity)
+    struct tm texp =
+    {
+        .tm_sec = crt.valid_to.sec,
+        .tm_min = crt.valid_to.min,
+        .tm_hour = crt.valid_to.hour,
+        .tm_mday = crt.valid_to.day,
+        .tm_mon = crt.valid_to.mon - 1,
+        .tm_year = crt.valid_to.year - 1900
+    };
+    *expiration = timegm(&texp);
+    if (*expiration == (time_t)-1)
     {
-        msg(1, "%s/cert.pem is due for renewal", certdir);
+        warnx("cert_info: failed to determine expiration time");
         goto out;
     }
-
-    while (names && *names)
+    if (crt.ext_types & MBEDTLS_X509_EXT_SUBJECT_ALT_NAME)
     {
-        const mbedtls_x509_name *name = NULL;
-        const mbedtls_x509_sequence *cur = NULL;
-
-        if (crt->ext_types & MBEDTLS_X509_EXT_SUBJECT_ALT_NAME)
-        {
-            for (cur = &crt->subject_alt_names; cur; cur = cur->next)
-            {
-                if (strncasecmp(*names, (const char *)cur->buf.p,
-                            strlen(*names)) == 0)
-                {
-                    break;
-                }
-            }
-        }
-        else for (name = &crt->subject; name != NULL; name = name->next)
+        for (const mbedtls_x509_sequence *cur = &crt.subject_alt_names;
+                cur; cur = cur->next)
         {
-            if (MBEDTLS_OID_CMP(MBEDTLS_OID_AT_CN, &name->oid) == 0 &&
-                    strncasecmp(*names, (const char *)name->val.p,
-                        strlen(*names)) == 0)
+            if (cur->buf.p && !names_add(&names, &count,
+                        (const char *)cur->buf.p, cur->buf.len))
             {
-                break;
+                goto out;
             }
         }
-        if (cur == NULL && name == NULL)
+    }
+    else for (const mbedtls_x509_name *name = &crt.subject; name;
+            name = name->next)
+    {
+        if (MBEDTLS_OID_CMP(MBEDTLS_OID_AT_CN, &name->oid) == 0 &&
+                !names_add(&names, &count, (const char *)name->val.p,
+                    name->val.len))
         {
-            msg(1, "%s/cert.pem does not include %s", certdir, *names);
             goto out;
         }
-        names++;
     }
-    valid = true;
-
+#endif
+    success = true;
 out:
-    if (crt)
+#if defined(USE_GNUTLS)
+    if (crt) gnutls_x509_crt_deinit(crt);
+#elif defined(USE_OPENSSL)
+    if (san) GENERAL_NAMES_free(san);
+    if (crt) X509_free(crt);
+    if (bio) BIO_free(bio);
+#elif defined(USE_MBEDTLS)
+    mbedtls_x509_crt_free(&crt);
+#endif
+    if (!success)
     {
-        mbedtls_x509_crt_free(crt);
-        free(crt);
+        names_free(names);
+        names = NULL;
     }
-#endif
-    return valid;
+    return names;
 }
 
 char *cert_der_base64url(const char *certfile)
@@ -3031,3 +3254,711 @@ out:
     free(certdata);
     return ret;
 }
+
+/*
+ * Returns the ACME renewal information identifier of a certificate (RFC
+ * 9773), the base64url encoded keyIdentifier of its authority key
+ * identifier extension and the DER encoded value of its serial number
+ * joined by a dot.
+ */
+char *cert_ari_id(const char *certfile)
+{
+    char *ret = NULL;
+    unsigned char aki[0x40], serial[0x40];
+    size_t aki_len = sizeof(aki), serial_len = sizeof(serial);
+    int r;
+#if defined(USE_GNUTLS)
+    gnutls_x509_crt_t crt = cert_load(certfile);
+    if (!crt)
+    {
+        warnx("cert_ari_id: cert_load failed");
+        return NULL;
+    }
+    r = gnutls_x509_crt_get_authority_key_id(crt, aki, &aki_len, NULL);
+    if (r < 0)
+    {
+        msg(1, "%s has no usable authority key identifier (%s)", certfile,
+                gnutls_strerror(r));
+        gnutls_x509_crt_deinit(crt);
+        return NULL;
+    }
+    r = gnutls_x509_crt_get_serial(crt, serial, &serial_len);
+    gnutls_x509_crt_deinit(crt);
+    if (r < 0)
+    {
+        warnx("cert_ari_id: gnutls_x509_crt_get_serial: %s",
+                gnutls_strerror(r));
+        return NULL;
+    }
+#elif defined(USE_OPENSSL)
+    X509 *crt = cert_load(certfile);
+    if (!crt)
+    {
+        warnx("cert_ari_id: cert_load failed");
+        return NULL;
+    }
+    AUTHORITY_KEYID *akid = X509_get_ext_d2i(crt,
+            NID_authority_key_identifier, NULL, NULL);
+    if (!akid || !akid->keyid ||
+            ASN1_STRING_length(akid->keyid) > (int)sizeof(aki))
+    {
+        msg(1, "%s has no usable authority key identifier", certfile);
+        AUTHORITY_KEYID_free(akid);
+        X509_free(crt);
+        return NULL;
+    }
+    aki_len = ASN1_STRING_length(akid->keyid);
+    memcpy(aki, ASN1_STRING_get0_data(akid->keyid), aki_len);
+    AUTHORITY_KEYID_free(akid);
+    // i2d gives the whole TLV, the identifier only wants the value
+    unsigned char *der = NULL;
+    r = i2d_ASN1_INTEGER(X509_get0_serialNumber(crt), &der);
+    X509_free(crt);
+    if (r < 3 || der[1] >= 0x80 || der[1] + 2 != r ||
+            (size_t)der[1] > sizeof(serial))
+    {
+        openssl_error("cert_ari_id");
+        OPENSSL_free(der);
+        return NULL;
+    }
+    serial_len = der[1];
+    memcpy(serial, der + 2, serial_len);
+    OPENSSL_free(der);
+#elif defined(USE_MBEDTLS)
+#if MBEDTLS_VERSION_NUMBER < 0x03050000
+    (void)certfile;
+    (void)r;
+    msg(1, "renewal information requires mbedTLS 3.5 or later");
+    return NULL;
+#else
+    mbedtls_x509_crt *crt = cert_load(certfile);
+    if (!crt)
+    {
+        warnx("cert_ari_id: cert_load failed");
+        return NULL;
+    }
+    const mbedtls_x509_buf *k = &crt->authority_key_id.keyIdentifier;
+    if (!k->p || k->len == 0 || k->len > sizeof(aki) ||
+            crt->serial.len > sizeof(serial))
+    {
+        msg(1, "%s has no usable authority key identifier", certfile);
+        mbedtls_x509_crt_free(crt);
+        free(crt);
+        return NULL;
+    }
+    aki_len = k->len;
+    memcpy(aki, k->p, aki_len);
+    serial_len = crt->serial.len;
+    memcpy(serial, crt->serial.p, serial_len);
+    mbedtls_x509_crt_free(crt);
+    free(crt);
+#endif
+#endif
+    char b1[base64_ENCODED_LEN(sizeof(aki),
+        base64_VARIANT_URLSAFE_NO_PADDING)];
+    char b2[base64_ENCODED_LEN(sizeof(serial),
+        base64_VARIANT_URLSAFE_NO_PADDING)];
+    if (!bin2base64(b1, sizeof(b1), aki, aki_len,
+                base64_VARIANT_URLSAFE_NO_PADDING) ||
+            !bin2base64(b2, sizeof(b2), serial, serial_len,
+                base64_VARIANT_URLSAFE_NO_PADDING))
+    {
+        warnx("cert_ari_id: bin2base64 failed");
+        return NULL;
+    }
+    if (asprintf(&ret, "%s.%s", b1, b2) < 0)
+    {
+        warnx("cert_ari_id: asprintf failed");
+        ret = NULL;
+    }
+    return ret;
+}
+
+/*
+ * tls-alpn-01 responder (RFC8737). A single ephemeral P-256 key signs a
+ * self-signed certificate per identifier carrying the critical
+ * acmeIdentifier extension; the certificate is chosen by SNI during
+ * handshakes that negotiate the acme-tls/1 protocol.
+ *
+ * Not available with mbedTLS, whose SNI callback may run before the
+ * ALPN extension has been parsed, so that the validation certificate
+ * could be served to clients that did not ask for acme-tls/1.
+ */
+#if !defined(USE_MBEDTLS)
+#define ALPN_PROTO "acme-tls/1"
+#define ALPN_OID "1.3.6.1.5.5.7.1.31"
+
+typedef struct alpn_cert
+{
+    char *ident;
+#if defined(USE_GNUTLS)
+    gnutls_pcert_st pcert;
+#elif defined(USE_OPENSSL)
+    X509 *crt;
+#endif
+} alpn_cert_t;
+
+struct tls_alpn
+{
+#if defined(USE_GNUTLS)
+    gnutls_privkey_t key;
+    gnutls_certificate_credentials_t cred;
+#elif defined(USE_OPENSSL)
+    EVP_PKEY *key;
+    SSL_CTX *ctx;
+#endif
+    alpn_cert_t **certs;
+    size_t count;
+};
+
+static alpn_cert_t *alpn_find(const tls_alpn_t *a, const char *name,
+        size_t len)
+{
+    for (size_t i = 0; i < a->count; i++)
+    {
+        if (strlen(a->certs[i]->ident) == len &&
+                strncasecmp(a->certs[i]->ident, name, len) == 0)
+        {
+            return a->certs[i];
+        }
+    }
+    return NULL;
+}
+
+// DER encoded acmeIdentifier extension value: an OCTET STRING holding
+// the SHA256 digest of the key authorization
+static bool alpn_ext_value(const char *auth, unsigned char value[34])
+{
+    size_t len = 0;
+    value[0] = 0x04;
+    value[1] = 0x20;
+    if (base642bin(value + 2, 32, auth, strlen(auth), NULL, &len, NULL,
+                base64_VARIANT_URLSAFE_NO_PADDING) != 0 || len != 32)
+    {
+        warnx("alpn_ext_value: invalid key authorization %s", auth);
+        return false;
+    }
+    return true;
+}
+
+static void alpn_cert_free(alpn_cert_t *c)
+{
+    if (!c)
+    {
+        return;
+    }
+#if defined(USE_GNUTLS)
+    gnutls_pcert_deinit(&c->pcert);
+#elif defined(USE_OPENSSL)
+    X509_free(c->crt);
+#endif
+    free(c->ident);
+    free(c);
+}
+
+#if defined(USE_GNUTLS)
+static int alpn_retrieve(gnutls_session_t session,
+        const gnutls_datum_t *req_ca_rdn, int nreqs,
+        const gnutls_pk_algorithm_t *pk_algos, int pk_algos_length,
+        gnutls_pcert_st **pcert, unsigned int *pcert_length,
+        gnutls_privkey_t *pkey)
+{
+    (void)req_ca_rdn;
+    (void)nreqs;
+    (void)pk_algos;
+    (void)pk_algos_length;
+    tls_alpn_t *a = gnutls_session_get_ptr(session);
+    gnutls_datum_t proto;
+    char name[256];
+    size_t len = sizeof(name);
+    unsigned int type;
+    // validation certificates are only for acme-tls/1 handshakes
+    if (gnutls_alpn_get_selected_protocol(session, &proto) !=
+            GNUTLS_E_SUCCESS)
+    {
+        msg(2, "tls-alpn-01: acme-tls/1 not negotiated");
+        return -1;
+    }
+    if (gnutls_server_name_get(session, name, &len, &type, 0) !=
+            GNUTLS_E_SUCCESS || type != GNUTLS_NAME_DNS)
+    {
+        return -1;
+    }
+    alpn_cert_t *c = alpn_find(a, name, strlen(name));
+    if (!c)
+    {
+        msg(2, "tls-alpn-01: no certificate for %s", name);
+        return -1;
+    }
+    *pcert = &c->pcert;
+    *pcert_length = 1;
+    *pkey = a->key;
+    return 0;
+}
+#elif defined(USE_OPENSSL)
+static int alpn_select(SSL *ssl, const unsigned char **out,
+        unsigned char *outlen, const unsigned char *in, unsigned int inlen,
+        void *arg)
+{
+    (void)ssl;
+    (void)arg;
+    size_t len = strlen(ALPN_PROTO);
+    for (unsigned int i = 0; i < inlen; i += 1 + in[i])
+    {
+        if (in[i] == len && i + 1 + len <= inlen &&
+                memcmp(in + i + 1, ALPN_PROTO, len) == 0)
+        {
+            *out = in + i + 1;
+            *outlen = in[i];
+            return SSL_TLSEXT_ERR_OK;
+        }
+    }
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+}
+
+static int alpn_cert_cb(SSL *ssl, void *arg)
+{
+    tls_alpn_t *a = arg;
+    const unsigned char *proto = NULL;
+    unsigned int len = 0;
+    // validation certificates are only for acme-tls/1 handshakes
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    if (len == 0)
+    {
+        msg(2, "tls-alpn-01: acme-tls/1 not negotiated");
+        return 0;
+    }
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    alpn_cert_t *c = name ? alpn_find(a, name, strlen(name)) : NULL;
+    if (!c)
+    {
+        msg(2, "tls-alpn-01: no certificate for %s", name ? name : "-");
+        return 0;
+    }
+    return SSL_use_certificate(ssl, c->crt) == 1 &&
+        SSL_use_PrivateKey(ssl, a->key) == 1;
+}
+#endif
+
+tls_alpn_t *tls_alpn_init(void)
+{
+    int r;
+    tls_alpn_t *a = calloc(1, sizeof(tls_alpn_t));
+    if (!a)
+    {
+        warn("tls_alpn_init: calloc failed");
+        return NULL;
+    }
+#if defined(USE_GNUTLS)
+    r = gnutls_privkey_init(&a->key);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_init: gnutls_privkey_init: %s", gnutls_strerror(r));
+        goto fail;
+    }
+    r = gnutls_privkey_generate(a->key, GNUTLS_PK_EC,
+            GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_init: gnutls_privkey_generate: %s",
+                gnutls_strerror(r));
+        goto fail;
+    }
+    r = gnutls_certificate_allocate_credentials(&a->cred);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_init: gnutls_certificate_allocate_credentials: %s",
+                gnutls_strerror(r));
+        goto fail;
+    }
+    gnutls_certificate_set_retrieve_function2(a->cred, alpn_retrieve);
+#elif defined(USE_OPENSSL)
+    EVP_PKEY_CTX *epc = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    r = epc && EVP_PKEY_keygen_init(epc) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(epc,
+                NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(epc, &a->key) == 1;
+    if (epc)
+    {
+        EVP_PKEY_CTX_free(epc);
+    }
+    if (!r)
+    {
+        openssl_error("tls_alpn_init");
+        goto fail;
+    }
+    a->ctx = SSL_CTX_new(TLS_server_method());
+    if (!a->ctx || !SSL_CTX_set_min_proto_version(a->ctx, TLS1_2_VERSION))
+    {
+        openssl_error("tls_alpn_init");
+        goto fail;
+    }
+    SSL_CTX_set_alpn_select_cb(a->ctx, alpn_select, NULL);
+    SSL_CTX_set_cert_cb(a->ctx, alpn_cert_cb, a);
+#endif
+    return a;
+
+fail:
+    tls_alpn_free(a);
+    return NULL;
+}
+
+bool tls_alpn_add(tls_alpn_t *a, const char *ident, const char *auth)
+{
+    bool success = false;
+    unsigned char value[34];
+    time_t now = time(NULL);
+    alpn_cert_t *c = NULL;
+    int r;
+#if defined(USE_GNUTLS)
+    gnutls_x509_crt_t crt = NULL;
+    gnutls_pubkey_t pubkey = NULL;
+    unsigned char serial[16];
+#elif defined(USE_OPENSSL)
+    X509_EXTENSION *ext = NULL;
+    ASN1_OBJECT *obj = NULL;
+    ASN1_OCTET_STRING *os = NULL;
+    char *san = NULL;
+#endif
+
+    if (!alpn_ext_value(auth, value))
+    {
+        goto out;
+    }
+    tls_alpn_del(a, ident);
+    c = calloc(1, sizeof(alpn_cert_t));
+    if (!c)
+    {
+        warn("tls_alpn_add: calloc failed");
+        goto out;
+    }
+    c->ident = strdup(ident);
+    if (!c->ident)
+    {
+        warn("tls_alpn_add: strdup failed");
+        goto out;
+    }
+
+#if defined(USE_GNUTLS)
+    r = gnutls_x509_crt_init(&crt);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: gnutls_x509_crt_init: %s", gnutls_strerror(r));
+        goto out;
+    }
+    r = gnutls_rnd(GNUTLS_RND_NONCE, serial, sizeof(serial));
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: gnutls_rnd: %s", gnutls_strerror(r));
+        goto out;
+    }
+    serial[0] &= 0x7f;
+    if ((r = gnutls_x509_crt_set_version(crt, 3)) != GNUTLS_E_SUCCESS ||
+            (r = gnutls_x509_crt_set_serial(crt, serial, sizeof(serial))) !=
+            GNUTLS_E_SUCCESS ||
+            (r = gnutls_x509_crt_set_activation_time(crt, now - 86400)) !=
+            GNUTLS_E_SUCCESS ||
+            (r = gnutls_x509_crt_set_expiration_time(crt, now + 7*86400)) !=
+            GNUTLS_E_SUCCESS ||
+            (r = gnutls_x509_crt_set_dn_by_oid(crt,
+                    GNUTLS_OID_X520_COMMON_NAME, 0, ident, strlen(ident))) !=
+            GNUTLS_E_SUCCESS ||
+            (r = gnutls_x509_crt_set_issuer_dn_by_oid(crt,
+                    GNUTLS_OID_X520_COMMON_NAME, 0, ident, strlen(ident))) !=
+            GNUTLS_E_SUCCESS ||
+            (r = gnutls_x509_crt_set_subject_alt_name(crt,
+                    GNUTLS_SAN_DNSNAME, ident, strlen(ident),
+                    GNUTLS_FSAN_SET)) != GNUTLS_E_SUCCESS ||
+            (r = gnutls_x509_crt_set_extension_by_oid(crt, ALPN_OID,
+                    value, sizeof(value), 1)) != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: failed to set certificate fields: %s",
+                gnutls_strerror(r));
+        goto out;
+    }
+    r = gnutls_pubkey_init(&pubkey);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: gnutls_pubkey_init: %s", gnutls_strerror(r));
+        goto out;
+    }
+    r = gnutls_pubkey_import_privkey(pubkey, a->key, 0, 0);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: gnutls_pubkey_import_privkey: %s",
+                gnutls_strerror(r));
+        goto out;
+    }
+    r = gnutls_x509_crt_set_pubkey(crt, pubkey);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: gnutls_x509_crt_set_pubkey: %s",
+                gnutls_strerror(r));
+        goto out;
+    }
+    r = gnutls_x509_crt_privkey_sign(crt, crt, a->key, GNUTLS_DIG_SHA256, 0);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: gnutls_x509_crt_privkey_sign: %s",
+                gnutls_strerror(r));
+        goto out;
+    }
+    r = gnutls_pcert_import_x509(&c->pcert, crt, 0);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_add: gnutls_pcert_import_x509: %s",
+                gnutls_strerror(r));
+        goto out;
+    }
+#elif defined(USE_OPENSSL)
+    c->crt = X509_new();
+    if (!c->crt)
+    {
+        openssl_error("tls_alpn_add");
+        goto out;
+    }
+    X509_NAME *name = X509_get_subject_name(c->crt);
+    if (asprintf(&san, "DNS:%s", ident) < 0)
+    {
+        warnx("tls_alpn_add: asprintf failed");
+        san = NULL;
+        goto out;
+    }
+    r = X509_set_version(c->crt, 2) &&
+        ASN1_INTEGER_set(X509_get_serialNumber(c->crt), now) &&
+        X509_gmtime_adj(X509_getm_notBefore(c->crt), -86400) &&
+        X509_gmtime_adj(X509_getm_notAfter(c->crt), 7*86400) &&
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                (const unsigned char *)ident, -1, -1, 0) &&
+        X509_set_issuer_name(c->crt, name) &&
+        X509_set_pubkey(c->crt, a->key);
+    if (!r)
+    {
+        openssl_error("tls_alpn_add");
+        goto out;
+    }
+    ext = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, san);
+    if (!ext || !X509_add_ext(c->crt, ext, -1))
+    {
+        openssl_error("tls_alpn_add");
+        goto out;
+    }
+    X509_EXTENSION_free(ext);
+    ext = NULL;
+    obj = OBJ_txt2obj(ALPN_OID, 1);
+    os = ASN1_OCTET_STRING_new();
+    if (!obj || !os || !ASN1_OCTET_STRING_set(os, value, sizeof(value)))
+    {
+        openssl_error("tls_alpn_add");
+        goto out;
+    }
+    ext = X509_EXTENSION_create_by_OBJ(NULL, obj, 1, os);
+    if (!ext || !X509_add_ext(c->crt, ext, -1) ||
+            !X509_sign(c->crt, a->key, EVP_sha256()))
+    {
+        openssl_error("tls_alpn_add");
+        goto out;
+    }
+#endif
+
+    alpn_cert_t **certs = realloc(a->certs,
+            (a->count + 1) * sizeof(alpn_cert_t *));
+    if (!certs)
+    {
+        warn("tls_alpn_add: realloc failed");
+        goto out;
+    }
+    a->certs = certs;
+    a->certs[a->count++] = c;
+    c = NULL;
+    msg(2, "serving tls-alpn-01 certificate for %s", ident);
+    success = true;
+
+out:
+    alpn_cert_free(c);
+#if defined(USE_GNUTLS)
+    gnutls_pubkey_deinit(pubkey);
+    gnutls_x509_crt_deinit(crt);
+#elif defined(USE_OPENSSL)
+    if (ext) X509_EXTENSION_free(ext);
+    if (obj) ASN1_OBJECT_free(obj);
+    if (os) ASN1_OCTET_STRING_free(os);
+    free(san);
+#endif
+    return success;
+}
+
+void tls_alpn_del(tls_alpn_t *a, const char *ident)
+{
+    for (size_t i = 0; i < a->count; i++)
+    {
+        if (strcasecmp(a->certs[i]->ident, ident) == 0)
+        {
+            alpn_cert_free(a->certs[i]);
+            a->certs[i] = a->certs[--a->count];
+            return;
+        }
+    }
+}
+
+void *tls_alpn_accept(tls_alpn_t *a, int fd)
+{
+#if defined(USE_GNUTLS)
+    gnutls_session_t session = NULL;
+    const gnutls_datum_t proto =
+    {
+        (unsigned char *)ALPN_PROTO, sizeof(ALPN_PROTO) - 1
+    };
+    int r = gnutls_init(&session, GNUTLS_SERVER | GNUTLS_NONBLOCK);
+    if (r != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_accept: gnutls_init: %s", gnutls_strerror(r));
+        return NULL;
+    }
+    if ((r = gnutls_set_default_priority(session)) != GNUTLS_E_SUCCESS ||
+            (r = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE,
+                    a->cred)) != GNUTLS_E_SUCCESS ||
+            (r = gnutls_alpn_set_protocols(session, &proto, 1,
+                    GNUTLS_ALPN_MANDATORY)) != GNUTLS_E_SUCCESS)
+    {
+        warnx("tls_alpn_accept: failed to set up session: %s",
+                gnutls_strerror(r));
+        gnutls_deinit(session);
+        return NULL;
+    }
+    gnutls_session_set_ptr(session, a);
+    gnutls_transport_set_int(session, fd);
+    return session;
+#elif defined(USE_OPENSSL)
+    SSL *ssl = SSL_new(a->ctx);
+    if (!ssl || !SSL_set_fd(ssl, fd))
+    {
+        openssl_error("tls_alpn_accept");
+        if (ssl) SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+#endif
+}
+
+int tls_alpn_handshake(void *session, bool *write)
+{
+#if defined(USE_GNUTLS)
+    int r = gnutls_handshake(session);
+    if (r == GNUTLS_E_SUCCESS)
+    {
+        return 1;
+    }
+    else if (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED)
+    {
+        *write = gnutls_record_get_direction(session) == 1;
+        return 0;
+    }
+    msg(2, "tls-alpn-01 handshake failed: %s", gnutls_strerror(r));
+    return -1;
+#elif defined(USE_OPENSSL)
+    int r = SSL_do_handshake(session);
+    if (r == 1)
+    {
+        return 1;
+    }
+    switch (SSL_get_error(session, r))
+    {
+        case SSL_ERROR_WANT_READ:
+            *write = false;
+            return 0;
+
+        case SSL_ERROR_WANT_WRITE:
+            *write = true;
+            return 0;
+
+        default:
+            msg(2, "tls-alpn-01 handshake failed: %s",
+                    ERR_reason_error_string(ERR_peek_error()));
+            ERR_clear_error();
+            return -1;
+    }
+#endif
+}
+
+void tls_alpn_close(void *session)
+{
+#if defined(USE_GNUTLS)
+    gnutls_bye(session, GNUTLS_SHUT_WR);
+    gnutls_deinit(session);
+#elif defined(USE_OPENSSL)
+    SSL_shutdown(session);
+    SSL_free(session);
+    ERR_clear_error();
+#endif
+}
+
+void tls_alpn_free(tls_alpn_t *a)
+{
+    if (!a)
+    {
+        return;
+    }
+    for (size_t i = 0; i < a->count; i++)
+    {
+        alpn_cert_free(a->certs[i]);
+    }
+    free(a->certs);
+#if defined(USE_GNUTLS)
+    if (a->cred)
+    {
+        gnutls_certificate_free_credentials(a->cred);
+    }
+    gnutls_privkey_deinit(a->key);
+#elif defined(USE_OPENSSL)
+    if (a->ctx) SSL_CTX_free(a->ctx);
+    if (a->key) EVP_PKEY_free(a->key);
+#endif
+    free(a);
+}
+#else
+tls_alpn_t *tls_alpn_init(void)
+{
+    warnx("tls-alpn-01 is not supported with mbedTLS");
+    return NULL;
+}
+
+bool tls_alpn_add(tls_alpn_t *a, const char *ident, const char *auth)
+{
+    (void)a;
+    (void)ident;
+    (void)auth;
+    return false;
+}
+
+void tls_alpn_del(tls_alpn_t *a, const char *ident)
+{
+    (void)a;
+    (void)ident;
+}
+
+void *tls_alpn_accept(tls_alpn_t *a, int fd)
+{
+    (void)a;
+    (void)fd;
+    return NULL;
+}
+
+int tls_alpn_handshake(void *session, bool *write)
+{
+    (void)session;
+    (void)write;
+    return -1;
+}
+
+void tls_alpn_close(void *session)
+{
+    (void)session;
+}
+
+void tls_alpn_free(tls_alpn_t *a)
+{
+    (void)a;
+}
+#endif
@@ -22,6 +22,9 @@
 #define __CRYPTO_H__
 
 #include <stdbool.h>
+#include <time.h>
+
+#include "base64.h"
 
 #if defined(USE_GNUTLS)
 #if defined(USE_OPENSSL) || defined(USE_MBEDTLS)
@@ -58,6 +61,13 @@ static inline void privkey_deinit(privkey_t key)
 #error either USE_GNUTLS or USE_MBEDTLS or USE_OPENSSL must be defined
 #endif
 
+/*
+ * Length (including the trailing \0) of the base64url encoded SHA256
+ * key authorization digest used by dns-01 and tls-alpn-01 challenges
+ */
+#define KEY_AUTH_SHA256_LEN \
+    base64_ENCODED_LEN(32, base64_VARIANT_URLSAFE_NO_PADDING)
+
 typedef enum
 {
     PK_NONE = 0,
@@ -68,6 +78,11 @@ typedef enum
 bool crypto_init(void);
 void crypto_deinit(void);
 char *sha2_base64url(size_t, const char *, ...);
+bool key_auth_sha256(char *, const char *, const char *);
+bool key_auth_sha256_batch(size_t, const char * const *, const char *,
+        char (*)[KEY_AUTH_SHA256_LEN]);
+size_t hmac_sha2(size_t, const void *, size_t, const void *, size_t,
+        unsigned char *);
 char *jws_jwk(privkey_t key, const char **, const char **);
 char *jws_protected_jwk(const char *, const char *, privkey_t);
 char *jws_protected_kid(const char *, const char *, const char *, privkey_t);
@@ -77,7 +92,18 @@ keytype_t key_type(privkey_t);
 privkey_t key_load(keytype_t, int bits, const char *, ...);
 char *csr_gen(const char * const *, bool, privkey_t);
 char *cert_der_base64url(const char *);
-bool cert_valid(const char *, const char * const *, int);
+char *cert_ari_id(const char *);
+char **cert_info(const void *, size_t, time_t *);
+void names_free(char **);
+
+typedef struct tls_alpn tls_alpn_t;
+tls_alpn_t *tls_alpn_init(void);
+bool tls_alpn_add(tls_alpn_t *, const char *, const char *);
+void tls_alpn_del(tls_alpn_t *, const char *);
+void *tls_alpn_accept(tls_alpn_t *, int);
+int tls_alpn_handshake(void *, bool *);
+void tls_alpn_close(void *);
+void tls_alpn_free(tls_alpn_t *);
 
 #endif
 
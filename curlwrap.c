@@ -21,6 +21,7 @@
 #include <err.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "curlwrap.h"
@@ -91,6 +92,34 @@ static size_t curl_wcb(void *ptr, size_t size, size_t n, void *userdata)
     return size * n;
 }
 
+// The handle is reused for all requests so that connections to the ACME
+// server are kept alive between them
+static CURL *g_curl = NULL;
+
+static CURL *curl_handle(const char *url, curldata_t *c)
+{
+    if (g_curl)
+    {
+        curl_easy_reset(g_curl);
+    }
+    else
+    {
+        g_curl = curl_easy_init();
+        if (!g_curl)
+        {
+            return NULL;
+        }
+    }
+    curl_easy_setopt(g_curl, CURLOPT_URL, url);
+    curl_easy_setopt(g_curl, CURLOPT_WRITEFUNCTION, curl_wcb);
+    curl_easy_setopt(g_curl, CURLOPT_WRITEDATA, c);
+    curl_easy_setopt(g_curl, CURLOPT_HEADERFUNCTION, curl_hcb);
+    curl_easy_setopt(g_curl, CURLOPT_HEADERDATA, c);
+    curl_easy_setopt(g_curl, CURLOPT_USERAGENT,
+            "uacme/" VERSION " (https://github.com/ndilieto/uacme)");
+    return g_curl;
+}
+
 curldata_t *curl_get(const char *url)
 {
     curldata_t *c = NULL;
@@ -98,26 +127,19 @@ curldata_t *curl_get(const char *url)
     {
         CURL *curl;
         CURLcode res;
-        curl = curl_easy_init();
-        if (!curl)
-        {
-            warnx("curl_get: curl_easy_init failed");
-            return NULL;
-        }
         c = curldata_calloc();
         if (!c)
         {
             warnx("curl_get: curldata_calloc failed");
-            curl_easy_cleanup(curl);
             return NULL;
         }
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_wcb);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, c);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_hcb);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, c);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT,
-                "uacme/" VERSION " (https://github.com/ndilieto/uacme)");
+        curl = curl_handle(url, c);
+        if (!curl)
+        {
+            warnx("curl_get: curl_easy_init failed");
+            curldata_free(c);
+            return NULL;
+        }
         res = curl_easy_perform(curl);
         if (res != CURLE_OK)
         {
@@ -132,7 +154,6 @@ curldata_t *curl_get(const char *url)
             curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
             c->code = code;
         }
-        curl_easy_cleanup(curl);
         if (c)
         {
             break;
@@ -154,30 +175,25 @@ curldata_t *curl_post(const char *url, const char *post)
         CURL *curl;
         CURLcode res;
         struct curl_slist *list = NULL;
-        curl = curl_easy_init();
-        if (!curl)
-        {
-            warnx("curl_post: curl_easy_init failed");
-            return NULL;
-        }
         c = curldata_calloc();
         if (!c)
         {
             warnx("curl_post: curldata_calloc failed");
-            curl_easy_cleanup(curl);
             return NULL;
         }
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_wcb);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, c);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_hcb);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, c);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT,
-                "uacme/" VERSION " (https://github.com/ndilieto/uacme)");
+        curl = curl_handle(url, c);
+        if (!curl)
+        {
+            warnx("curl_post: curl_easy_init failed");
+            curldata_free(c);
+            return NULL;
+        }
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post);
         list = curl_slist_append(list, "Content-Type: application/jose+json");
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
         res = curl_easy_perform(curl);
+        // the list must not outlive its use by the handle
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
         curl_slist_free_all(list);
         if (res != CURLE_OK)
         {
@@ -192,7 +208,6 @@ curldata_t *curl_post(const char *url, const char *post)
             curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
             c->code = code;
         }
-        curl_easy_cleanup(curl);
         if (c)
         {
             break;
@@ -205,3 +220,163 @@ curldata_t *curl_post(const char *url, const char *post)
     }
     return c;
 }
+
+// Fetches all the urls concurrently, calling idle at least every 50ms
+// while waiting if not NULL. data[i] is left NULL if urls[i] failed.
+bool curl_get_many(const char * const *urls, curldata_t **data,
+        size_t count, long timeout, void (*idle)(void *), void *arg)
+{
+    bool success = false;
+    int running = 0;
+    CURLMsg *m;
+    int left;
+    CURLM *multi = curl_multi_init();
+    CURL **easy = calloc(count, sizeof(CURL *));
+    CURLcode *res = calloc(count, sizeof(CURLcode));
+    for (size_t i = 0; i < count; i++)
+    {
+        data[i] = NULL;
+    }
+    if (!multi || !easy || !res)
+    {
+        warnx("curl_get_many: initialization failed");
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        data[i] = curldata_calloc();
+        easy[i] = curl_easy_init();
+        if (!data[i] || !easy[i])
+        {
+            warnx("curl_get_many: initialization failed");
+            goto out;
+        }
+        curl_easy_setopt(easy[i], CURLOPT_URL, urls[i]);
+        curl_easy_setopt(easy[i], CURLOPT_WRITEFUNCTION, curl_wcb);
+        curl_easy_setopt(easy[i], CURLOPT_WRITEDATA, data[i]);
+        curl_easy_setopt(easy[i], CURLOPT_HEADERFUNCTION, curl_hcb);
+        curl_easy_setopt(easy[i], CURLOPT_HEADERDATA, data[i]);
+        curl_easy_setopt(easy[i], CURLOPT_USERAGENT,
+                "uacme/" VERSION " (https://github.com/ndilieto/uacme)");
+        curl_easy_setopt(easy[i], CURLOPT_TIMEOUT, timeout);
+        // follow redirects like ACME servers do, without checking
+        // certificates
+        curl_easy_setopt(easy[i], CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(easy[i], CURLOPT_MAXREDIRS, 10L);
+#if LIBCURL_VERSION_NUM >= 0x075500
+        curl_easy_setopt(easy[i], CURLOPT_REDIR_PROTOCOLS_STR, "http,https");
+#else
+        curl_easy_setopt(easy[i], CURLOPT_REDIR_PROTOCOLS,
+                CURLPROTO_HTTP | CURLPROTO_HTTPS);
+#endif
+        curl_easy_setopt(easy[i], CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(easy[i], CURLOPT_SSL_VERIFYHOST, 0L);
+        if (curl_multi_add_handle(multi, easy[i]) != CURLM_OK)
+        {
+            warnx("curl_get_many: curl_multi_add_handle failed");
+            curl_easy_cleanup(easy[i]);
+            easy[i] = NULL;
+            goto out;
+        }
+    }
+    do
+    {
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc == CURLM_OK && running)
+        {
+            mc = curl_multi_wait(multi, NULL, 0, idle ? 50 : 1000, NULL);
+        }
+        if (mc != CURLM_OK)
+        {
+            warnx("curl_get_many: %s", curl_multi_strerror(mc));
+            goto out;
+        }
+        if (idle)
+        {
+            idle(arg);
+        }
+    } while (running);
+    for (size_t i = 0; i < count; i++)
+    {
+        res[i] = CURLE_GOT_NOTHING;
+    }
+    while ((m = curl_multi_info_read(multi, &left)))
+    {
+        for (size_t i = 0; m->msg == CURLMSG_DONE && i < count; i++)
+        {
+            if (m->easy_handle == easy[i])
+            {
+                res[i] = m->data.result;
+            }
+        }
+    }
+    success = true;
+
+out:
+    for (size_t i = 0; easy && i < count; i++)
+    {
+        if (!easy[i])
+        {
+            continue;
+        }
+        if (success)
+        {
+            if (res[i] == CURLE_OK)
+            {
+                long code = -1;
+                curl_easy_getinfo(easy[i], CURLINFO_RESPONSE_CODE, &code);
+                data[i]->code = code;
+            }
+            else
+            {
+                warnx("curl_get_many: GET %s failed: %s", urls[i],
+                        curl_easy_strerror(res[i]));
+                curldata_free(data[i]);
+                data[i] = NULL;
+            }
+        }
+        curl_multi_remove_handle(multi, easy[i]);
+        curl_easy_cleanup(easy[i]);
+    }
+    if (!success)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            curldata_free(data[i]);
+            data[i] = NULL;
+        }
+    }
+    free(easy);
+    free(res);
+    if (multi)
+    {
+        curl_multi_cleanup(multi);
+    }
+    return success;
+}
+
+void curl_fini(void)
+{
+    if (g_curl)
+    {
+        curl_easy_cleanup(g_curl);
+        g_curl = NULL;
+    }
+}
+
+time_t curl_retry_after(const char *value)
+{
+    // either a number of seconds or an HTTP date
+    if (!value)
+    {
+        return 0;
+    }
+    char *end;
+    long long n = strtoll(value, &end, 10);
+    if (end != value && *end == 0 && n >= 0)
+    {
+        return time(NULL) + n;
+    }
+    time_t t = curl_getdate(value, NULL);
+    return t < 0 ? 0 : t;
+}
@@ -20,6 +20,8 @@
 
 #ifndef __CURLWRAP_H__
 #define __CURLWRAP_H__
+#include <stdbool.h>
+#include <time.h>
 #include <curl/curl.h>
 
 typedef struct
@@ -35,5 +37,9 @@ curldata_t *curldata_calloc(void);
 void curldata_free(curldata_t *c);
 curldata_t *curl_get(const char *url);
 curldata_t *curl_post(const char *url, const char *post);
+bool curl_get_many(const char * const *urls, curldata_t **data,
+        size_t count, long timeout, void (*idle)(void *), void *arg);
+void curl_fini(void);
+time_t curl_retry_after(const char *value);
 
 #endif
@@ -0,0 +1,1776 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "crypto.h"
+#include "dns.h"
+#include "msg.h"
+#include "util.h"
+
+#define DNS_PORT "53"
+#define DNS_TIMEOUT 10
+#define DNS_TTL 60
+#define DNS_FUDGE 300
+#define DNS_MAX_KEYFILE 0x10000
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+#define DNS_MAX_RESOLVERS 3
+#define DNS_UDP_TIMEOUT 2
+#define DNS_PROBE_INTERVAL 2000
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_NS 2
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_TXT 16
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_TSIG 250
+#define DNS_CLASS_IN 1
+#define DNS_CLASS_NONE 254
+#define DNS_CLASS_ANY 255
+#define DNS_OPCODE_QUERY 0
+#define DNS_OPCODE_UPDATE 5
+
+typedef struct dns_buf
+{
+    unsigned char *data;
+    size_t len;
+    size_t alloc;
+    bool error;
+} dns_buf_t;
+
+typedef struct dns_zone
+{
+    char *name;
+    char *zone;
+} dns_zone_t;
+
+typedef struct dns_ns
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char host[NI_MAXHOST];
+} dns_ns_t;
+
+typedef struct dns_authority
+{
+    char *zone;
+    dns_ns_t *ns;
+    size_t nns;
+} dns_authority_t;
+
+typedef struct dns_target
+{
+    char *name;
+    const char *value;
+    size_t auth;
+    bool *seen;
+    uint16_t *ids;
+    bool done;
+} dns_target_t;
+
+struct dns_probe
+{
+    int fd[2];
+    uint16_t id;
+    long long next;
+    dns_ns_t resolvers[DNS_MAX_RESOLVERS];
+    size_t nresolvers;
+    dns_authority_t *auths;
+    size_t nauths;
+    dns_target_t *targets;
+    size_t count;
+};
+
+struct dns
+{
+    char *server;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char *keyname;
+    char *algorithm;
+    size_t bits;
+    unsigned char *secret;
+    size_t secretlen;
+    uint16_t id;
+    dns_zone_t *zones;
+    size_t nzones;
+};
+
+static const char *dns_rcode(int rcode)
+{
+    static const char *names[] =
+    {
+        "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+        "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE", NULL,
+        NULL, NULL, NULL, NULL, "BADSIG", "BADKEY", "BADTIME"
+    };
+    if (rcode >= 0 && rcode < (int)(sizeof(names)/sizeof(names[0])) &&
+            names[rcode])
+    {
+        return names[rcode];
+    }
+    return "unknown error";
+}
+
+static void buf_put(dns_buf_t *b, const void *data, size_t len)
+{
+    if (b->error)
+    {
+        return;
+    }
+    if (b->len + len > b->alloc)
+    {
+        size_t alloc = b->alloc ? b->alloc : 512;
+        while (alloc < b->len + len)
+        {
+            alloc *= 2;
+        }
+        unsigned char *tmp = realloc(b->data, alloc);
+        if (!tmp)
+        {
+            warn("buf_put: realloc failed");
+            b->error = true;
+            return;
+        }
+        b->data = tmp;
+        b->alloc = alloc;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void buf_u16(dns_buf_t *b, unsigned int v)
+{
+    unsigned char d[2] = {v >> 8, v};
+    buf_put(b, d, sizeof(d));
+}
+
+static void buf_u32(dns_buf_t *b, unsigned long v)
+{
+    unsigned char d[4] = {v >> 24, v >> 16, v >> 8, v};
+    buf_put(b, d, sizeof(d));
+}
+
+// Appends name in uncompressed wire format, lowercase as required for
+// TSIG computations
+static void buf_name(dns_buf_t *b, const char *name)
+{
+    size_t total = 1;
+    while (*name && strcmp(name, ".") != 0)
+    {
+        size_t len = strcspn(name, ".");
+        unsigned char label[64];
+        total += len + 1;
+        if (len == 0 || len > 63 || total > 255)
+        {
+            warnx("invalid domain name %s", name);
+            b->error = true;
+            return;
+        }
+        label[0] = len;
+        for (size_t i = 0; i < len; i++)
+        {
+            label[i + 1] = tolower((unsigned char)name[i]);
+        }
+        buf_put(b, label, len + 1);
+        name += len;
+        if (*name == '.')
+        {
+            name++;
+        }
+    }
+    buf_put(b, "", 1);
+}
+
+static void buf_header(dns_buf_t *b, uint16_t id, int opcode,
+        unsigned int qdcount, unsigned int ancount)
+{
+    buf_u16(b, id);
+    buf_u16(b, opcode << 11);
+    buf_u16(b, qdcount);
+    buf_u16(b, ancount);
+    buf_u16(b, 0);
+    buf_u16(b, 0);
+}
+
+static unsigned int get_u16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned long get_u32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Reads a possibly compressed name at *off into out as a lowercase dotted
+// string, advancing *off past it
+static bool dns_name(const unsigned char *msg, size_t len, size_t *off,
+        char *out, size_t outlen)
+{
+    size_t pos = *off, n = 0;
+    int jumps = 0;
+    bool jumped = false;
+    while (1)
+    {
+        if (pos >= len)
+        {
+            return false;
+        }
+        unsigned int l = msg[pos];
+        if ((l & 0xc0) == 0xc0)
+        {
+            if (pos + 1 >= len || ++jumps > 64)
+            {
+                return false;
+            }
+            if (!jumped)
+            {
+                *off = pos + 2;
+                jumped = true;
+            }
+            pos = ((l & 0x3f) << 8) | msg[pos + 1];
+            continue;
+        }
+        else if (l & 0xc0)
+        {
+            return false;
+        }
+        pos++;
+        if (l == 0)
+        {
+            break;
+        }
+        if (pos + l > len || n + l + 2 > outlen)
+        {
+            return false;
+        }
+        if (n > 0)
+        {
+            out[n++] = '.';
+        }
+        for (unsigned int i = 0; i < l; i++)
+        {
+            out[n++] = tolower(msg[pos + i]);
+        }
+        pos += l;
+    }
+    out[n] = 0;
+    if (!jumped)
+    {
+        *off = pos;
+    }
+    return true;
+}
+
+// Skips the fixed part of a resource record following its name, storing
+// its type and the offset/length of its data
+static bool dns_rr(const unsigned char *msg, size_t len, size_t *off,
+        unsigned int *type, size_t *rdata, size_t *rdlen)
+{
+    if (*off + 10 > len)
+    {
+        return false;
+    }
+    *type = get_u16(msg + *off);
+    *rdlen = get_u16(msg + *off + 8);
+    *rdata = *off + 10;
+    *off += 10 + *rdlen;
+    return *off <= len;
+}
+
+// Appends the TSIG variables (RFC8945 section 4.3.3) to b
+static void dns_tsig_vars(dns_buf_t *b, const char *keyname,
+        const char *algorithm, uint64_t now, unsigned int fudge,
+        unsigned int error, const unsigned char *other, size_t otherlen)
+{
+    buf_name(b, keyname);
+    buf_u16(b, DNS_CLASS_ANY);
+    buf_u32(b, 0);
+    buf_name(b, algorithm);
+    buf_u16(b, (now >> 32) & 0xffff);
+    buf_u32(b, now & 0xffffffff);
+    buf_u16(b, fudge);
+    buf_u16(b, error);
+    buf_u16(b, otherlen);
+    buf_put(b, other, otherlen);
+}
+
+// Signs the message in b, appending the TSIG record and storing its MAC
+// in mac, which is needed to verify the response
+static bool dns_sign(const dns_t *d, dns_buf_t *b, unsigned char *mac,
+        size_t *maclen)
+{
+    dns_buf_t in = {NULL, 0, 0, false};
+    uint64_t now = time(NULL);
+    buf_put(&in, b->data, b->len);
+    dns_tsig_vars(&in, d->keyname, d->algorithm, now, DNS_FUDGE, 0, NULL, 0);
+    *maclen = in.error ? 0 : hmac_sha2(d->bits, d->secret, d->secretlen,
+            in.data, in.len, mac);
+    free(in.data);
+    if (*maclen == 0)
+    {
+        return false;
+    }
+    buf_name(b, d->keyname);
+    buf_u16(b, DNS_TYPE_TSIG);
+    buf_u16(b, DNS_CLASS_ANY);
+    buf_u32(b, 0);
+    dns_buf_t rdata = {NULL, 0, 0, false};
+    buf_name(&rdata, d->algorithm);
+    buf_u16(&rdata, (now >> 32) & 0xffff);
+    buf_u32(&rdata, now & 0xffffffff);
+    buf_u16(&rdata, DNS_FUDGE);
+    buf_u16(&rdata, *maclen);
+    buf_put(&rdata, mac, *maclen);
+    buf_u16(&rdata, get_u16(b->data));
+    buf_u16(&rdata, 0);
+    buf_u16(&rdata, 0);
+    buf_u16(b, rdata.len);
+    buf_put(b, rdata.data, rdata.len);
+    free(rdata.data);
+    if (b->error || rdata.error)
+    {
+        return false;
+    }
+    // ARCOUNT
+    unsigned int arcount = get_u16(b->data + 10) + 1;
+    b->data[10] = arcount >> 8;
+    b->data[11] = arcount;
+    return true;
+}
+
+// Checks the TSIG record at the end of the response (starting at offset
+// tsig) against the MAC of the request
+static bool dns_verify(const dns_t *d, const unsigned char *msg, size_t len,
+        size_t tsig, const unsigned char *reqmac, size_t reqmaclen)
+{
+    bool success = false;
+    char keyname[256], algorithm[256];
+    size_t off = tsig, rdata, rdlen;
+    unsigned int type;
+    unsigned char mac[64];
+    dns_buf_t in = {NULL, 0, 0, false};
+
+    if (!dns_name(msg, len, &off, keyname, sizeof(keyname)) ||
+            !dns_rr(msg, len, &off, &type, &rdata, &rdlen) ||
+            type != DNS_TYPE_TSIG)
+    {
+        warnx("malformed TSIG record in response from %s", d->server);
+        return false;
+    }
+    off = rdata;
+    if (!dns_name(msg, len, &off, algorithm, sizeof(algorithm)) ||
+            off + 10 > rdata + rdlen)
+    {
+        warnx("malformed TSIG record in response from %s", d->server);
+        return false;
+    }
+    uint64_t signed_at = ((uint64_t)get_u16(msg + off) << 32) |
+        get_u32(msg + off + 2);
+    unsigned int fudge = get_u16(msg + off + 6);
+    size_t maclen = get_u16(msg + off + 8);
+    const unsigned char *rmac = msg + off + 10;
+    off += 10 + maclen;
+    if (off + 6 > rdata + rdlen)
+    {
+        warnx("malformed TSIG record in response from %s", d->server);
+        return false;
+    }
+    unsigned int orig_id = get_u16(msg + off);
+    unsigned int error = get_u16(msg + off + 2);
+    size_t otherlen = get_u16(msg + off + 4);
+    if (off + 6 + otherlen > rdata + rdlen)
+    {
+        warnx("malformed TSIG record in response from %s", d->server);
+        return false;
+    }
+    if (error)
+    {
+        warnx("TSIG error %s from %s", dns_rcode(error), d->server);
+        return false;
+    }
+    if (strcasecmp(keyname, d->keyname) != 0 ||
+            strcasecmp(algorithm, d->algorithm) != 0)
+    {
+        warnx("unexpected TSIG key %s in response from %s", keyname,
+                d->server);
+        return false;
+    }
+
+    buf_u16(&in, reqmaclen);
+    buf_put(&in, reqmac, reqmaclen);
+    buf_u16(&in, orig_id);
+    buf_put(&in, msg + 2, tsig - 2);
+    if (!in.error)
+    {
+        // the MAC covers the message as it was before TSIG was added
+        size_t ar = 2 + reqmaclen + 10;
+        unsigned int arcount = get_u16(in.data + ar) - 1;
+        in.data[ar] = arcount >> 8;
+        in.data[ar + 1] = arcount;
+    }
+    dns_tsig_vars(&in, keyname, algorithm, signed_at, fudge, error,
+            msg + off + 6, otherlen);
+    if (in.error || hmac_sha2(d->bits, d->secret, d->secretlen,
+                in.data, in.len, mac) != maclen)
+    {
+        warnx("invalid TSIG signature in response from %s", d->server);
+        goto out;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < maclen; i++)
+    {
+        diff |= mac[i] ^ rmac[i];
+    }
+    if (diff)
+    {
+        warnx("invalid TSIG signature in response from %s", d->server);
+        goto out;
+    }
+    uint64_t now = time(NULL);
+    if (now > signed_at + fudge || signed_at > now + fudge)
+    {
+        warnx("TSIG time out of range in response from %s", d->server);
+        goto out;
+    }
+    success = true;
+out:
+    free(in.data);
+    return success;
+}
+
+static int dns_connect(const char *server, const struct sockaddr *addr,
+        socklen_t addrlen)
+{
+    struct timeval tv = {DNS_TIMEOUT, 0};
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        warn("dns_connect: socket failed");
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+    {
+        warn("dns_connect: setsockopt failed");
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, addr, addrlen) < 0)
+    {
+        warn("failed to connect to %s", server);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool dns_io(int fd, void *data, size_t len, bool wr)
+{
+    unsigned char *p = data;
+    while (len > 0)
+    {
+        ssize_t r = wr ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (r == 0)
+        {
+            errno = ECONNRESET;
+            return false;
+        }
+        else if (r < 0)
+        {
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Sends the message in b and reads the response into *resp
+static bool dns_exchange(const char *server, int fd, const dns_buf_t *b,
+        unsigned char **resp, size_t *resplen)
+{
+    unsigned char len[2] = {b->len >> 8, b->len};
+    *resp = NULL;
+    if (!dns_io(fd, len, sizeof(len), true) ||
+            !dns_io(fd, b->data, b->len, true))
+    {
+        warn("failed to send to %s", server);
+        return false;
+    }
+    if (!dns_io(fd, len, sizeof(len), false))
+    {
+        warn("failed to receive from %s", server);
+        return false;
+    }
+    *resplen = get_u16(len);
+    *resp = malloc(*resplen ? *resplen : 1);
+    if (!*resp)
+    {
+        warn("dns_exchange: malloc failed");
+        return false;
+    }
+    if (!dns_io(fd, *resp, *resplen, false))
+    {
+        warn("failed to receive from %s", server);
+        free(*resp);
+        *resp = NULL;
+        return false;
+    }
+    if (*resplen < 12 || get_u16(*resp) != get_u16(b->data) ||
+            !((*resp)[2] & 0x80))
+    {
+        warnx("invalid response from %s", server);
+        free(*resp);
+        *resp = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Finds the zone name belongs to from the SOA record in the answer or
+// authority section of the response to a SOA query
+static char *dns_find_zone(dns_t *d, int fd, const char *name)
+{
+    char *zone = NULL;
+    char owner[256];
+    unsigned char *resp = NULL;
+    size_t len = 0;
+    dns_buf_t b = {NULL, 0, 0, false};
+
+    for (size_t i = 0; i < d->nzones; i++)
+    {
+        if (strcasecmp(d->zones[i].name, name) == 0)
+        {
+            return d->zones[i].zone;
+        }
+    }
+
+    buf_header(&b, ++d->id, DNS_OPCODE_QUERY, 1, 0);
+    buf_name(&b, name);
+    buf_u16(&b, DNS_TYPE_SOA);
+    buf_u16(&b, DNS_CLASS_IN);
+    if (b.error || !dns_exchange(d->server, fd, &b, &resp, &len))
+    {
+        goto out;
+    }
+    int rcode = resp[3] & 0x0f;
+    if (rcode != 0 && rcode != 3)
+    {
+        warnx("SOA query for %s failed: %s", name, dns_rcode(rcode));
+        goto out;
+    }
+    size_t off = 12;
+    unsigned int qdcount = get_u16(resp + 4);
+    unsigned int rrcount = get_u16(resp + 6) + get_u16(resp + 8);
+    for (unsigned int i = 0; i < qdcount; i++)
+    {
+        if (!dns_name(resp, len, &off, owner, sizeof(owner)) ||
+                (off += 4) > len)
+        {
+            warnx("malformed response from %s", d->server);
+            goto out;
+        }
+    }
+    for (unsigned int i = 0; i < rrcount; i++)
+    {
+        unsigned int type;
+        size_t rdata, rdlen;
+        if (!dns_name(resp, len, &off, owner, sizeof(owner)) ||
+                !dns_rr(resp, len, &off, &type, &rdata, &rdlen))
+        {
+            warnx("malformed response from %s", d->server);
+            goto out;
+        }
+        if (type == DNS_TYPE_SOA)
+        {
+            zone = strdup(owner);
+            break;
+        }
+    }
+    if (!zone)
+    {
+        warnx("failed to find the zone of %s on %s", name, d->server);
+        goto out;
+    }
+    dns_zone_t *z = realloc(d->zones, (d->nzones + 1) * sizeof(dns_zone_t));
+    if (!z || !(z[d->nzones].name = strdup(name)))
+    {
+        warn("dns_find_zone: allocation failed");
+        if (z)
+        {
+            d->zones = z;
+        }
+        free(zone);
+        zone = NULL;
+        goto out;
+    }
+    d->zones = z;
+    z[d->nzones++].zone = zone;
+    msg(2, "%s is in zone %s", name, zone);
+out:
+    free(resp);
+    free(b.data);
+    return zone;
+}
+
+// Sends one UPDATE message for the records of zone flagged in sel
+static bool dns_update_zone(dns_t *d, int fd, const char *zone, bool add,
+        const char * const *names, const char * const *values,
+        const bool *sel, size_t count)
+{
+    bool success = false;
+    unsigned char mac[64];
+    size_t maclen = 0;
+    unsigned char *resp = NULL;
+    size_t len = 0;
+    unsigned int n = 0;
+    dns_buf_t b = {NULL, 0, 0, false};
+
+    for (size_t i = 0; i < count; i++)
+    {
+        n += sel[i];
+    }
+    msg(1, "%s %u TXT record%s %s zone %s on %s", add ? "adding" : "removing",
+            n, n > 1 ? "s" : "", add ? "to" : "from", zone, d->server);
+    buf_header(&b, ++d->id, DNS_OPCODE_UPDATE, 1, 0);
+    // the update section count is at the position of the authority count
+    b.data[8] = n >> 8;
+    b.data[9] = n;
+    buf_name(&b, zone);
+    buf_u16(&b, DNS_TYPE_SOA);
+    buf_u16(&b, DNS_CLASS_IN);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!sel[i])
+        {
+            continue;
+        }
+        size_t vlen = strlen(values[i]);
+        if (vlen > 255)
+        {
+            warnx("TXT value too long for %s", names[i]);
+            goto out;
+        }
+        msg(2, "%s %s TXT \"%s\"", add ? "add" : "delete", names[i],
+                values[i]);
+        unsigned char l = vlen;
+        buf_name(&b, names[i]);
+        buf_u16(&b, DNS_TYPE_TXT);
+        // deleting an RR from an RRset is done with class NONE and TTL 0
+        buf_u16(&b, add ? DNS_CLASS_IN : DNS_CLASS_NONE);
+        buf_u32(&b, add ? DNS_TTL : 0);
+        buf_u16(&b, vlen + 1);
+        buf_put(&b, &l, 1);
+        buf_put(&b, values[i], vlen);
+    }
+    if (b.error || (d->keyname && !dns_sign(d, &b, mac, &maclen)))
+    {
+        goto out;
+    }
+    if (!dns_exchange(d->server, fd, &b, &resp, &len))
+    {
+        goto out;
+    }
+    int rcode = resp[3] & 0x0f;
+    size_t off = 12, tsig = 0;
+    unsigned int rrcount = get_u16(resp + 4) + get_u16(resp + 6) +
+        get_u16(resp + 8) + get_u16(resp + 10);
+    for (unsigned int i = 0; i < rrcount; i++)
+    {
+        char owner[256];
+        unsigned int type = 0;
+        size_t rdata, rdlen, start = off;
+        // the zone section has no TTL and data
+        if (!dns_name(resp, len, &off, owner, sizeof(owner)) ||
+                (i < get_u16(resp + 4) ? (off += 4) > len :
+                 !dns_rr(resp, len, &off, &type, &rdata, &rdlen)))
+        {
+            warnx("malformed response from %s", d->server);
+            goto out;
+        }
+        if (i == rrcount - 1 && i >= get_u16(resp + 4) &&
+                type == DNS_TYPE_TSIG)
+        {
+            tsig = start;
+        }
+    }
+    if (d->keyname && !tsig)
+    {
+        warnx("update of zone %s failed: %s (unsigned response)", zone,
+                dns_rcode(rcode));
+        goto out;
+    }
+    if (d->keyname && !dns_verify(d, resp, len, tsig, mac, maclen))
+    {
+        goto out;
+    }
+    if (rcode != 0)
+    {
+        warnx("update of zone %s failed: %s", zone, dns_rcode(rcode));
+        goto out;
+    }
+    success = true;
+out:
+    free(resp);
+    free(b.data);
+    return success;
+}
+
+bool dns_update(dns_t *d, bool add, const char * const *names,
+        const char * const *values, bool *done, size_t count)
+{
+    bool success = true;
+    const char **zones = calloc(count, sizeof(char *));
+    bool *sel = calloc(count, sizeof(bool));
+    int fd = -1;
+    if (!zones || !sel)
+    {
+        warn("dns_update: calloc failed");
+        success = false;
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        done[i] = false;
+    }
+    fd = dns_connect(d->server, (const struct sockaddr *)&d->addr,
+            d->addrlen);
+    if (fd < 0)
+    {
+        success = false;
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        zones[i] = dns_find_zone(d, fd, names[i]);
+        if (!zones[i])
+        {
+            success = false;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!zones[i] || done[i])
+        {
+            continue;
+        }
+        for (size_t j = i; j < count; j++)
+        {
+            sel[j] = zones[j] && strcasecmp(zones[j], zones[i]) == 0;
+        }
+        bool ok = dns_update_zone(d, fd, zones[i], add, names, values,
+                sel, count);
+        for (size_t j = i; j < count; j++)
+        {
+            if (sel[j])
+            {
+                // do not try this zone again
+                done[j] = ok;
+                zones[j] = ok ? zones[j] : NULL;
+                sel[j] = false;
+            }
+        }
+        success = success && ok;
+    }
+out:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(zones);
+    free(sel);
+    return success;
+}
+
+// Copies the next token of a BIND configuration file into tok: a quoted
+// string, a word or one of "{};", skipping comments
+static bool dns_token(const char **p, char *tok, size_t len)
+{
+    const char *s = *p;
+    bool quoted = false;
+    size_t n;
+    while (1)
+    {
+        while (isspace((unsigned char)*s))
+        {
+            s++;
+        }
+        if (*s == '#' || (s[0] == '/' && s[1] == '/'))
+        {
+            s += strcspn(s, "\n");
+        }
+        else if (s[0] == '/' && s[1] == '*')
+        {
+            const char *end = strstr(s + 2, "*/");
+            s = end ? end + 2 : s + strlen(s);
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (!*s)
+    {
+        return false;
+    }
+    if (*s == '"')
+    {
+        quoted = true;
+        n = strcspn(++s, "\"");
+    }
+    else if (strchr("{};", *s))
+    {
+        n = 1;
+    }
+    else
+    {
+        n = strcspn(s, " \t\r\n{};\"#");
+    }
+    if (n >= len)
+    {
+        return false;
+    }
+    memcpy(tok, s, n);
+    tok[n] = 0;
+    s += n;
+    if (quoted && *s == '"')
+    {
+        s++;
+    }
+    *p = s;
+    return true;
+}
+
+// Reads the first key statement of a BIND style key file:
+// key "NAME" { algorithm hmac-sha256; secret "BASE64"; };
+static bool dns_key(dns_t *d, const char *keyfile)
+{
+    bool success = false;
+    char tok[1024], name[256] = "", alg[32] = "", secret[1024] = "";
+    char *buf = NULL;
+    const char *p;
+    int depth = 0;
+    FILE *f = fopen(keyfile, "r");
+    if (!f)
+    {
+        warn("failed to open %s", keyfile);
+        return false;
+    }
+    buf = calloc(1, DNS_MAX_KEYFILE + 1);
+    if (!buf)
+    {
+        warn("dns_key: calloc failed");
+        goto out;
+    }
+    if (fread(buf, 1, DNS_MAX_KEYFILE, f) == DNS_MAX_KEYFILE || ferror(f))
+    {
+        warnx("failed to read %s", keyfile);
+        goto out;
+    }
+    p = buf;
+    while (dns_token(&p, tok, sizeof(tok)))
+    {
+        if (strcmp(tok, "{") == 0)
+        {
+            depth++;
+        }
+        else if (strcmp(tok, "}") == 0)
+        {
+            if (--depth == 0 && *name)
+            {
+                break;
+            }
+        }
+        else if (depth == 0 && strcmp(tok, "key") == 0 && !*name)
+        {
+            if (!dns_token(&p, name, sizeof(name)))
+            {
+                break;
+            }
+        }
+        else if (depth == 1 && *name && strcmp(tok, "algorithm") == 0)
+        {
+            if (!dns_token(&p, alg, sizeof(alg)))
+            {
+                break;
+            }
+        }
+        else if (depth == 1 && *name && strcmp(tok, "secret") == 0)
+        {
+            if (!dns_token(&p, secret, sizeof(secret)))
+            {
+                break;
+            }
+        }
+    }
+    if (!*name || !*alg || !*secret)
+    {
+        warnx("no valid key statement found in %s", keyfile);
+        goto out;
+    }
+    if (strcasecmp(alg, "hmac-sha256") == 0)
+    {
+        d->bits = 256;
+        d->algorithm = strdup("hmac-sha256");
+    }
+    else if (strcasecmp(alg, "hmac-sha512") == 0)
+    {
+        d->bits = 512;
+        d->algorithm = strdup("hmac-sha512");
+    }
+    else
+    {
+        warnx("unsupported TSIG algorithm %s in %s (hmac-sha256 and "
+                "hmac-sha512 are supported)", alg, keyfile);
+        goto out;
+    }
+    d->keyname = strdup(name);
+    d->secretlen = base64_ENCODED_LEN(strlen(secret),
+            base64_VARIANT_ORIGINAL);
+    d->secret = calloc(1, d->secretlen);
+    if (!d->algorithm || !d->keyname || !d->secret)
+    {
+        warn("dns_key: allocation failed");
+        goto out;
+    }
+    if (base642bin(d->secret, d->secretlen, secret, strlen(secret),
+                NULL, &d->secretlen, NULL, base64_VARIANT_ORIGINAL) ||
+            d->secretlen == 0)
+    {
+        warnx("invalid secret in %s", keyfile);
+        goto out;
+    }
+    msg(2, "using TSIG key %s (%s) from %s", d->keyname, d->algorithm,
+            keyfile);
+    success = true;
+out:
+    if (buf)
+    {
+        explicit_bzero(buf, DNS_MAX_KEYFILE + 1);
+        free(buf);
+    }
+    explicit_bzero(secret, sizeof(secret));
+    explicit_bzero(tok, sizeof(tok));
+    fclose(f);
+    return success;
+}
+
+dns_t *dns_init(const char *server, const char *keyfile)
+{
+    struct addrinfo hints, *ai = NULL;
+    char *host = NULL, *port = NULL;
+    dns_t *d = calloc(1, sizeof(dns_t));
+    if (!d)
+    {
+        warn("dns_init: calloc failed");
+        return NULL;
+    }
+    d->server = strdup(server);
+    host = strdup(server);
+    if (!d->server || !host)
+    {
+        warn("dns_init: strdup failed");
+        goto fail;
+    }
+    if (*host == '[')
+    {
+        char *end = strchr(host, ']');
+        if (!end || (end[1] && end[1] != ':'))
+        {
+            warnx("invalid server %s", server);
+            goto fail;
+        }
+        *end = 0;
+        port = end[1] ? end + 2 : NULL;
+        memmove(host, host + 1, strlen(host));
+    }
+    else
+    {
+        port = strchr(host, ':');
+        if (port && strchr(port + 1, ':'))
+        {
+            // bare IPv6 address
+            port = NULL;
+        }
+        else if (port)
+        {
+            *port++ = 0;
+        }
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int r = getaddrinfo(host, port && *port ? port : DNS_PORT, &hints, &ai);
+    if (r)
+    {
+        warnx("failed to resolve %s: %s", server, gai_strerror(r));
+        goto fail;
+    }
+    memcpy(&d->addr, ai->ai_addr, ai->ai_addrlen);
+    d->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    if (keyfile && !dns_key(d, keyfile))
+    {
+        goto fail;
+    }
+    d->id = time(NULL) ^ getpid();
+    free(host);
+    return d;
+fail:
+    free(host);
+    dns_free(d);
+    return NULL;
+}
+
+void dns_free(dns_t *d)
+{
+    if (!d)
+    {
+        return;
+    }
+    for (size_t i = 0; i < d->nzones; i++)
+    {
+        free(d->zones[i].name);
+        free(d->zones[i].zone);
+    }
+    free(d->zones);
+    if (d->secret)
+    {
+        explicit_bzero(d->secret, d->secretlen);
+        free(d->secret);
+    }
+    free(d->keyname);
+    free(d->algorithm);
+    free(d->server);
+    free(d);
+}
+
+static void dns_ns_set(dns_ns_t *ns, const struct sockaddr *sa,
+        socklen_t len)
+{
+    memset(ns, 0, sizeof(*ns));
+    memcpy(&ns->addr, sa, len);
+    ns->addrlen = len;
+    if (getnameinfo(sa, len, ns->host, sizeof(ns->host), NULL, 0,
+                NI_NUMERICHOST))
+    {
+        strcpy(ns->host, "?");
+    }
+}
+
+static bool dns_ns_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+    if (a->sa_family != b->sa_family)
+    {
+        return false;
+    }
+    if (a->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+        return a4->sin_port == b4->sin_port &&
+            a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+    return a6->sin6_port == b6->sin6_port &&
+        memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+}
+
+static bool dns_query_build(dns_buf_t *b, uint16_t id, const char *name,
+        unsigned int type, bool rd)
+{
+    buf_header(b, id, DNS_OPCODE_QUERY, 1, 0);
+    if (!b->error && rd)
+    {
+        b->data[2] |= 0x01;
+    }
+    buf_name(b, name);
+    buf_u16(b, type);
+    buf_u16(b, DNS_CLASS_IN);
+    return !b->error;
+}
+
+// Sends a query to ns and waits for the response, over UDP unless tcp is
+// set or the UDP response is truncated
+static bool dns_query(const dns_ns_t *ns, uint16_t id, const char *name,
+        unsigned int type, bool rd, bool tcp, unsigned char **resp,
+        size_t *len)
+{
+    bool success = false;
+    dns_buf_t b = {NULL, 0, 0, false};
+    struct timeval tv = {DNS_UDP_TIMEOUT, 0};
+    int fd = -1;
+
+    *resp = NULL;
+    if (!dns_query_build(&b, id, name, type, rd))
+    {
+        goto out;
+    }
+    if (!tcp)
+    {
+        fd = socket(ns->addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            warn("dns_query: socket failed");
+            goto out;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+                connect(fd, (const struct sockaddr *)&ns->addr,
+                    ns->addrlen) < 0)
+        {
+            warn("failed to connect to %s", ns->host);
+            goto out;
+        }
+        *resp = malloc(512);
+        if (!*resp)
+        {
+            warn("dns_query: malloc failed");
+            goto out;
+        }
+        for (int i = 0; i < 2 && !success; i++)
+        {
+            if (send(fd, b.data, b.len, 0) < 0)
+            {
+                continue;
+            }
+            ssize_t r;
+            while ((r = recv(fd, *resp, 512, 0)) >= 12)
+            {
+                if (get_u16(*resp) == id && ((*resp)[2] & 0x80))
+                {
+                    *len = r;
+                    success = true;
+                    break;
+                }
+            }
+        }
+        close(fd);
+        fd = -1;
+        if (!success)
+        {
+            msg(2, "no response from %s for %s", ns->host, name);
+            goto out;
+        }
+        if (!((*resp)[2] & 0x02))
+        {
+            goto out;
+        }
+        msg(2, "truncated response from %s, retrying with TCP", ns->host);
+        free(*resp);
+        *resp = NULL;
+        success = false;
+    }
+    fd = dns_connect(ns->host, (const struct sockaddr *)&ns->addr,
+            ns->addrlen);
+    if (fd >= 0 && dns_exchange(ns->host, fd, &b, resp, len))
+    {
+        success = true;
+    }
+out:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!success)
+    {
+        free(*resp);
+        *resp = NULL;
+    }
+    free(b.data);
+    return success;
+}
+
+// Reads the name servers from resolv.conf, like the C library does
+static void dns_resolvers(dns_probe_t *p)
+{
+    char line[256];
+    FILE *f = fopen(DNS_RESOLV_CONF, "r");
+    while (f && fgets(line, sizeof(line), f) &&
+            p->nresolvers < DNS_MAX_RESOLVERS)
+    {
+        char addr[INET6_ADDRSTRLEN + 16];
+        struct addrinfo hints, *ai = NULL;
+        if (sscanf(line, " nameserver %63s", addr) != 1)
+        {
+            continue;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST;
+        if (getaddrinfo(addr, DNS_PORT, &hints, &ai) == 0)
+        {
+            dns_ns_set(p->resolvers + p->nresolvers++, ai->ai_addr,
+                    ai->ai_addrlen);
+            freeaddrinfo(ai);
+        }
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+    if (p->nresolvers == 0)
+    {
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(53);
+        sin.sin_addr.s_addr = htonl(0x7f000001);
+        dns_ns_set(p->resolvers, (const struct sockaddr *)&sin,
+                sizeof(sin));
+        p->nresolvers = 1;
+    }
+}
+
+// Asks the recursive resolvers, returning the first response that is not
+// a server failure
+static bool dns_resolve(dns_probe_t *p, const char *name, unsigned int type,
+        unsigned char **resp, size_t *len)
+{
+    for (size_t i = 0; i < p->nresolvers; i++)
+    {
+        if (dns_query(p->resolvers + i, ++p->id, name, type, true, false,
+                    resp, len))
+        {
+            int rcode = (*resp)[3] & 0x0f;
+            if (rcode == 0 || rcode == 3)
+            {
+                return true;
+            }
+            msg(2, "query for %s on %s failed: %s", name,
+                    p->resolvers[i].host, dns_rcode(rcode));
+            free(*resp);
+            *resp = NULL;
+        }
+    }
+    return false;
+}
+
+// Positions *off at the first resource record, past the question section
+static bool dns_skip_question(const unsigned char *msg, size_t len,
+        size_t *off)
+{
+    char name[256];
+    *off = 12;
+    for (unsigned int i = 0; i < get_u16(msg + 4); i++)
+    {
+        if (!dns_name(msg, len, off, name, sizeof(name)) ||
+                (*off += 4) > len)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void dns_ns_add(dns_authority_t *auth, const struct sockaddr *sa,
+        socklen_t len)
+{
+    for (size_t i = 0; i < auth->nns; i++)
+    {
+        if (dns_ns_equal((const struct sockaddr *)&auth->ns[i].addr, sa))
+        {
+            return;
+        }
+    }
+    dns_ns_t *tmp = realloc(auth->ns, (auth->nns + 1) * sizeof(dns_ns_t));
+    if (!tmp)
+    {
+        warn("dns_ns_add: realloc failed");
+        return;
+    }
+    auth->ns = tmp;
+    dns_ns_set(auth->ns + auth->nns++, sa, len);
+}
+
+// Finds the addresses of the name servers of zone, from the glue records
+// in the response to the NS query if present
+static bool dns_zone_servers(dns_probe_t *p, dns_authority_t *auth)
+{
+    unsigned char *resp = NULL;
+    size_t len = 0, off, nnames = 0;
+    char names[16][256];
+    bool glued[16] = {false};
+    if (!dns_resolve(p, auth->zone, DNS_TYPE_NS, &resp, &len) ||
+            !dns_skip_question(resp, len, &off))
+    {
+        free(resp);
+        return false;
+    }
+    unsigned int an = get_u16(resp + 6);
+    unsigned int total = an + get_u16(resp + 8) + get_u16(resp + 10);
+    for (unsigned int i = 0; i < total; i++)
+    {
+        char owner[256];
+        unsigned int type;
+        size_t rdata, rdlen;
+        if (!dns_name(resp, len, &off, owner, sizeof(owner)) ||
+                !dns_rr(resp, len, &off, &type, &rdata, &rdlen))
+        {
+            break;
+        }
+        if (i < an && type == DNS_TYPE_NS && nnames < 16 &&
+                strcasecmp(owner, auth->zone) == 0)
+        {
+            dns_name(resp, len, &rdata, names[nnames++], sizeof(names[0]));
+        }
+        else if (i >= an && (type == DNS_TYPE_A || type == DNS_TYPE_AAAA))
+        {
+            for (size_t j = 0; j < nnames; j++)
+            {
+                if (strcasecmp(owner, names[j]) != 0)
+                {
+                    continue;
+                }
+                struct sockaddr_storage ss;
+                memset(&ss, 0, sizeof(ss));
+                if (type == DNS_TYPE_A && rdlen == 4)
+                {
+                    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+                    sin->sin_family = AF_INET;
+                    sin->sin_port = htons(53);
+                    memcpy(&sin->sin_addr, resp + rdata, 4);
+                    dns_ns_add(auth, (struct sockaddr *)sin, sizeof(*sin));
+                }
+                else if (type == DNS_TYPE_AAAA && rdlen == 16)
+                {
+                    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+                    sin6->sin6_family = AF_INET6;
+                    sin6->sin6_port = htons(53);
+                    memcpy(&sin6->sin6_addr, resp + rdata, 16);
+                    dns_ns_add(auth, (struct sockaddr *)sin6, sizeof(*sin6));
+                }
+                // other glue records for the same name still follow
+                glued[j] = true;
+            }
+        }
+    }
+    free(resp);
+    for (size_t j = 0; j < nnames; j++)
+    {
+        struct addrinfo hints, *ai = NULL;
+        if (glued[j])
+        {
+            continue;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        int r = getaddrinfo(names[j], DNS_PORT, &hints, &ai);
+        if (r)
+        {
+            warnx("failed to resolve %s: %s", names[j], gai_strerror(r));
+            continue;
+        }
+        for (struct addrinfo *i = ai; i; i = i->ai_next)
+        {
+            dns_ns_add(auth, i->ai_addr, i->ai_addrlen);
+        }
+        freeaddrinfo(ai);
+    }
+    return auth->nns > 0;
+}
+
+// Follows CNAMEs from name to the name the TXT record is published at,
+// and returns the index of the authority of its zone
+static bool dns_target_init(dns_probe_t *p, dns_target_t *t,
+        const char *name)
+{
+    unsigned char *resp = NULL;
+    size_t len = 0, off;
+    char cur[256], zone[256] = "";
+    if (strlen(name) >= sizeof(cur))
+    {
+        return false;
+    }
+    strcpy(cur, name);
+    if (!dns_resolve(p, name, DNS_TYPE_SOA, &resp, &len) ||
+            !dns_skip_question(resp, len, &off))
+    {
+        free(resp);
+        return false;
+    }
+    unsigned int total = get_u16(resp + 6) + get_u16(resp + 8);
+    for (unsigned int i = 0; i < total; i++)
+    {
+        char owner[256];
+        unsigned int type;
+        size_t rdata, rdlen;
+        if (!dns_name(resp, len, &off, owner, sizeof(owner)) ||
+                !dns_rr(resp, len, &off, &type, &rdata, &rdlen))
+        {
+            break;
+        }
+        if (type == DNS_TYPE_CNAME && strcasecmp(owner, cur) == 0)
+        {
+            dns_name(resp, len, &rdata, cur, sizeof(cur));
+        }
+        else if (type == DNS_TYPE_SOA)
+        {
+            strcpy(zone, owner);
+        }
+    }
+    free(resp);
+    if (!*zone)
+    {
+        return false;
+    }
+    if (strcasecmp(cur, name) != 0)
+    {
+        msg(2, "%s is an alias of %s", name, cur);
+    }
+    t->name = strdup(cur);
+    if (!t->name)
+    {
+        warn("dns_target_init: strdup failed");
+        return false;
+    }
+    for (t->auth = 0; t->auth < p->nauths; t->auth++)
+    {
+        if (strcasecmp(p->auths[t->auth].zone, zone) == 0)
+        {
+            break;
+        }
+    }
+    if (t->auth == p->nauths)
+    {
+        dns_authority_t *tmp = realloc(p->auths,
+                (p->nauths + 1) * sizeof(dns_authority_t));
+        if (!tmp)
+        {
+            warn("dns_target_init: realloc failed");
+            return false;
+        }
+        p->auths = tmp;
+        memset(p->auths + p->nauths, 0, sizeof(dns_authority_t));
+        p->auths[p->nauths].zone = strdup(zone);
+        if (!p->auths[p->nauths].zone)
+        {
+            warn("dns_target_init: strdup failed");
+            return false;
+        }
+        p->nauths++;
+        if (!dns_zone_servers(p, p->auths + t->auth))
+        {
+            return false;
+        }
+        for (size_t i = 0; i < p->auths[t->auth].nns; i++)
+        {
+            msg(2, "zone %s is served by %s", zone,
+                    p->auths[t->auth].ns[i].host);
+        }
+    }
+    if (p->auths[t->auth].nns == 0)
+    {
+        return false;
+    }
+    t->seen = calloc(p->auths[t->auth].nns, sizeof(bool));
+    t->ids = calloc(p->auths[t->auth].nns, sizeof(uint16_t));
+    if (!t->seen || !t->ids)
+    {
+        warn("dns_target_init: calloc failed");
+        return false;
+    }
+    return true;
+}
+
+// Whether the response has a TXT record at name with value
+static bool dns_txt_match(const unsigned char *msg, size_t len,
+        const char *name, const char *value)
+{
+    size_t off;
+    if ((msg[3] & 0x0f) != 0 || !dns_skip_question(msg, len, &off))
+    {
+        return false;
+    }
+    for (unsigned int i = 0; i < get_u16(msg + 6); i++)
+    {
+        char owner[256], txt[256];
+        unsigned int type;
+        size_t rdata, rdlen, n = 0;
+        if (!dns_name(msg, len, &off, owner, sizeof(owner)) ||
+                !dns_rr(msg, len, &off, &type, &rdata, &rdlen))
+        {
+            return false;
+        }
+        if (type != DNS_TYPE_TXT || strcasecmp(owner, name) != 0)
+        {
+            continue;
+        }
+        for (size_t j = rdata; j < rdata + rdlen; j += msg[j] + 1)
+        {
+            size_t l = msg[j];
+            if (j + 1 + l > rdata + rdlen || n + l >= sizeof(txt))
+            {
+                n = 0;
+                break;
+            }
+            memcpy(txt + n, msg + j + 1, l);
+            n += l;
+        }
+        txt[n] = 0;
+        if (n > 0 && strcmp(txt, value) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+dns_probe_t *dns_probe(const char * const *names, const char * const *values,
+        size_t count)
+{
+    dns_probe_t *p = calloc(1, sizeof(dns_probe_t));
+    if (!p)
+    {
+        warn("dns_probe: calloc failed");
+        return NULL;
+    }
+    p->fd[0] = p->fd[1] = -1;
+    p->id = util_now() ^ getpid();
+    p->targets = calloc(count, sizeof(dns_target_t));
+    if (!p->targets)
+    {
+        warn("dns_probe: calloc failed");
+        dns_probe_free(p);
+        return NULL;
+    }
+    p->count = count;
+    dns_resolvers(p);
+    for (size_t i = 0; i < count; i++)
+    {
+        dns_target_t *t = p->targets + i;
+        t->value = values[i];
+        if (!dns_target_init(p, t, names[i]))
+        {
+            warnx("failed to find the name servers of %s, not waiting "
+                    "for it", names[i]);
+            t->done = true;
+        }
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        p->fd[i] = socket(i ? AF_INET6 : AF_INET,
+                SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    return p;
+}
+
+// Sends a TXT query to every server that has not returned the expected
+// value yet
+static void dns_probe_send(dns_probe_t *p)
+{
+    for (size_t i = 0; i < p->count; i++)
+    {
+        dns_target_t *t = p->targets + i;
+        const dns_authority_t *auth = p->auths + t->auth;
+        for (size_t j = 0; !t->done && j < auth->nns; j++)
+        {
+            const dns_ns_t *ns = auth->ns + j;
+            int fd = p->fd[ns->addr.ss_family == AF_INET6];
+            dns_buf_t b = {NULL, 0, 0, false};
+            if (t->seen[j] || fd < 0)
+            {
+                continue;
+            }
+            if (++p->id == 0)
+            {
+                p->id++;
+            }
+            t->ids[j] = p->id;
+            if (dns_query_build(&b, t->ids[j], t->name, DNS_TYPE_TXT, false) &&
+                    sendto(fd, b.data, b.len, 0,
+                        (const struct sockaddr *)&ns->addr, ns->addrlen) < 0)
+            {
+                msg(2, "failed to send query to %s: %s", ns->host,
+                        strerror(errno));
+            }
+            free(b.data);
+        }
+    }
+}
+
+// Matches a response to its query, checking it against the expected value
+static void dns_probe_recv(dns_probe_t *p, const unsigned char *pkt,
+        size_t len, const struct sockaddr *from)
+{
+    if (len < 12 || !(pkt[2] & 0x80))
+    {
+        return;
+    }
+    uint16_t id = get_u16(pkt);
+    for (size_t i = 0; i < p->count; i++)
+    {
+        dns_target_t *t = p->targets + i;
+        const dns_authority_t *auth = p->auths + t->auth;
+        for (size_t j = 0; !t->done && j < auth->nns; j++)
+        {
+            const dns_ns_t *ns = auth->ns + j;
+            if (t->ids[j] != id || t->seen[j] ||
+                    !dns_ns_equal(from, (const struct sockaddr *)&ns->addr))
+            {
+                continue;
+            }
+            t->ids[j] = 0;
+            unsigned char *resp = NULL;
+            size_t rlen = 0;
+            if (pkt[2] & 0x02)
+            {
+                msg(2, "truncated response from %s, retrying with TCP",
+                        ns->host);
+                if (!dns_query(ns, id, t->name, DNS_TYPE_TXT, false, true,
+                            &resp, &rlen))
+                {
+                    return;
+                }
+            }
+            t->seen[j] = dns_txt_match(resp ? resp : pkt, resp ? rlen : len,
+                    t->name, t->value);
+            free(resp);
+            if (!t->seen[j])
+            {
+                msg(2, "%s not yet visible on %s", t->name, ns->host);
+                return;
+            }
+            msg(2, "%s visible on %s", t->name, ns->host);
+            t->done = true;
+            for (size_t k = 0; k < auth->nns; k++)
+            {
+                t->done = t->done && t->seen[k];
+            }
+            if (t->done)
+            {
+                msg(1, "%s visible on all %zu name servers of %s", t->name,
+                        auth->nns, auth->zone);
+            }
+            return;
+        }
+    }
+}
+
+size_t dns_probe_wait(dns_probe_t *p, int timeout, bool *done)
+{
+    long long end = util_now() + timeout;
+    size_t pending = 0, before = 0;
+    for (size_t i = 0; i < p->count; i++)
+    {
+        before += !p->targets[i].done;
+    }
+    pending = before;
+    while (pending == before && pending > 0)
+    {
+        long long now = util_now();
+        if (now >= p->next)
+        {
+            dns_probe_send(p);
+            p->next = now + DNS_PROBE_INTERVAL;
+        }
+        if (now >= end)
+        {
+            break;
+        }
+        struct pollfd fds[2] =
+        {
+            {p->fd[0], POLLIN, 0},
+            {p->fd[1], POLLIN, 0}
+        };
+        long long wait = (p->next < end ? p->next : end) - now;
+        if (poll(fds, 2, wait) < 0 && errno != EINTR)
+        {
+            warn("dns_probe_wait: poll failed");
+            break;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            unsigned char pkt[512];
+            struct sockaddr_storage from;
+            socklen_t fromlen = sizeof(from);
+            ssize_t r;
+            while (fds[i].fd >= 0 && (fds[i].revents & POLLIN) &&
+                    (r = recvfrom(fds[i].fd, pkt, sizeof(pkt), 0,
+                                  (struct sockaddr *)&from, &fromlen)) >= 0)
+            {
+                dns_probe_recv(p, pkt, r, (struct sockaddr *)&from);
+                fromlen = sizeof(from);
+            }
+        }
+        pending = 0;
+        for (size_t i = 0; i < p->count; i++)
+        {
+            pending += !p->targets[i].done;
+        }
+    }
+    for (size_t i = 0; i < p->count; i++)
+    {
+        done[i] = p->targets[i].done;
+    }
+    return pending;
+}
+
+void dns_probe_free(dns_probe_t *p)
+{
+    if (!p)
+    {
+        return;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (p->fd[i] >= 0)
+        {
+            close(p->fd[i]);
+        }
+    }
+    for (size_t i = 0; i < p->nauths; i++)
+    {
+        free(p->auths[i].zone);
+        free(p->auths[i].ns);
+    }
+    free(p->auths);
+    for (size_t i = 0; i < p->count; i++)
+    {
+        free(p->targets[i].name);
+        free(p->targets[i].seen);
+        free(p->targets[i].ids);
+    }
+    free(p->targets);
+    free(p);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * RFC2136 dynamic updates of TXT records, optionally signed with a RFC8945
+ * TSIG key read from a BIND style key file (as written by tsig-keygen or
+ * ddns-confgen). The zone of each record is found by asking the server for
+ * the SOA of its name, then the records of each zone are added or removed
+ * with a single UPDATE message. Messages are exchanged over TCP.
+ */
+typedef struct dns dns_t;
+
+dns_t *dns_init(const char *server, const char *keyfile);
+bool dns_update(dns_t *d, bool add, const char * const *names,
+        const char * const *values, bool *done, size_t count);
+void dns_free(dns_t *d);
+
+/*
+ * Checks that TXT records are visible on every authoritative server of
+ * their zone before the ACME server is asked to look them up. The servers
+ * are found by asking the recursive resolvers of resolv.conf for the NS
+ * records of the zone (following CNAMEs from each name first), then all
+ * of them are queried directly over UDP, falling back to TCP for truncated
+ * responses, every few seconds until they return the expected value.
+ *
+ * dns_probe_wait waits up to timeout ms for at least one more name to
+ * become visible everywhere, sets done for the names that are and
+ * returns how many are still pending.
+ */
+typedef struct dns_probe dns_probe_t;
+
+dns_probe_t *dns_probe(const char * const *names, const char * const *values,
+        size_t count);
+size_t dns_probe_wait(dns_probe_t *p, int timeout, bool *done);
+void dns_probe_free(dns_probe_t *p);
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "crypto.h"
+#include "dropin.h"
+#include "msg.h"
+
+struct dropin
+{
+    char *dir;
+    int fd;
+    time_t scanned;
+    bool rescan;
+    size_t len;
+    size_t off;
+    char buf[0x1000];
+};
+
+dropin_t *dropin_open(const char *dir)
+{
+    dropin_t *w = calloc(1, sizeof(*w));
+    if (!w || !(w->dir = strdup(dir)))
+    {
+        warn("dropin_open: allocation failed");
+        free(w);
+        return NULL;
+    }
+    w->fd = -1;
+    w->scanned = time(NULL);
+#if defined(__linux__)
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0 || inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE |
+                IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR) < 0)
+    {
+        warn("failed to watch %s, checking it every %d seconds", dir,
+                DROPIN_RESCAN);
+        if (w->fd >= 0)
+        {
+            close(w->fd);
+            w->fd = -1;
+        }
+    }
+    else
+    {
+        msg(1, "watching %s", dir);
+    }
+#endif
+    return w;
+}
+
+// Waits up to timeout milliseconds for changes, returning whether there
+// are any to collect with dropin_next()
+bool dropin_wait(dropin_t *w, int timeout)
+{
+    if (w->rescan || w->off < w->len)
+    {
+        return true;
+    }
+    if (w->fd < 0)
+    {
+        if (timeout > 0)
+        {
+            struct timespec ts = {timeout / 1000,
+                (timeout % 1000) * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+        if (time(NULL) - w->scanned >= DROPIN_RESCAN)
+        {
+            w->rescan = true;
+        }
+        return w->rescan;
+    }
+    struct pollfd pfd = {w->fd, POLLIN, 0};
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+// Returns the descriptor that becomes readable on changes, -1 without
+// inotify
+int dropin_fd(const dropin_t *w)
+{
+    return w->fd;
+}
+
+bool dropin_entry(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 0 && name[0] != '.' && name[len - 1] != '~';
+}
+
+// Collects the next change, with *entry set to the name of the entry
+// that changed or to NULL if the whole directory is to be checked again.
+// Returns false once there are no more.
+bool dropin_next(dropin_t *w, char **entry)
+{
+    *entry = NULL;
+    if (w->rescan)
+    {
+        w->rescan = false;
+        w->scanned = time(NULL);
+        w->len = w->off = 0;
+        return true;
+    }
+#if defined(__linux__)
+    while (w->fd >= 0)
+    {
+        if (w->off >= w->len)
+        {
+            ssize_t r = read(w->fd, w->buf, sizeof(w->buf));
+            if (r <= 0)
+            {
+                if (r < 0 && errno != EAGAIN && errno != EINTR)
+                {
+                    warn("failed to read events for %s", w->dir);
+                }
+                w->len = w->off = 0;
+                return false;
+            }
+            w->len = r;
+            w->off = 0;
+        }
+        struct inotify_event *ev = (struct inotify_event *)
+            (w->buf + w->off);
+        w->off += sizeof(*ev) + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW)
+        {
+            msg(1, "events for %s were lost, checking it again", w->dir);
+            w->len = w->off = 0;
+            return true;
+        }
+        if (ev->len == 0 || !dropin_entry(ev->name))
+        {
+            continue;
+        }
+        if (!(*entry = strdup(ev->name)))
+        {
+            warn("dropin_next: strdup failed");
+            continue;
+        }
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Returns the names an entry holds, or NULL if it does not exist, is not
+// a regular file or cannot be read
+char **dropin_read(const char *dir, const char *entry, struct stat *st)
+{
+    char *path = NULL, *buf = NULL, **names = NULL;
+    size_t n = 0;
+    int fd = -1;
+    if (asprintf(&path, "%s/%s", dir, entry) < 0)
+    {
+        path = NULL;
+        warnx("dropin_read: asprintf failed");
+        goto out;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+        {
+            warn("failed to open %s", path);
+        }
+        goto out;
+    }
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode) ||
+            st->st_size > DROPIN_MAX_SIZE)
+    {
+        warnx("%s is not a regular file of up to %d bytes", path,
+                DROPIN_MAX_SIZE);
+        goto out;
+    }
+    buf = calloc(1, st->st_size + 1);
+    if (!buf)
+    {
+        warn("dropin_read: calloc failed");
+        goto out;
+    }
+    ssize_t len = 0, r;
+    while (len < st->st_size &&
+            (r = read(fd, buf + len, st->st_size - len)) > 0)
+    {
+        len += r;
+    }
+    buf[len] = 0;
+    for (char *p = buf; *p; p++)
+    {
+        if (*p == '#')
+        {
+            while (*p && *p != '\n')
+            {
+                *p++ = ' ';
+            }
+            if (!*p)
+            {
+                break;
+            }
+        }
+        if (isspace((unsigned char)*p))
+        {
+            *p = ' ';
+        }
+    }
+    names = calloc(len / 2 + 2, sizeof(char *));
+    if (!names)
+    {
+        warn("dropin_read: calloc failed");
+        goto out;
+    }
+    for (char *p = buf, *tok; (tok = strsep(&p, " ")); )
+    {
+        if (*tok && !(names[n++] = strdup(tok)))
+        {
+            warn("dropin_read: strdup failed");
+            goto fail;
+        }
+    }
+    if (n == 0 && !(names[n++] = strdup(entry)))
+    {
+        warn("dropin_read: strdup failed");
+        goto fail;
+    }
+    goto out;
+fail:
+    names_free(names);
+    names = NULL;
+out:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(buf);
+    free(path);
+    return names;
+}
+
+void dropin_close(dropin_t *w)
+{
+    if (!w)
+    {
+        return;
+    }
+    if (w->fd >= 0)
+    {
+        close(w->fd);
+    }
+    free(w->dir);
+    free(w);
+}
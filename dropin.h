@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DROPIN_H__
+#define __DROPIN_H__
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#define DROPIN_RESCAN 60
+#define DROPIN_MAX_SIZE 0x10000
+
+/*
+ * Drop-in directory of certificate entries for the daemon. Every regular
+ * file whose name does not start with a dot or end with a tilde is an
+ * entry, holding the names of one certificate separated by blanks or
+ * newlines, the first one giving its DOMAIN, with # starting a comment.
+ * An empty entry stands for the certificate named after the file.
+ *
+ * Where inotify is available the directory is watched for entries being
+ * written, moved or deleted, and dropin_next() returns the name of every
+ * entry that changed so that only those are read again. Elsewhere, and
+ * when the kernel dropped events, it asks for the whole directory to be
+ * checked again instead, every DROPIN_RESCAN seconds without inotify.
+ */
+typedef struct dropin dropin_t;
+
+dropin_t *dropin_open(const char *dir);
+bool dropin_wait(dropin_t *w, int timeout);
+int dropin_fd(const dropin_t *w);
+bool dropin_next(dropin_t *w, char **entry);
+bool dropin_entry(const char *name);
+char **dropin_read(const char *dir, const char *entry, struct stat *st);
+void dropin_close(dropin_t *w);
+
+#endif
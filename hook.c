@@ -0,0 +1,1078 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hook.h"
+#include "msg.h"
+#include "state.h"
+#include "util.h"
+
+extern char **environ;
+
+static long long hook_deadline(const hook_t *h)
+{
+    return h->timeout > 0 ? util_now() + (long long)h->timeout*1000 : 0;
+}
+
+// Milliseconds left until deadline in the format expected by poll()
+static int hook_remaining(long long deadline)
+{
+    return deadline ? util_left(deadline) : -1;
+}
+
+static hook_req_t *hook_find(hook_t *h, int id)
+{
+    for (size_t i = 0; i < h->count; i++)
+    {
+        if (h->reqs[i].id == id)
+        {
+            return h->reqs + i;
+        }
+    }
+    return NULL;
+}
+
+static hook_req_t *hook_add(hook_t *h)
+{
+    if (h->count == h->alloc)
+    {
+        size_t alloc = h->alloc ? 2*h->alloc : 16;
+        hook_req_t *reqs = realloc(h->reqs, alloc * sizeof(hook_req_t));
+        if (!reqs)
+        {
+            warn("hook_add: realloc failed");
+            return NULL;
+        }
+        h->reqs = reqs;
+        h->alloc = alloc;
+    }
+    hook_req_t *r = h->reqs + h->count++;
+    memset(r, 0, sizeof(*r));
+    r->id = ++h->next_id;
+    r->deadline = hook_deadline(h);
+    return r;
+}
+
+static void hook_del(hook_t *h, hook_req_t *r)
+{
+    free(r->data);
+    *r = h->reqs[--h->count];
+}
+
+static size_t hook_outstanding(const hook_t *h)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < h->count; i++)
+    {
+        if (!h->reqs[i].done)
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+static bool hook_pipe(int p[2])
+{
+    if (pipe(p) < 0)
+    {
+        warn("hook_pipe: pipe failed");
+        return false;
+    }
+    if (fcntl(p[0], F_SETFD, FD_CLOEXEC) < 0 ||
+            fcntl(p[1], F_SETFD, FD_CLOEXEC) < 0)
+    {
+        warn("hook_pipe: fcntl failed");
+        close(p[0]);
+        close(p[1]);
+        return false;
+    }
+    return true;
+}
+
+// Runs the hook without duplicating this process (posix_spawn normally uses
+// vfork or clone semantics) in a process group of its own, so that the hook
+// and everything it started can be killed at once if it runs for too long.
+// Unless in and out are -1 they become the standard input/output of the hook.
+static pid_t hook_spawn(hook_t *h, char * const *argv, int in, int out)
+{
+    pid_t pid = -1;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t mask, def;
+    int e;
+
+    sigemptyset(&mask);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    if ((e = posix_spawn_file_actions_init(&fa)))
+    {
+        errno = e;
+        warn("hook_spawn: posix_spawn_file_actions_init failed");
+        return -1;
+    }
+    if ((e = posix_spawnattr_init(&attr)))
+    {
+        errno = e;
+        warn("hook_spawn: posix_spawnattr_init failed");
+        posix_spawn_file_actions_destroy(&fa);
+        return -1;
+    }
+    if ((in >= 0 &&
+                (e = posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO))) ||
+            (out >= 0 &&
+             (e = posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO))) ||
+            (e = posix_spawnattr_setpgroup(&attr, 0)) ||
+            (e = posix_spawnattr_setsigmask(&attr, &mask)) ||
+            (e = posix_spawnattr_setsigdefault(&attr, &def)) ||
+            (e = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                    POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF)))
+    {
+        errno = e;
+        warn("hook_spawn: failed to set up %s", h->prog);
+        goto out;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if ((e = posix_spawn(&pid, h->prog, &fa, &attr, argv, environ)))
+    {
+        errno = e;
+        warn("hook_spawn: failed to execute %s", h->prog);
+        pid = -1;
+    }
+out:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    return pid;
+}
+
+static int hook_exit_status(const hook_t *h, int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    warnx("%s terminated abnormally", h->prog);
+    return -1;
+}
+
+// Sleeps until a child process exits or the deadline (0 for none) has
+// expired. The caller blocks SIGCHLD beforehand, so that a child exiting
+// after its last waitpid() still ends the sleep.
+static void hook_sleep(long long deadline)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    int ms = hook_remaining(deadline);
+    if (ms < 0)
+    {
+        sigwaitinfo(&set, NULL);
+    }
+    else
+    {
+        struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+        sigtimedwait(&set, NULL, &ts);
+    }
+}
+
+static bool hook_block_sigchld(sigset_t *old)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &set, old) < 0)
+    {
+        warn("hook: sigprocmask failed");
+        return false;
+    }
+    return true;
+}
+
+// Checks whether pid has exited, waiting for it if block is set. Returns
+// 1 if it has, storing its exit status, 0 if it is still running and -1
+// on failure or if the deadline expired, in which case its process group
+// is killed.
+static int hook_waitpid(const hook_t *h, pid_t pid, long long deadline,
+        bool block, int *status)
+{
+    sigset_t old;
+    int ret = -1;
+    if (!hook_block_sigchld(&old))
+    {
+        return -1;
+    }
+    while (1)
+    {
+        pid_t r = waitpid(pid, status, block && !deadline ? 0 : WNOHANG);
+        if (r == pid)
+        {
+            ret = 1;
+            break;
+        }
+        else if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("hook_waitpid: waitpid failed");
+            break;
+        }
+        if (deadline && util_now() >= deadline)
+        {
+            warnx("%s timed out, killing it", h->prog);
+            kill(-pid, SIGKILL);
+            while (waitpid(pid, status, 0) < 0 && errno == EINTR);
+            break;
+        }
+        if (!block)
+        {
+            ret = 0;
+            break;
+        }
+        hook_sleep(deadline);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return ret;
+}
+
+// Waits until one of the running hook processes exits, or the earliest
+// deadline among them expires
+static void hook_collect(hook_t *h)
+{
+    sigset_t old;
+    if (!hook_block_sigchld(&old))
+    {
+        return;
+    }
+    while (1)
+    {
+        long long deadline = 0;
+        for (size_t i = 0; i < h->count; i++)
+        {
+            hook_req_t *r = h->reqs + i;
+            int status;
+            if (r->done || r->pid <= 0)
+            {
+                continue;
+            }
+            int ret = hook_waitpid(h, r->pid, r->deadline, false, &status);
+            if (ret != 0)
+            {
+                r->status = ret > 0 ? hook_exit_status(h, status) : -1;
+                r->done = true;
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                return;
+            }
+            if (r->deadline && (!deadline || r->deadline < deadline))
+            {
+                deadline = r->deadline;
+            }
+        }
+        hook_sleep(deadline);
+    }
+}
+
+// Kills the persistent hook, failing all its outstanding requests. It is
+// started again by the next request.
+static void hook_stop(hook_t *h)
+{
+    if (h->pid <= 0)
+    {
+        return;
+    }
+    kill(-h->pid, SIGKILL);
+    while (waitpid(h->pid, NULL, 0) < 0 && errno == EINTR);
+    close(h->fd);
+    h->pid = 0;
+    h->fd = -1;
+    h->rlen = 0;
+    for (size_t i = 0; i < h->count; i++)
+    {
+        if (!h->reqs[i].done)
+        {
+            h->reqs[i].status = -1;
+            h->reqs[i].done = true;
+        }
+    }
+}
+
+// A socket rather than a pipe is used for the hook's standard input so that
+// writes can use MSG_NOSIGNAL: ignoring SIGPIPE instead would be inherited
+// by the hook and by every program it runs
+static bool hook_start(hook_t *h)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        warn("hook_start: socketpair failed");
+        return false;
+    }
+    if (fcntl(sv[0], F_SETFD, FD_CLOEXEC) < 0 ||
+            fcntl(sv[1], F_SETFD, FD_CLOEXEC) < 0)
+    {
+        warn("hook_start: fcntl failed");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    msg(1, "starting persistent hook %s", h->prog);
+    char *argv[] = {(char *)h->prog, NULL};
+    pid_t pid = hook_spawn(h, argv, sv[1], sv[1]);
+    close(sv[1]);
+    if (pid < 0)
+    {
+        close(sv[0]);
+        return false;
+    }
+    h->fd = sv[0];
+    h->pid = pid;
+    h->rlen = 0;
+    return true;
+}
+
+static bool hook_send(hook_t *h, const char *line, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t r = send(h->fd, line, len, MSG_NOSIGNAL);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("hook_send: failed to write to %s", h->prog);
+            hook_stop(h);
+            return false;
+        }
+        line += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Reads a line from the persistent hook into *line, waiting for it until
+// deadline at the most
+static bool hook_getline(hook_t *h, char **line, long long deadline)
+{
+    while (1)
+    {
+        char *nl = h->rbuf ? memchr(h->rbuf, '\n', h->rlen) : NULL;
+        if (nl)
+        {
+            size_t len = nl - h->rbuf + 1;
+            char *l = realloc(*line, len + 1);
+            if (!l)
+            {
+                warn("hook_getline: realloc failed");
+                return false;
+            }
+            memcpy(l, h->rbuf, len);
+            l[len] = 0;
+            *line = l;
+            h->rlen -= len;
+            memmove(h->rbuf, h->rbuf + len, h->rlen);
+            return true;
+        }
+        if (h->ralloc - h->rlen < 1024)
+        {
+            size_t alloc = h->ralloc ? 2*h->ralloc : 4096;
+            char *buf = realloc(h->rbuf, alloc);
+            if (!buf)
+            {
+                warn("hook_getline: realloc failed");
+                return false;
+            }
+            h->rbuf = buf;
+            h->ralloc = alloc;
+        }
+        struct pollfd pfd = {.fd = h->fd, .events = POLLIN};
+        int r = poll(&pfd, 1, hook_remaining(deadline));
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("hook_getline: poll failed");
+            return false;
+        }
+        else if (r == 0)
+        {
+            warnx("%s timed out, killing it", h->prog);
+            return false;
+        }
+        ssize_t n = read(h->fd, h->rbuf + h->rlen, h->ralloc - h->rlen);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("hook_getline: failed to read from %s", h->prog);
+            return false;
+        }
+        else if (n == 0)
+        {
+            warnx("%s exited unexpectedly", h->prog);
+            return false;
+        }
+        h->rlen += n;
+    }
+}
+
+// Reads one response from the persistent hook and records it. Any failure
+// means the hook cannot be relied upon any longer, so it is stopped.
+static bool hook_recv(hook_t *h, long long deadline)
+{
+    bool success = false;
+    char *line = NULL;
+    char *data = NULL;
+    size_t datalen = 0;
+    int id, status, count = 0, n = 0;
+    if (!hook_getline(h, &line, deadline))
+    {
+        goto out;
+    }
+    if ((sscanf(line, "%d %d %n", &id, &status, &n) != 2 || line[n]) &&
+            (sscanf(line, "%d %d %d %n", &id, &status, &count, &n) != 3 ||
+             line[n] || count < 0))
+    {
+        warnx("hook_recv: invalid response from %s: %s", h->prog, line);
+        goto out;
+    }
+    hook_req_t *r = hook_find(h, id);
+    if (!r || r->done)
+    {
+        warnx("hook_recv: unexpected response from %s: %s", h->prog, line);
+        goto out;
+    }
+    // the lines following a batch response belong to it
+    while (count-- > 0)
+    {
+        if (!hook_getline(h, &line, deadline))
+        {
+            goto out;
+        }
+        size_t l = strlen(line);
+        char *tmp = realloc(data, datalen + l + 1);
+        if (!tmp)
+        {
+            warn("hook_recv: realloc failed");
+            goto out;
+        }
+        data = tmp;
+        memcpy(data + datalen, line, l + 1);
+        datalen += l;
+    }
+    r->status = status;
+    r->data = data;
+    r->done = true;
+    data = NULL;
+    success = true;
+out:
+    if (!success)
+    {
+        hook_stop(h);
+    }
+    free(data);
+    free(line);
+    return success;
+}
+
+// Waits for responses from the persistent hook until r is answered
+static void hook_recv_until(hook_t *h, hook_req_t *r)
+{
+    while (!r->done)
+    {
+        // hook_recv does not add or remove requests so r stays valid, and
+        // on failure all outstanding requests including r are done
+        hook_recv(h, r->deadline);
+    }
+}
+
+int hook_submit(hook_t *h, const char *method, const char *type,
+        const char *ident, const char *token, const char *auth)
+{
+    msg(1, "running %s %s %s %s %s %s", h->prog, method, type, ident,
+            token, auth);
+    if (h->persistent)
+    {
+        const char *args[] = {method, type, ident, token, auth};
+        for (size_t i = 0; i < sizeof(args)/sizeof(args[0]); i++)
+        {
+            if (!*args[i] || strpbrk(args[i], " \t\r\n"))
+            {
+                warnx("hook_submit: invalid argument '%s'", args[i]);
+                return -1;
+            }
+        }
+        if (h->pid <= 0 && !hook_start(h))
+        {
+            return -1;
+        }
+        while (h->jobs > 0 && hook_outstanding(h) >= (size_t)h->jobs)
+        {
+            long long deadline = 0;
+            for (size_t i = 0; i < h->count; i++)
+            {
+                if (!h->reqs[i].done && (!deadline ||
+                            h->reqs[i].deadline < deadline))
+                {
+                    deadline = h->reqs[i].deadline;
+                }
+            }
+            if (!hook_recv(h, deadline))
+            {
+                return -1;
+            }
+        }
+        hook_req_t *r = hook_add(h);
+        if (!r)
+        {
+            return -1;
+        }
+        char *line = NULL;
+        int len = asprintf(&line, "%d %s %s %s %s %s\n", r->id, method,
+                type, ident, token, auth);
+        if (len < 0)
+        {
+            warnx("hook_submit: asprintf failed");
+            hook_del(h, r);
+            return -1;
+        }
+        int id = r->id;
+        if (!hook_send(h, line, len))
+        {
+            hook_del(h, r);
+            id = -1;
+        }
+        free(line);
+        return id;
+    }
+
+    while (h->jobs > 0 && hook_outstanding(h) >= (size_t)h->jobs)
+    {
+        hook_collect(h);
+    }
+    hook_req_t *r = hook_add(h);
+    if (!r)
+    {
+        return -1;
+    }
+    char *argv[] = {(char *)h->prog, (char *)method, (char *)type,
+        (char *)ident, (char *)token, (char *)auth, NULL};
+    r->pid = hook_spawn(h, argv, -1, -1);
+    if (r->pid < 0)
+    {
+        hook_del(h, r);
+        return -1;
+    }
+    return r->id;
+}
+
+int hook_wait(hook_t *h, int id)
+{
+    hook_req_t *r = hook_find(h, id);
+    if (!r)
+    {
+        warnx("hook_wait: unknown request %d", id);
+        return -1;
+    }
+    if (h->persistent)
+    {
+        hook_recv_until(h, r);
+    }
+    else if (!r->done)
+    {
+        int status;
+        int ret = hook_waitpid(h, r->pid, r->deadline, true, &status);
+        r->status = ret > 0 ? hook_exit_status(h, status) : -1;
+        r->done = true;
+    }
+    int ret = r->status;
+    msg(2, "hook returned %d", ret);
+    hook_del(h, r);
+    return ret;
+}
+
+int hook_run(hook_t *h, const char *method, const char *type,
+        const char *ident, const char *token, const char *auth)
+{
+    int id = hook_submit(h, method, type, ident, token, auth);
+    return id < 0 ? -1 : hook_wait(h, id);
+}
+
+// Feeds input to a batch hook process and collects its standard output,
+// until deadline at the most
+static bool hook_exchange(hook_t *h, int in, const char *input, size_t len,
+        int out, char **output, long long deadline)
+{
+    size_t olen = 0, alloc = 0;
+    struct pollfd fds[2] =
+    {
+        {.fd = in, .events = POLLOUT},
+        {.fd = out, .events = POLLIN}
+    };
+    *output = NULL;
+    if (len == 0)
+    {
+        close(in);
+        fds[0].fd = in = -1;
+    }
+    else
+    {
+        // so that a hook writing before it read all its input cannot
+        // block the write past the deadline
+        int flags = fcntl(in, F_GETFL);
+        if (flags < 0 || fcntl(in, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            warn("hook_exchange: fcntl failed");
+            goto fail;
+        }
+    }
+    while (fds[1].fd >= 0)
+    {
+        int r = poll(fds, 2, hook_remaining(deadline));
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("hook_exchange: poll failed");
+            goto fail;
+        }
+        else if (r == 0)
+        {
+            warnx("%s timed out", h->prog);
+            goto fail;
+        }
+        if (fds[0].revents)
+        {
+            ssize_t r = write(in, input, len);
+            if (r < 0 && errno != EINTR && errno != EAGAIN)
+            {
+                // the hook may not read all its input, ignore that
+                len = 0;
+            }
+            else if (r > 0)
+            {
+                input += r;
+                len -= r;
+            }
+            if (len == 0)
+            {
+                close(in);
+                fds[0].fd = in = -1;
+            }
+        }
+        if (fds[1].revents)
+        {
+            if (alloc - olen < 4096)
+            {
+                alloc = alloc ? 2*alloc : 8192;
+                char *tmp = realloc(*output, alloc);
+                if (!tmp)
+                {
+                    warn("hook_exchange: realloc failed");
+                    goto fail;
+                }
+                *output = tmp;
+            }
+            ssize_t r = read(out, *output + olen, alloc - olen - 1);
+            if (r < 0 && errno != EINTR)
+            {
+                warn("hook_exchange: failed to read from %s", h->prog);
+                goto fail;
+            }
+            else if (r == 0)
+            {
+                fds[1].fd = -1;
+            }
+            else if (r > 0)
+            {
+                olen += r;
+            }
+        }
+    }
+    if (*output)
+    {
+        (*output)[olen] = 0;
+    }
+    if (in >= 0)
+    {
+        close(in);
+    }
+    close(out);
+    return true;
+fail:
+    if (in >= 0)
+    {
+        close(in);
+    }
+    close(out);
+    free(*output);
+    *output = NULL;
+    return false;
+}
+
+// Runs METHOD with input on the hook's standard input and returns its
+// status, storing what it writes on standard output in *output
+static int hook_request(hook_t *h, const char *method, size_t count,
+        const char *input, size_t len, char **output)
+{
+    int ret = -1;
+    *output = NULL;
+    if (h->persistent)
+    {
+        if (h->pid <= 0 && !hook_start(h))
+        {
+            return -1;
+        }
+        hook_req_t *r = hook_add(h);
+        if (!r)
+        {
+            return -1;
+        }
+        char header[64];
+        int hlen = snprintf(header, sizeof(header), "%d %s %zu\n", r->id,
+                method, count);
+        if (!hook_send(h, header, hlen) || !hook_send(h, input, len))
+        {
+            hook_del(h, r);
+            return -1;
+        }
+        hook_recv_until(h, r);
+        ret = r->status;
+        *output = r->data;
+        r->data = NULL;
+        hook_del(h, r);
+    }
+    else
+    {
+        int in[2], out[2], status;
+        long long deadline = hook_deadline(h);
+        if (!hook_pipe(in))
+        {
+            return -1;
+        }
+        if (!hook_pipe(out))
+        {
+            close(in[0]);
+            close(in[1]);
+            return -1;
+        }
+        char *argv[] = {(char *)h->prog, (char *)method, NULL};
+        pid_t pid = hook_spawn(h, argv, in[0], out[1]);
+        close(in[0]);
+        close(out[1]);
+        if (pid < 0)
+        {
+            close(in[1]);
+            close(out[0]);
+            return -1;
+        }
+        // the hook may exit without reading all its input
+        void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+        bool ok = hook_exchange(h, in[1], input, len, out[0], output,
+                deadline);
+        signal(SIGPIPE, sigpipe);
+        if (!ok)
+        {
+            // the deadline has expired or reading failed
+            kill(-pid, SIGKILL);
+        }
+        int r = hook_waitpid(h, pid, deadline, true, &status);
+        if (ok && r > 0)
+        {
+            ret = hook_exit_status(h, status);
+        }
+    }
+    msg(2, "hook returned %d", ret);
+    return ret;
+}
+
+int hook_batch(hook_t *h, const char *method, hook_chlg_t *chlgs,
+        size_t count)
+{
+    int ret = -1;
+    char *input = NULL;
+    char *output = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&input, &len);
+    if (!f)
+    {
+        warn("hook_batch: open_memstream failed");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *args[] = {chlgs[i].type, chlgs[i].ident, chlgs[i].token,
+            chlgs[i].auth};
+        for (size_t j = 0; j < sizeof(args)/sizeof(args[0]); j++)
+        {
+            if (!*args[j] || strpbrk(args[j], " \t\r\n"))
+            {
+                warnx("hook_batch: invalid argument '%s'", args[j]);
+                fclose(f);
+                goto out;
+            }
+        }
+        msg(2, "%s %s %s %s %s", method, chlgs[i].type, chlgs[i].ident,
+                chlgs[i].token, chlgs[i].auth);
+        fprintf(f, "%s %s %s %s\n", chlgs[i].type, chlgs[i].ident,
+                chlgs[i].token, chlgs[i].auth);
+        chlgs[i].accepted = false;
+    }
+    if (fclose(f))
+    {
+        warn("hook_batch: failed to write batch");
+        goto out;
+    }
+    msg(1, "running %s %s with %zu challenges", h->prog, method, count);
+
+    ret = hook_request(h, method, count, input, len, &output);
+
+    for (char *line = output; ret == 0 && line && *line; )
+    {
+        char *end = line + strcspn(line, "\n");
+        char *sep = memchr(line, ' ', end - line);
+        if (sep)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                if (strlen(chlgs[i].type) == (size_t)(sep - line) &&
+                        strncmp(chlgs[i].type, line, sep - line) == 0 &&
+                        strlen(chlgs[i].ident) == (size_t)(end - sep - 1) &&
+                        strncmp(chlgs[i].ident, sep + 1, end - sep - 1) == 0)
+                {
+                    chlgs[i].accepted = true;
+                }
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+out:
+    free(input);
+    free(output);
+    return ret;
+}
+
+bool hook_supports(const hook_t *h, const char *cap)
+{
+    if (!h->caps)
+    {
+        return true;
+    }
+    size_t len = strlen(cap);
+    for (const char *c = h->caps; *c; )
+    {
+        size_t l = strcspn(c, " ");
+        if (l == len && strncmp(c, cap, len) == 0)
+        {
+            return true;
+        }
+        c += l + (c[l] ? 1 : 0);
+    }
+    return false;
+}
+
+// A hook that names no challenge type, typically one that ignores the
+// methods it does not know and exits 0 without output, declares nothing
+static bool hook_declares(const char *caps)
+{
+    static const char * const types[] = {"http-01", "dns-01", "tls-alpn-01"};
+    hook_t h = {.caps = (char *)caps};
+    for (size_t i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+    {
+        if (hook_supports(&h, types[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void hook_capabilities(hook_t *h, const char *cache)
+{
+    char *key = NULL;
+    char *value = NULL;
+    char *output = NULL;
+    char *caps = NULL;
+    state_t *s = NULL;
+    struct stat st;
+    int status = -1;
+
+    if (stat(h->prog, &st) < 0)
+    {
+        warn("hook_capabilities: failed to stat %s", h->prog);
+        return;
+    }
+    key = realpath(h->prog, NULL);
+    if (!key)
+    {
+        warn("hook_capabilities: realpath failed for %s", h->prog);
+        return;
+    }
+
+    value = state_read(cache, key);
+    if (value)
+    {
+        unsigned long long dev, ino;
+        long long mtime, size;
+        int n = 0;
+        if (sscanf(value, "%llu %llu %lld %lld %d %n", &dev, &ino, &mtime,
+                    &size, &status, &n) == 5 &&
+                dev == (unsigned long long)st.st_dev &&
+                ino == (unsigned long long)st.st_ino &&
+                mtime == (long long)st.st_mtime &&
+                size == (long long)st.st_size)
+        {
+            msg(2, "%s capabilities found in %s", h->prog, cache);
+            if (status == 0 && !hook_declares(value + n))
+            {
+                status = 1;
+            }
+            caps = strdup(value + n);
+            if (!caps)
+            {
+                warn("hook_capabilities: strdup failed");
+                goto out;
+            }
+        }
+        else
+        {
+            status = -1;
+        }
+    }
+
+    if (!caps)
+    {
+        status = hook_request(h, "capabilities", 0, "", 0, &output);
+        if (status < 0)
+        {
+            goto out;
+        }
+        // normalize to single space separated words
+        caps = calloc(1, output ? strlen(output) + 1 : 1);
+        if (!caps)
+        {
+            warn("hook_capabilities: calloc failed");
+            goto out;
+        }
+        for (char *w = output ? strtok(output, " \t\r\n") : NULL; w;
+                w = strtok(NULL, " \t\r\n"))
+        {
+            if (*caps)
+            {
+                strcat(caps, " ");
+            }
+            strcat(caps, w);
+        }
+        if (status == 0 && !hook_declares(caps))
+        {
+            status = 1;
+        }
+        s = state_load(cache, true);
+        if (!s || !state_set(s, key, "%llu %llu %lld %lld %d %s",
+                    (unsigned long long)st.st_dev,
+                    (unsigned long long)st.st_ino,
+                    (long long)st.st_mtime, (long long)st.st_size, status,
+                    status == 0 ? caps : "") || !state_save(s))
+        {
+            warnx("failed to update %s", cache);
+        }
+    }
+
+    if (status == 0)
+    {
+        msg(1, "%s capabilities: %s", h->prog, caps);
+        free(h->caps);
+        h->caps = caps;
+        caps = NULL;
+        if (hook_supports(h, "batch"))
+        {
+            h->batch = true;
+        }
+    }
+    else
+    {
+        msg(1, "%s does not declare its capabilities", h->prog);
+    }
+
+out:
+    state_free(s);
+    free(caps);
+    free(output);
+    free(value);
+    free(key);
+}
+
+void hook_fini(hook_t *h)
+{
+    while (h->count > 0)
+    {
+        hook_req_t *r = h->reqs;
+        int status;
+        if (r->pid > 0 && !r->done)
+        {
+            hook_waitpid(h, r->pid, r->deadline, true, &status);
+        }
+        hook_del(h, r);
+    }
+    if (h->pid > 0)
+    {
+        // closing its standard input tells the persistent hook to exit
+        int status;
+        close(h->fd);
+        int r = hook_waitpid(h, h->pid, hook_deadline(h), true, &status);
+        if (r > 0 && hook_exit_status(h, status) != 0)
+        {
+            warnx("%s exited with status %d", h->prog,
+                    WEXITSTATUS(status));
+        }
+        h->pid = 0;
+        h->fd = -1;
+    }
+    free(h->reqs);
+    h->reqs = NULL;
+    free(h->rbuf);
+    h->rbuf = NULL;
+    h->rlen = h->ralloc = 0;
+    free(h->caps);
+    h->caps = NULL;
+    h->count = h->alloc = 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HOOK_H__
+#define __HOOK_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define HOOK_TIMEOUT 600
+#define HOOK_JOBS 16
+
+typedef struct hook_req
+{
+    int id;
+    pid_t pid;
+    long long deadline;
+    int status;
+    bool done;
+    char *data;
+} hook_req_t;
+
+typedef struct hook_chlg
+{
+    const char *type;
+    const char *ident;
+    const char *token;
+    const char *auth;
+    bool accepted;
+} hook_chlg_t;
+
+/*
+ * Hook invocations are submitted and waited for separately so that several
+ * of them can be outstanding at the same time. By default every request
+ * runs PROGRAM METHOD TYPE IDENT TOKEN AUTH in a new process. A persistent
+ * hook is started once with no arguments and receives one
+ * "ID METHOD TYPE IDENT TOKEN AUTH" line per request on its standard
+ * input, answering each with an "ID STATUS" line on its standard output,
+ * in any order.
+ *
+ * Batch methods pass many challenges in a single request: PROGRAM METHOD
+ * is run with one "TYPE IDENT TOKEN AUTH" line per challenge on its
+ * standard input (for a persistent hook the request line is
+ * "ID METHOD COUNT" followed by COUNT such lines). The challenges the hook
+ * accepts are reported back as "TYPE IDENT" lines on its standard output
+ * (by a persistent hook as "ID STATUS COUNT" followed by COUNT lines).
+ *
+ * The capabilities method takes no challenge and returns the words the
+ * hook supports, challenge types and "batch". Answers are cached per
+ * program file so that the hook is not asked again until it changes.
+ *
+ * Hooks are spawned in a process group of their own, which is killed if
+ * an invocation takes more than timeout seconds (0 means no limit). At
+ * most jobs invocations are outstanding at any time, submitting more
+ * waits for one of them to complete first.
+ */
+typedef struct hook
+{
+    const char *prog;
+    bool persistent;
+    bool batch;
+    char *caps;
+    int timeout;
+    int jobs;
+    pid_t pid;
+    int fd;
+    char *rbuf;
+    size_t rlen;
+    size_t ralloc;
+    int next_id;
+    size_t count;
+    size_t alloc;
+    hook_req_t *reqs;
+} hook_t;
+
+int hook_submit(hook_t *h, const char *method, const char *type,
+        const char *ident, const char *token, const char *auth);
+int hook_wait(hook_t *h, int id);
+int hook_run(hook_t *h, const char *method, const char *type,
+        const char *ident, const char *token, const char *auth);
+int hook_batch(hook_t *h, const char *method, hook_chlg_t *chlgs,
+        size_t count);
+bool hook_supports(const hook_t *h, const char *cap);
+void hook_capabilities(hook_t *h, const char *cache);
+void hook_fini(hook_t *h);
+
+#endif
@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "httpd.h"
+#include "msg.h"
+#include "util.h"
+
+#define HTTPD_MAX_LISTEN 8
+#define HTTPD_MAX_CONN 64
+#define HTTPD_REQ_SIZE 2048
+#define HTTPD_IDLE 10
+#define HTTPD_PREFIX "/.well-known/acme-challenge/"
+
+typedef struct httpd_conn
+{
+    int fd;
+    void *tls;
+    bool write;
+    long long start;
+    size_t len;
+    char req[HTTPD_REQ_SIZE];
+    char *resp;
+    size_t resp_len;
+    size_t resp_off;
+} httpd_conn_t;
+
+typedef struct httpd_token
+{
+    char *token;
+    char *auth;
+} httpd_token_t;
+
+struct httpd
+{
+    int lfd[HTTPD_MAX_LISTEN];
+    bool ltls[HTTPD_MAX_LISTEN];
+    size_t nlfd;
+    tls_alpn_t *alpn;
+    httpd_conn_t conn[HTTPD_MAX_CONN];
+    size_t nconn;
+    httpd_token_t *tokens;
+    size_t ntokens;
+};
+
+// Splits [ADDRESS:]PORT into its parts, ADDRESS may be an IPv6 address
+// in square brackets
+static bool httpd_parse(const char *listen, char **host, const char **port)
+{
+    const char *colon = strrchr(listen, ':');
+    *host = NULL;
+    *port = listen;
+    if (!colon)
+    {
+        return true;
+    }
+    const char *start = listen;
+    const char *end = colon;
+    if (*listen == '[')
+    {
+        if (colon == listen || colon[-1] != ']')
+        {
+            return false;
+        }
+        start++;
+        end--;
+    }
+    else if (memchr(listen, ':', colon - listen))
+    {
+        // a bare IPv6 address is ambiguous
+        return false;
+    }
+    *port = colon + 1;
+    if (end > start)
+    {
+        *host = strndup(start, end - start);
+        if (!*host)
+        {
+            warn("httpd_parse: strndup failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool httpd_listen(httpd_t *h, const char *listen_on, bool tls)
+{
+    struct addrinfo hints, *res = NULL;
+    char *host = NULL;
+    const char *port;
+    size_t nlfd = h->nlfd;
+    if (!httpd_parse(listen_on, &host, &port) || !*port)
+    {
+        warnx("invalid listen address %s", listen_on);
+        free(host);
+        return false;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int r = getaddrinfo(host, port, &hints, &res);
+    free(host);
+    if (r)
+    {
+        warnx("failed to resolve %s: %s", listen_on, gai_strerror(r));
+        return false;
+    }
+    for (struct addrinfo *ai = res; ai && h->nlfd < HTTPD_MAX_LISTEN;
+            ai = ai->ai_next)
+    {
+        int one = 1;
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (ai->ai_family == AF_INET6)
+        {
+            // the IPv4 wildcard is bound separately
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+        }
+        if (!util_nonblock(fd) ||
+                bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+                listen(fd, 64) < 0)
+        {
+            warn("failed to listen on %s", listen_on);
+            close(fd);
+            continue;
+        }
+        h->ltls[h->nlfd] = tls;
+        h->lfd[h->nlfd++] = fd;
+    }
+    freeaddrinfo(res);
+    if (h->nlfd == nlfd)
+    {
+        return false;
+    }
+    msg(1, "listening for %s challenges on %s",
+            tls ? "tls-alpn-01" : "http-01", listen_on);
+    return true;
+}
+
+httpd_t *httpd_start(const char *http, const char *tls)
+{
+    httpd_t *h = calloc(1, sizeof(httpd_t));
+    if (!h)
+    {
+        warn("httpd_start: calloc failed");
+        return NULL;
+    }
+    if (tls)
+    {
+        h->alpn = tls_alpn_init();
+        if (!h->alpn || !httpd_listen(h, tls, true))
+        {
+            httpd_stop(h);
+            return NULL;
+        }
+    }
+    if (http && !httpd_listen(h, http, false))
+    {
+        httpd_stop(h);
+        return NULL;
+    }
+    return h;
+}
+
+static httpd_token_t *httpd_find(httpd_t *h, const char *token, size_t len)
+{
+    for (size_t i = 0; i < h->ntokens; i++)
+    {
+        if (strlen(h->tokens[i].token) == len &&
+                strncmp(h->tokens[i].token, token, len) == 0)
+        {
+            return h->tokens + i;
+        }
+    }
+    return NULL;
+}
+
+bool httpd_put(httpd_t *h, const char *token, const char *auth)
+{
+    httpd_token_t *t = httpd_find(h, token, strlen(token));
+    char *a = strdup(auth);
+    if (!a)
+    {
+        warn("httpd_put: strdup failed");
+        return false;
+    }
+    if (t)
+    {
+        free(t->auth);
+        t->auth = a;
+        return true;
+    }
+    t = realloc(h->tokens, (h->ntokens + 1) * sizeof(httpd_token_t));
+    if (!t)
+    {
+        warn("httpd_put: realloc failed");
+        free(a);
+        return false;
+    }
+    h->tokens = t;
+    t += h->ntokens;
+    t->token = strdup(token);
+    if (!t->token)
+    {
+        warn("httpd_put: strdup failed");
+        free(a);
+        return false;
+    }
+    t->auth = a;
+    h->ntokens++;
+    msg(2, "serving %s%s", HTTPD_PREFIX, token);
+    return true;
+}
+
+bool httpd_put_alpn(httpd_t *h, const char *ident, const char *auth)
+{
+    if (!h->alpn)
+    {
+        warnx("httpd_put_alpn: tls-alpn-01 responder not started");
+        return false;
+    }
+    return tls_alpn_add(h->alpn, ident, auth);
+}
+
+bool httpd_del_alpn(httpd_t *h, const char *ident)
+{
+    if (h->alpn)
+    {
+        tls_alpn_del(h->alpn, ident);
+    }
+    return true;
+}
+
+bool httpd_del(httpd_t *h, const char *token)
+{
+    httpd_token_t *t = httpd_find(h, token, strlen(token));
+    if (t)
+    {
+        free(t->token);
+        free(t->auth);
+        *t = h->tokens[--h->ntokens];
+    }
+    return true;
+}
+
+static void httpd_close(httpd_t *h, size_t i)
+{
+    if (h->conn[i].tls)
+    {
+        tls_alpn_close(h->conn[i].tls);
+    }
+    close(h->conn[i].fd);
+    free(h->conn[i].resp);
+    h->conn[i] = h->conn[--h->nconn];
+}
+
+static bool httpd_respond(httpd_t *h, httpd_conn_t *c)
+{
+    const char *status = "400 Bad Request";
+    const char *body = "";
+    char method[8];
+    int n = 0;
+    bool head = false;
+
+    if (sscanf(c->req, "%7s %n", method, &n) == 1 && n > 0)
+    {
+        const char *path = c->req + n;
+        size_t len = strcspn(path, " \r\n");
+        head = strcmp(method, "HEAD") == 0;
+        if (strcmp(method, "GET") && !head)
+        {
+            status = "405 Method Not Allowed";
+        }
+        else
+        {
+            httpd_token_t *t = NULL;
+            size_t plen = strlen(HTTPD_PREFIX);
+            if (len > plen && strncmp(path, HTTPD_PREFIX, plen) == 0)
+            {
+                t = httpd_find(h, path + plen, len - plen);
+            }
+            status = t ? "200 OK" : "404 Not Found";
+            body = t ? t->auth : "";
+            msg(2, "http %s %.*s %.3s", method, (int)len, path, status);
+        }
+    }
+    int r = asprintf(&c->resp, "HTTP/1.0 %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n%s", status, strlen(body),
+            head ? "" : body);
+    if (r < 0)
+    {
+        c->resp = NULL;
+        warnx("httpd_respond: asprintf failed");
+        return false;
+    }
+    c->resp_len = r;
+    c->resp_off = 0;
+    return true;
+}
+
+// Makes progress on connection i, returning false once it is finished
+static bool httpd_handle(httpd_t *h, size_t i)
+{
+    httpd_conn_t *c = h->conn + i;
+    if (c->tls)
+    {
+        // tls-alpn-01 validation is over once the handshake completes
+        int r = tls_alpn_handshake(c->tls, &c->write);
+        if (r > 0)
+        {
+            msg(2, "tls-alpn-01 handshake completed");
+        }
+        return r == 0;
+    }
+    if (!c->resp)
+    {
+        ssize_t r = read(c->fd, c->req + c->len,
+                sizeof(c->req) - c->len - 1);
+        if (r < 0)
+        {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        else if (r == 0)
+        {
+            return false;
+        }
+        c->len += r;
+        c->req[c->len] = 0;
+        if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n") &&
+                c->len < sizeof(c->req) - 1)
+        {
+            return true;
+        }
+        if (!httpd_respond(h, c))
+        {
+            return false;
+        }
+    }
+    ssize_t r = send(c->fd, c->resp + c->resp_off,
+            c->resp_len - c->resp_off, MSG_NOSIGNAL);
+    if (r < 0)
+    {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    c->resp_off += r;
+    return c->resp_off < c->resp_len;
+}
+
+void httpd_serve(httpd_t *h, int timeout)
+{
+    struct pollfd fds[HTTPD_MAX_LISTEN + HTTPD_MAX_CONN];
+    long long end = util_now() + timeout;
+    while (1)
+    {
+        long long now = util_now();
+        for (size_t i = 0; i < h->nconn; i++)
+        {
+            if (now - h->conn[i].start > HTTPD_IDLE*1000LL)
+            {
+                httpd_close(h, i--);
+            }
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < h->nlfd; i++)
+        {
+            fds[n].fd = h->nconn < HTTPD_MAX_CONN ? h->lfd[i] : -1;
+            fds[n++].events = POLLIN;
+        }
+        for (size_t i = 0; i < h->nconn; i++)
+        {
+            fds[n].fd = h->conn[i].fd;
+            fds[n++].events = h->conn[i].resp || h->conn[i].write ?
+                POLLOUT : POLLIN;
+        }
+        int r = poll(fds, n, util_left(end));
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("httpd_serve: poll failed");
+            return;
+        }
+        else if (r == 0)
+        {
+            return;
+        }
+        // connections first, accepting may change their order
+        for (size_t i = h->nconn; r > 0 && i-- > 0; )
+        {
+            if (fds[h->nlfd + i].revents && !httpd_handle(h, i))
+            {
+                httpd_close(h, i);
+            }
+        }
+        for (size_t i = 0; r > 0 && i < h->nlfd; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            while (h->nconn < HTTPD_MAX_CONN)
+            {
+                int fd = accept(h->lfd[i], NULL, NULL);
+                if (fd < 0)
+                {
+                    break;
+                }
+                if (!util_nonblock(fd))
+                {
+                    close(fd);
+                    continue;
+                }
+                httpd_conn_t *c = h->conn + h->nconn;
+                memset(c, 0, sizeof(*c));
+                if (h->ltls[i] && !(c->tls = tls_alpn_accept(h->alpn, fd)))
+                {
+                    close(fd);
+                    continue;
+                }
+                c->fd = fd;
+                c->start = now;
+                h->nconn++;
+            }
+        }
+    }
+}
+
+void httpd_stop(httpd_t *h)
+{
+    if (!h)
+    {
+        return;
+    }
+    while (h->nconn > 0)
+    {
+        httpd_close(h, 0);
+    }
+    for (size_t i = 0; i < h->nlfd; i++)
+    {
+        close(h->lfd[i]);
+    }
+    for (size_t i = 0; i < h->ntokens; i++)
+    {
+        free(h->tokens[i].token);
+        free(h->tokens[i].auth);
+    }
+    free(h->tokens);
+    tls_alpn_free(h->alpn);
+    free(h);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HTTPD_H__
+#define __HTTPD_H__
+
+#include <stdbool.h>
+
+/*
+ * Minimal responder for http-01 and tls-alpn-01 challenges. On the HTTP
+ * port it answers GET /.well-known/acme-challenge/TOKEN from an in-memory
+ * table and nothing else; on the TLS port it completes acme-tls/1
+ * handshakes with the validation certificate of the identifier requested
+ * by SNI. There are no threads: connections are only handled within
+ * httpd_serve(), which uacme calls whenever it would otherwise be waiting
+ * during authorization.
+ */
+typedef struct httpd httpd_t;
+
+httpd_t *httpd_start(const char *http, const char *tls);
+bool httpd_put(httpd_t *h, const char *token, const char *auth);
+bool httpd_del(httpd_t *h, const char *token);
+bool httpd_put_alpn(httpd_t *h, const char *ident, const char *auth);
+bool httpd_del_alpn(httpd_t *h, const char *ident);
+void httpd_serve(httpd_t *h, int timeout);
+void httpd_stop(httpd_t *h);
+
+#endif
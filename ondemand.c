@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "certidx.h"
+#include "crypto.h"
+#include "msg.h"
+#include "ondemand.h"
+#include "util.h"
+
+typedef struct ondemand_job
+{
+    int id;
+    uint64_t hash;
+    char **names;
+    bool running;
+} ondemand_job_t;
+
+typedef struct ondemand_conn
+{
+    int fd;
+    long long start;
+    int job;
+    bool pem;
+    size_t len;
+    char buf[ONDEMAND_LINE];
+} ondemand_conn_t;
+
+struct ondemand
+{
+    char *path;
+    int lfd;
+    ondemand_conn_t conn[ONDEMAND_MAX_CONN];
+    size_t nconn;
+    ondemand_job_t *jobs;
+    size_t njobs;
+    int next_id;
+};
+
+ondemand_t *ondemand_start(const char *path)
+{
+    struct sockaddr_un sun;
+    if (strlen(path) >= sizeof(sun.sun_path))
+    {
+        warnx("socket path %s is too long", path);
+        return NULL;
+    }
+    ondemand_t *o = calloc(1, sizeof(*o));
+    if (!o || !(o->path = strdup(path)))
+    {
+        warn("ondemand_start: allocation failed");
+        free(o);
+        return NULL;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    // a socket left behind by an earlier daemon is replaced
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+    o->lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (o->lfd < 0 || !util_nonblock(o->lfd) ||
+            bind(o->lfd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+            chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) < 0 ||
+            listen(o->lfd, ONDEMAND_MAX_CONN) < 0)
+    {
+        warn("failed to listen on %s", path);
+        if (o->lfd >= 0)
+        {
+            close(o->lfd);
+        }
+        free(o->path);
+        free(o);
+        return NULL;
+    }
+    msg(1, "listening for issuance requests on %s", path);
+    return o;
+}
+
+static void ondemand_close(ondemand_t *o, size_t i)
+{
+    close(o->conn[i].fd);
+    o->conn[i] = o->conn[--o->nconn];
+}
+
+static void ondemand_reply(ondemand_conn_t *c, const char *certfile,
+        const char *error)
+{
+    // the reply is short and the client is waiting for it, but one that
+    // stopped reading must not hold the daemon up for long
+    struct timeval tv = {ONDEMAND_TIMEOUT, 0};
+    int flags = fcntl(c->fd, F_GETFL);
+    if (flags < 0 || fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK) < 0 ||
+            setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+    {
+        return;
+    }
+    char line[ONDEMAND_LINE];
+    int n = snprintf(line, sizeof(line), "%s %s\n", certfile ? "ok" : "error",
+            certfile ? certfile : error);
+    if (n >= (int)sizeof(line))
+    {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+    if (n < 0 || send(c->fd, line, n, MSG_NOSIGNAL) < 0 || !certfile ||
+            !c->pem)
+    {
+        return;
+    }
+    int fd = open(certfile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        warn("failed to open %s", certfile);
+        return;
+    }
+    ssize_t r;
+    while ((r = read(fd, line, sizeof(line))) > 0 &&
+            send(c->fd, line, r, MSG_NOSIGNAL) == r)
+    {
+    }
+    close(fd);
+}
+
+// Turns a complete request line into a job, or attaches the connection
+// to the job for the same names, returning false if it is malformed
+static bool ondemand_request(ondemand_t *o, ondemand_conn_t *c)
+{
+    char *p = c->buf, *tok;
+    char **names = NULL;
+    size_t n = 0;
+    tok = strsep(&p, " ");
+    if (strcmp(tok, "pem") == 0)
+    {
+        c->pem = true;
+    }
+    else if (strcmp(tok, "issue") != 0)
+    {
+        ondemand_reply(c, NULL, "unknown request");
+        return false;
+    }
+    names = calloc(ONDEMAND_MAX_NAMES + 1, sizeof(char *));
+    if (!names)
+    {
+        warn("ondemand_request: calloc failed");
+        return false;
+    }
+    while ((tok = strsep(&p, " ")))
+    {
+        if (!*tok)
+        {
+            continue;
+        }
+        if (n == ONDEMAND_MAX_NAMES)
+        {
+            ondemand_reply(c, NULL, "too many names");
+            names_free(names);
+            return false;
+        }
+        if (!(names[n++] = strdup(tok)))
+        {
+            warn("ondemand_request: strdup failed");
+            names_free(names);
+            return false;
+        }
+    }
+    if (n == 0)
+    {
+        ondemand_reply(c, NULL, "no names");
+        free(names);
+        return false;
+    }
+    uint64_t hash = names_hash((const char * const *)names);
+    for (size_t i = 0; i < o->njobs; i++)
+    {
+        if (o->jobs[i].hash == hash &&
+                names_equal((const char * const *)o->jobs[i].names,
+                    (const char * const *)names))
+        {
+            msg(1, "joining %s request for %s", o->jobs[i].running ?
+                    "running" : "queued", names[0]);
+            names_free(names);
+            c->job = o->jobs[i].id;
+            return true;
+        }
+    }
+    ondemand_job_t *tmp = realloc(o->jobs, (o->njobs + 1) * sizeof(*tmp));
+    if (!tmp)
+    {
+        warn("ondemand_request: realloc failed");
+        names_free(names);
+        return false;
+    }
+    o->jobs = tmp;
+    ondemand_job_t *j = o->jobs + o->njobs++;
+    j->id = ++o->next_id;
+    j->hash = hash;
+    j->names = names;
+    j->running = false;
+    c->job = j->id;
+    msg(1, "received request for %s", names[0]);
+    return true;
+}
+
+// Reads from a connection, returning false once it is to be closed
+static bool ondemand_handle(ondemand_t *o, size_t i)
+{
+    ondemand_conn_t *c = o->conn + i;
+    if (c->job)
+    {
+        // only polled for errors and hangups until the reply
+        return false;
+    }
+    ssize_t r = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+    if (r < 0)
+    {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    else if (r == 0)
+    {
+        return false;
+    }
+    c->len += r;
+    c->buf[c->len] = 0;
+    char *eol = strchr(c->buf, '\n');
+    if (!eol)
+    {
+        if (c->len == sizeof(c->buf) - 1)
+        {
+            ondemand_reply(c, NULL, "request too long");
+            return false;
+        }
+        return true;
+    }
+    if (eol > c->buf && eol[-1] == '\r')
+    {
+        eol--;
+    }
+    *eol = 0;
+    return ondemand_request(o, c);
+}
+
+static bool ondemand_waiting(const ondemand_t *o)
+{
+    for (size_t i = 0; i < o->njobs; i++)
+    {
+        if (!o->jobs[i].running)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Handles connections for up to timeout milliseconds, returning whether
+// a job is waiting to be processed, as soon as there is one. It returns
+// early too once wake, if not -1, becomes readable, so that the caller
+// can wait for something else at the same time.
+bool ondemand_serve(ondemand_t *o, int timeout, int wake)
+{
+    struct pollfd fds[2 + ONDEMAND_MAX_CONN];
+    long long end = util_now() + timeout;
+    bool waiting = ondemand_waiting(o);
+    while (1)
+    {
+        long long now = util_now();
+        for (size_t i = 0; i < o->nconn; i++)
+        {
+            // only the request line is subject to the timeout
+            if (!o->conn[i].job &&
+                    now - o->conn[i].start > ONDEMAND_TIMEOUT*1000LL)
+            {
+                ondemand_close(o, i--);
+            }
+        }
+        fds[0].fd = o->nconn < ONDEMAND_MAX_CONN ? o->lfd : -1;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < o->nconn; i++)
+        {
+            fds[1 + i].fd = o->conn[i].fd;
+            fds[1 + i].events = o->conn[i].job ? 0 : POLLIN;
+        }
+        fds[1 + o->nconn].fd = wake;
+        fds[1 + o->nconn].events = POLLIN;
+        int r = poll(fds, 2 + o->nconn, waiting ? 0 : util_left(end));
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("ondemand_serve: poll failed");
+            break;
+        }
+        else if (r == 0)
+        {
+            break;
+        }
+        bool woken = fds[1 + o->nconn].revents != 0;
+        // new connections are appended, so the ones polled come first
+        for (size_t i = o->nconn; i-- > 0; )
+        {
+            if (fds[1 + i].revents && !ondemand_handle(o, i))
+            {
+                ondemand_close(o, i);
+            }
+        }
+        while ((fds[0].revents & POLLIN) && o->nconn < ONDEMAND_MAX_CONN)
+        {
+            int fd = accept(o->lfd, NULL, NULL);
+            if (fd < 0)
+            {
+                break;
+            }
+            if (!util_nonblock(fd))
+            {
+                close(fd);
+                continue;
+            }
+            ondemand_conn_t *c = o->conn + o->nconn++;
+            memset(c, 0, sizeof(*c));
+            c->fd = fd;
+            c->start = now;
+        }
+        // once a job is waiting, only what is already there is handled
+        waiting = ondemand_waiting(o);
+        if (woken)
+        {
+            break;
+        }
+    }
+    return waiting;
+}
+
+// Returns the names of the oldest job not yet processed, which becomes
+// the running one, or NULL if there is none
+char **ondemand_next(ondemand_t *o)
+{
+    for (size_t i = 0; i < o->njobs; i++)
+    {
+        if (!o->jobs[i].running)
+        {
+            o->jobs[i].running = true;
+            return o->jobs[i].names;
+        }
+    }
+    return NULL;
+}
+
+// Answers the connections waiting for the running job, with certfile on
+// success and error otherwise, and forgets the job
+void ondemand_done(ondemand_t *o, const char *certfile, const char *error)
+{
+    size_t j = 0;
+    while (j < o->njobs && !o->jobs[j].running)
+    {
+        j++;
+    }
+    if (j == o->njobs)
+    {
+        return;
+    }
+    for (size_t i = o->nconn; i-- > 0; )
+    {
+        if (o->conn[i].job == o->jobs[j].id)
+        {
+            ondemand_reply(o->conn + i, certfile, error);
+            ondemand_close(o, i);
+        }
+    }
+    names_free(o->jobs[j].names);
+    memmove(o->jobs + j, o->jobs + j + 1,
+            (--o->njobs - j) * sizeof(*o->jobs));
+}
+
+void ondemand_stop(ondemand_t *o)
+{
+    if (!o)
+    {
+        return;
+    }
+    while (o->nconn > 0)
+    {
+        ondemand_close(o, 0);
+    }
+    for (size_t i = 0; i < o->njobs; i++)
+    {
+        names_free(o->jobs[i].names);
+    }
+    free(o->jobs);
+    close(o->lfd);
+    unlink(o->path);
+    free(o->path);
+    free(o);
+}
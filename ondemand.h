@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ONDEMAND_H__
+#define __ONDEMAND_H__
+
+#include <stdbool.h>
+
+#define ONDEMAND_MAX_CONN 64
+#define ONDEMAND_MAX_NAMES 100
+#define ONDEMAND_LINE 4096
+#define ONDEMAND_TIMEOUT 10
+
+/*
+ * Unix domain socket on which the daemon takes on-demand issuance
+ * requests, one per connection, as a single line:
+ *
+ *   issue NAME [NAME ...]   answered with "ok CERTFILE" once CERTFILE is
+ *                           valid for the names
+ *   pem NAME [NAME ...]     the same, followed by the content of CERTFILE
+ *
+ * or with "error MESSAGE" on failure, after which the connection is
+ * closed. Requests for the same names, in any order, are handled as a
+ * single job and answered together, including those arriving while the
+ * job is being processed. Like httpd, there are no threads: connections
+ * are only handled within ondemand_serve(), which returns early when a
+ * new job is waiting.
+ */
+typedef struct ondemand ondemand_t;
+
+ondemand_t *ondemand_start(const char *path);
+bool ondemand_serve(ondemand_t *o, int timeout, int wake);
+char **ondemand_next(ondemand_t *o);
+void ondemand_done(ondemand_t *o, const char *certfile, const char *error);
+void ondemand_stop(ondemand_t *o);
+
+#endif
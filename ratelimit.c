@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "certidx.h"
+#include "msg.h"
+#include "ratelimit.h"
+#include "state.h"
+
+static const char * const ratelimit_names[RATELIMIT_NUM] =
+{
+    "orders", "certs", "failures"
+};
+
+ratelimit_t *ratelimit_init(const char *confdir, const char *spec)
+{
+    ratelimit_t *rl = calloc(1, sizeof(*rl));
+    char *dup = spec ? strdup(spec) : NULL;
+    if (!rl || (spec && !dup))
+    {
+        warn("ratelimit_init: allocation failed");
+        goto fail;
+    }
+    if (asprintf(&rl->path, "%s/" RATELIMIT_FILE, confdir) < 0)
+    {
+        rl->path = NULL;
+        warnx("ratelimit_init: asprintf failed");
+        goto fail;
+    }
+    for (char *p = dup, *tok; p && (tok = strsep(&p, ",")); )
+    {
+        char *eq = strchr(tok, '=');
+        char *end = NULL;
+        int k = 0;
+        if (eq)
+        {
+            *eq = 0;
+            while (k < RATELIMIT_NUM && strcmp(tok, ratelimit_names[k]))
+            {
+                k++;
+            }
+        }
+        if (!eq || k == RATELIMIT_NUM)
+        {
+            warnx("unknown rate limit %s", tok);
+            goto fail;
+        }
+        unsigned long count = strtoul(eq + 1, &end, 10);
+        unsigned long period = 0;
+        if (end != eq + 1 && *end == '/')
+        {
+            char *unit;
+            period = strtoul(end + 1, &unit, 10);
+            if (unit == end + 1 || period == 0)
+            {
+                period = 0;
+            }
+            else if (strcmp(unit, "d") == 0)
+            {
+                period *= 24*3600;
+            }
+            else if (strcmp(unit, "h") == 0)
+            {
+                period *= 3600;
+            }
+            else if (strcmp(unit, "m") == 0)
+            {
+                period *= 60;
+            }
+            else if (*unit && strcmp(unit, "s") != 0)
+            {
+                period = 0;
+            }
+        }
+        if (period == 0)
+        {
+            warnx("rate limit %s must be COUNT/PERIOD[s|m|h|d]", tok);
+            goto fail;
+        }
+        rl->count[k] = count;
+        rl->period[k] = period;
+    }
+    free(dup);
+    return rl;
+fail:
+    free(dup);
+    ratelimit_free(rl);
+    return NULL;
+}
+
+void ratelimit_free(ratelimit_t *rl)
+{
+    if (rl)
+    {
+        free(rl->path);
+        free(rl);
+    }
+}
+
+// Second level labels that country code TLDs commonly reserve for public
+// registrations, as in co.uk, com.au or ac.jp
+static const char * const ratelimit_slds[] =
+{
+    "ac", "co", "com", "ed", "edu", "go", "gob", "gov", "govt", "gv",
+    "lg", "ltd", "me", "mil", "ne", "net", "nhs", "nic",
+    "nom", "or", "org", "plc", "sch"
+};
+
+static bool ratelimit_sld(const char *label, size_t len)
+{
+    for (size_t i = 0; i < sizeof(ratelimit_slds)/sizeof(ratelimit_slds[0]);
+            i++)
+    {
+        if (strlen(ratelimit_slds[i]) == len &&
+                strncasecmp(label, ratelimit_slds[i], len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *ratelimit_domain(const char *name)
+{
+    if (name[0] == '*' && name[1] == '.')
+    {
+        name += 2;
+    }
+    const char *labels[3] = {name, name, name};
+    for (const char *p = name; *p; p++)
+    {
+        if (*p == '.')
+        {
+            labels[2] = labels[1];
+            labels[1] = labels[0];
+            labels[0] = p + 1;
+        }
+    }
+    // labels[0] is the last label, labels[1] the last two and so on
+    size_t sld = labels[0] - labels[1] - 1;
+    if (strlen(labels[0]) == 2 && labels[2] != labels[1] &&
+            ratelimit_sld(labels[1], sld))
+    {
+        return labels[2];
+    }
+    return labels[1];
+}
+
+static char *ratelimit_key(ratelimit_kind_t kind, const char *id)
+{
+    char *key = NULL;
+    if (asprintf(&key, "%s %s", ratelimit_names[kind], id) < 0)
+    {
+        warnx("ratelimit_key: asprintf failed");
+        return NULL;
+    }
+    for (char *p = key; *p; p++)
+    {
+        // keys live in a tab separated file
+        if (*p == '\t' || *p == '\n')
+        {
+            *p = ' ';
+        }
+    }
+    return key;
+}
+
+// Brings a bucket up to date, returning the tokens available now
+static double ratelimit_tokens(const ratelimit_t *rl, ratelimit_kind_t kind,
+        const char *value, time_t now, time_t *blocked)
+{
+    double tokens = rl->count[kind];
+    long long updated = now, until = 0;
+    if (value && sscanf(value, "%lf %lld %lld", &tokens, &updated,
+                &until) == 3 && rl->count[kind])
+    {
+        tokens += (double)(now - updated) * rl->count[kind] /
+            rl->period[kind];
+        if (tokens > rl->count[kind])
+        {
+            tokens = rl->count[kind];
+        }
+    }
+    *blocked = until;
+    return tokens;
+}
+
+static time_t ratelimit_check(const ratelimit_t *rl, const state_t *s,
+        ratelimit_kind_t kind, const char *id, time_t now)
+{
+    time_t wait = 0, blocked;
+    char *key = ratelimit_key(kind, id);
+    if (!key)
+    {
+        return 0;
+    }
+    double tokens = ratelimit_tokens(rl, kind, state_get(s, key), now,
+            &blocked);
+    if (blocked > now)
+    {
+        msg(1, "%s blocked by the CA for %lld seconds", key,
+                (long long)(blocked - now));
+        wait = blocked - now;
+    }
+    if (rl->count[kind] && tokens < 1)
+    {
+        time_t t = (time_t)((1 - tokens) * rl->period[kind] /
+                rl->count[kind]) + 1;
+        msg(1, "%s rate limit reached for %lld seconds", key, (long long)t);
+        if (t > wait)
+        {
+            wait = t;
+        }
+    }
+    free(key);
+    return wait;
+}
+
+// Takes a token from a bucket and/or blocks it until the given time
+static bool ratelimit_take(const ratelimit_t *rl, state_t *s,
+        ratelimit_kind_t kind, const char *id, bool take, time_t until)
+{
+    time_t now = time(NULL), blocked;
+    char *key = ratelimit_key(kind, id);
+    if (!key)
+    {
+        return false;
+    }
+    double tokens = ratelimit_tokens(rl, kind, state_get(s, key), now,
+            &blocked);
+    if (take && rl->count[kind])
+    {
+        tokens -= 1;
+    }
+    if (until > blocked)
+    {
+        blocked = until;
+    }
+    bool ok = true;
+    if ((rl->count[kind] && tokens < rl->count[kind]) || blocked > now)
+    {
+        ok = state_set(s, key, "%.6f %lld %lld", tokens, (long long)now,
+                (long long)blocked);
+    }
+    else
+    {
+        // a full bucket carries no information
+        state_del(s, key);
+    }
+    free(key);
+    return ok;
+}
+
+static void ratelimit_save(const ratelimit_t *rl, state_t *s, bool ok)
+{
+    if (!ok || !state_save(s))
+    {
+        warnx("failed to update %s", rl->path);
+    }
+    state_free(s);
+}
+
+time_t ratelimit_wait(const ratelimit_t *rl, const char *account,
+        const char * const *names)
+{
+    time_t now = time(NULL), wait = 0, t;
+    state_t *s = state_load(rl->path, false);
+    if (!s)
+    {
+        return 0;
+    }
+    if (account)
+    {
+        wait = ratelimit_check(rl, s, RATELIMIT_ORDERS, account, now);
+    }
+    for (size_t i = 0; names && names[i]; i++)
+    {
+        t = ratelimit_check(rl, s, RATELIMIT_CERTS,
+                ratelimit_domain(names[i]), now);
+        wait = t > wait ? t : wait;
+        t = ratelimit_check(rl, s, RATELIMIT_FAILURES, names[i], now);
+        wait = t > wait ? t : wait;
+    }
+    state_free(s);
+    return wait;
+}
+
+void ratelimit_order(const ratelimit_t *rl, const char *account)
+{
+    state_t *s = account ? state_load(rl->path, true) : NULL;
+    if (s)
+    {
+        ratelimit_save(rl, s, ratelimit_take(rl, s, RATELIMIT_ORDERS,
+                    account, true, 0));
+    }
+}
+
+void ratelimit_issued(const ratelimit_t *rl, const char * const *names)
+{
+    bool ok = true;
+    state_t *s = state_load(rl->path, true);
+    if (!s)
+    {
+        return;
+    }
+    for (size_t i = 0; names && names[i]; i++)
+    {
+        const char *d = ratelimit_domain(names[i]);
+        size_t j = 0;
+        while (j < i && strcasecmp(ratelimit_domain(names[j]), d))
+        {
+            j++;
+        }
+        if (j == i)
+        {
+            ok = ratelimit_take(rl, s, RATELIMIT_CERTS, d, true, 0) && ok;
+        }
+    }
+    ratelimit_save(rl, s, ok);
+}
+
+void ratelimit_failed(const ratelimit_t *rl, const char *name)
+{
+    state_t *s = state_load(rl->path, true);
+    if (s)
+    {
+        ratelimit_save(rl, s, ratelimit_take(rl, s, RATELIMIT_FAILURES,
+                    name, true, 0));
+    }
+}
+
+static bool ratelimit_quoted(const char *detail, const char *name)
+{
+    for (const char *p = detail; (p = strchr(p, '"')); p++)
+    {
+        size_t len = strlen(name);
+        if (strncasecmp(p + 1, name, len) == 0 && p[len + 1] == '"')
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ratelimit_block(const ratelimit_t *rl, const char *account,
+        const char * const *names, const char *detail, time_t until)
+{
+    bool ok = true, found = false;
+    state_t *s = state_load(rl->path, true);
+    if (!s)
+    {
+        return;
+    }
+    if (!until)
+    {
+        until = time(NULL) + RATELIMIT_RETRY;
+    }
+    // work out from the problem detail which limit was hit: a hostname or
+    // registered domain it quotes, else the account if it mentions it,
+    // else the registered domains of the order
+    for (int pass = 0; pass < 2 && !found; pass++)
+    {
+        if (pass == 1 && account && detail && strstr(detail, "account"))
+        {
+            ok = ratelimit_take(rl, s, RATELIMIT_ORDERS, account, false,
+                    until) && ok;
+            break;
+        }
+        for (size_t i = 0; names && names[i]; i++)
+        {
+            const char *d = ratelimit_domain(names[i]);
+            if (pass == 0 && detail && strstr(detail, "fail") &&
+                    ratelimit_quoted(detail, names[i]))
+            {
+                ok = ratelimit_take(rl, s, RATELIMIT_FAILURES, names[i],
+                        false, until) && ok;
+                found = true;
+            }
+            else if (pass == 1 || (detail && ratelimit_quoted(detail, d)))
+            {
+                ok = ratelimit_take(rl, s, RATELIMIT_CERTS, d, false,
+                        until) && ok;
+                found = true;
+            }
+        }
+    }
+    ratelimit_save(rl, s, ok);
+}
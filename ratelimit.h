@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Client side view of the CA rate limits kept in CONFDIR/ratelimit.idx,
+ * shared by every run against that configuration directory. There is a
+ * token bucket for new orders per account, for certificates per
+ * registered domain and for failed validations per hostname, refilled at
+ * COUNT tokens per PERIOD as configured (a COUNT of 0 disables the
+ * bucket), plus the times until which the CA asked to be left alone in
+ * rateLimited problems, which are honoured even without buckets.
+ *
+ * Registered domains are approximated as the last two labels of a name,
+ * or three when a country code TLD is preceded by one of the usual
+ * second level public suffix labels (co.uk, com.au and the like).
+ */
+#define RATELIMIT_FILE "ratelimit.idx"
+#define RATELIMIT_RETRY 3600
+
+typedef enum
+{
+    RATELIMIT_ORDERS = 0,
+    RATELIMIT_CERTS,
+    RATELIMIT_FAILURES,
+    RATELIMIT_NUM
+} ratelimit_kind_t;
+
+typedef struct ratelimit
+{
+    char *path;
+    unsigned int count[RATELIMIT_NUM];
+    time_t period[RATELIMIT_NUM];
+} ratelimit_t;
+
+ratelimit_t *ratelimit_init(const char *confdir, const char *spec);
+time_t ratelimit_wait(const ratelimit_t *rl, const char *account,
+        const char * const *names);
+void ratelimit_order(const ratelimit_t *rl, const char *account);
+void ratelimit_issued(const ratelimit_t *rl, const char * const *names);
+void ratelimit_failed(const ratelimit_t *rl, const char *name);
+void ratelimit_block(const ratelimit_t *rl, const char *account,
+        const char * const *names, const char *detail, time_t until);
+void ratelimit_free(ratelimit_t *rl);
+
+#endif
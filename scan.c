@@ -0,0 +1,714 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "certidx.h"
+#include "crypto.h"
+#include "msg.h"
+#include "scan.h"
+#include "state.h"
+
+#define SCAN_MAX_WORKERS 64
+#define SCAN_PLAN_WIDTH 50
+
+typedef enum
+{
+    SCAN_VALID = 0,
+    SCAN_DUE,
+    SCAN_UNCOVERED,
+    SCAN_INVALID,
+    SCAN_MISSING,
+    SCAN_PENDING
+} scan_status_t;
+
+static const char * const scan_status_str[] =
+{
+    "valid", "due", "uncovered", "invalid", "missing", "pending"
+};
+
+typedef struct scan_entry
+{
+    char *certdir;
+    const char *domain;
+    char *names;
+    time_t expiration;
+    time_t renewal;
+    bool covered;
+    scan_status_t status;
+} scan_entry_t;
+
+typedef struct scan_worker
+{
+    pid_t pid;
+    int fd;
+    char *buf;
+    size_t len;
+    size_t alloc;
+} scan_worker_t;
+
+static bool scan_covered(const char *domain, char * const *names)
+{
+    for (; *names; names++)
+    {
+        const char *n = *names;
+        if (n[0] == '*' && n[1] == '.')
+        {
+            n += 2;
+        }
+        if (strcasecmp(n, domain) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void scan_parse(scan_entry_t *e)
+{
+    char *certfile = NULL;
+    char **names = NULL;
+    struct stat st;
+    e->status = SCAN_INVALID;
+    if (asprintf(&certfile, "%s/cert.pem", e->certdir) < 0)
+    {
+        warnx("scan_parse: asprintf failed");
+        return;
+    }
+    names = cert_file_info(certfile, &e->expiration, &st);
+    if (names)
+    {
+        e->covered = scan_covered(e->domain, names);
+        e->names = names_join((const char * const *)names);
+        e->status = SCAN_VALID;
+        names_free(names);
+    }
+    free(certfile);
+}
+
+static void scan_child(scan_entry_t *entries, size_t count, size_t worker,
+        size_t nworkers, int fd)
+{
+    FILE *f = fdopen(fd, "w");
+    if (!f)
+    {
+        warn("scan_child: fdopen failed");
+        _exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0, n = 0; i < count; i++)
+    {
+        if (entries[i].status != SCAN_PENDING || n++ % nworkers != worker)
+        {
+            continue;
+        }
+        scan_parse(entries + i);
+        fprintf(f, "%zu %d %d %lld %s\n", i, entries[i].status,
+                entries[i].covered, (long long)entries[i].expiration,
+                entries[i].names ? entries[i].names : "");
+    }
+    _exit(fclose(f) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static bool scan_collect(scan_entry_t *entries, size_t count,
+        scan_worker_t *w)
+{
+    char *line = w->buf;
+    char *end = w->buf + w->len;
+    while (line < end)
+    {
+        char *nl = memchr(line, '\n', end - line);
+        if (!nl)
+        {
+            break;
+        }
+        *nl = 0;
+        size_t i;
+        int status, covered, n = 0;
+        long long exp;
+        if (sscanf(line, "%zu %d %d %lld %n", &i, &status, &covered, &exp,
+                    &n) != 4 || i >= count ||
+                entries[i].status != SCAN_PENDING)
+        {
+            warnx("scan_collect: unexpected worker output");
+            return false;
+        }
+        entries[i].status = status;
+        entries[i].covered = covered;
+        entries[i].expiration = exp;
+        if (n > 0 && line[n])
+        {
+            entries[i].names = strdup(line + n);
+            if (!entries[i].names)
+            {
+                warn("scan_collect: strdup failed");
+                return false;
+            }
+        }
+        line = nl + 1;
+    }
+    return true;
+}
+
+// Parses the pending entries in nworkers child processes which report back
+// one line per certificate over a pipe. Parsing is the expensive part of a
+// scan and each certificate is independent, so this scales with the CPUs.
+static bool scan_run(scan_entry_t *entries, size_t count, size_t nworkers)
+{
+    bool success = false;
+    size_t started = 0;
+    scan_worker_t *workers = calloc(nworkers, sizeof(scan_worker_t));
+    struct pollfd *fds = calloc(nworkers, sizeof(struct pollfd));
+    if (!workers || !fds)
+    {
+        warn("scan_run: calloc failed");
+        goto out;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (; started < nworkers; started++)
+    {
+        int p[2];
+        if (pipe(p) < 0)
+        {
+            warn("scan_run: pipe failed");
+            goto out;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            warn("scan_run: fork failed");
+            close(p[0]);
+            close(p[1]);
+            goto out;
+        }
+        else if (pid == 0)
+        {
+            close(p[0]);
+            for (size_t i = 0; i < started; i++)
+            {
+                close(workers[i].fd);
+            }
+            scan_child(entries, count, started, nworkers, p[1]);
+        }
+        close(p[1]);
+        workers[started].pid = pid;
+        workers[started].fd = p[0];
+    }
+
+    size_t active = nworkers;
+    while (active > 0)
+    {
+        for (size_t i = 0; i < nworkers; i++)
+        {
+            fds[i].fd = workers[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, nworkers, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            warn("scan_run: poll failed");
+            goto out;
+        }
+        for (size_t i = 0; i < nworkers; i++)
+        {
+            scan_worker_t *w = workers + i;
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+            if (w->alloc - w->len < 4096)
+            {
+                size_t alloc = w->alloc ? 2*w->alloc : 16384;
+                char *buf = realloc(w->buf, alloc);
+                if (!buf)
+                {
+                    warn("scan_run: realloc failed");
+                    goto out;
+                }
+                w->buf = buf;
+                w->alloc = alloc;
+            }
+            ssize_t r = read(w->fd, w->buf + w->len, w->alloc - w->len);
+            if (r < 0 && errno != EINTR)
+            {
+                warn("scan_run: read failed");
+                goto out;
+            }
+            else if (r == 0)
+            {
+                close(w->fd);
+                w->fd = -1;
+                active--;
+            }
+            else if (r > 0)
+            {
+                w->len += r;
+            }
+        }
+    }
+
+    success = true;
+    for (size_t i = 0; i < nworkers; i++)
+    {
+        int status = 0;
+        while (waitpid(workers[i].pid, &status, 0) < 0)
+        {
+            if (errno != EINTR)
+            {
+                warn("scan_run: waitpid failed");
+                success = false;
+                break;
+            }
+        }
+        workers[i].pid = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            warnx("scan_run: worker %zu failed", i);
+            success = false;
+        }
+        if (!scan_collect(entries, count, workers + i))
+        {
+            success = false;
+        }
+    }
+
+out:
+    for (size_t i = 0; workers && i < started; i++)
+    {
+        if (workers[i].fd >= 0)
+        {
+            close(workers[i].fd);
+        }
+        if (workers[i].pid > 0)
+        {
+            kill(workers[i].pid, SIGTERM);
+            waitpid(workers[i].pid, NULL, 0);
+        }
+        free(workers[i].buf);
+    }
+    free(workers);
+    free(fds);
+    return success;
+}
+
+static bool scan_add(scan_entry_t **entries, size_t *count, size_t *alloc,
+        const char *confdir, const char *domain)
+{
+    if (*count == *alloc)
+    {
+        size_t n = *alloc ? 2 * *alloc : 256;
+        scan_entry_t *e = realloc(*entries, n * sizeof(scan_entry_t));
+        if (!e)
+        {
+            warn("scan_add: realloc failed");
+            return false;
+        }
+        *entries = e;
+        *alloc = n;
+    }
+    scan_entry_t *e = *entries + *count;
+    memset(e, 0, sizeof(*e));
+    if (asprintf(&e->certdir, "%s/%s", confdir, domain) < 0)
+    {
+        warnx("scan_add: asprintf failed");
+        e->certdir = NULL;
+        return false;
+    }
+    e->domain = e->certdir + strlen(confdir) + 1;
+    (*count)++;
+    return true;
+}
+
+static int scan_cmp(const void *a, const void *b)
+{
+    const scan_entry_t *x = a;
+    const scan_entry_t *y = b;
+    if (x->expiration != y->expiration)
+    {
+        return x->expiration < y->expiration ? -1 : 1;
+    }
+    return strcmp(x->domain, y->domain);
+}
+
+static int scan_time_cmp(const void *a, const void *b)
+{
+    time_t x = *(const time_t *)a;
+    time_t y = *(const time_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void json_puts(const char *s, size_t len, FILE *f)
+{
+    fputc('"', f);
+    for (; len--; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+        {
+            fprintf(f, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(f, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void scan_report(const scan_entry_t *e, bool json, bool first)
+{
+    time_t now = time(NULL);
+    char notafter[32] = "-";
+    int days_left = 0;
+    if (e->expiration)
+    {
+        struct tm tm;
+        strftime(notafter, sizeof(notafter), "%Y-%m-%dT%H:%M:%SZ",
+                gmtime_r(&e->expiration, &tm));
+        days_left = (e->expiration - now)/(24*3600);
+    }
+    if (json)
+    {
+        printf("%s\n  {\"domain\": ", first ? "" : ",");
+        json_puts(e->domain, strlen(e->domain), stdout);
+        printf(", \"certdir\": ");
+        json_puts(e->certdir, strlen(e->certdir), stdout);
+        printf(", \"status\": \"%s\"", scan_status_str[e->status]);
+        if (e->expiration)
+        {
+            printf(", \"notAfter\": \"%s\", \"daysLeft\": %d",
+                    notafter, days_left);
+        }
+        printf(", \"names\": [");
+        const char *n = e->names;
+        while (n && *n)
+        {
+            size_t len = strcspn(n, ",");
+            printf("%s", n == e->names ? "" : ", ");
+            json_puts(n, len, stdout);
+            n += len + (n[len] ? 1 : 0);
+        }
+        printf("]}");
+    }
+    else
+    {
+        if (e->expiration)
+        {
+            printf("%d", days_left);
+        }
+        else
+        {
+            printf("-");
+        }
+        printf("\t%s\t%s\t%s\t%s\n", notafter, scan_status_str[e->status],
+                e->certdir, e->names ? e->names : "-");
+    }
+}
+
+// Prints how many certificates fall due in each hour, overdue ones being
+// counted in the current hour as the next run renews them
+static void scan_plan(const scan_entry_t *entries, size_t count, bool json)
+{
+    time_t now = time(NULL);
+    time_t *hours = calloc(count + 1, sizeof(time_t));
+    size_t n = 0, peak = 0;
+    if (!hours)
+    {
+        warn("scan_plan: calloc failed");
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (entries[i].status == SCAN_VALID || entries[i].status == SCAN_DUE)
+        {
+            time_t t = entries[i].renewal < now ? now : entries[i].renewal;
+            hours[n++] = t - t % 3600;
+        }
+    }
+    qsort(hours, n, sizeof(time_t), scan_time_cmp);
+    for (size_t i = 0, j; i < n; i = j)
+    {
+        for (j = i; j < n && hours[j] == hours[i]; j++);
+        if (j - i > peak)
+        {
+            peak = j - i;
+        }
+    }
+    if (json)
+    {
+        printf("[");
+    }
+    for (size_t i = 0, j; i < n; i = j)
+    {
+        char hour[32];
+        struct tm tm;
+        for (j = i; j < n && hours[j] == hours[i]; j++);
+        strftime(hour, sizeof(hour), "%Y-%m-%dT%H:%M:%SZ",
+                gmtime_r(hours + i, &tm));
+        if (json)
+        {
+            printf("%s\n  {\"hour\": \"%s\", \"count\": %zu}",
+                    i ? "," : "", hour, j - i);
+        }
+        else
+        {
+            int width = (int)((j - i) * SCAN_PLAN_WIDTH / peak);
+            printf("%s\t%zu\t%.*s\n", hour, j - i, width ? width : 1,
+                    "##################################################");
+        }
+    }
+    if (json)
+    {
+        printf("%s]\n", n ? "\n" : "");
+    }
+    msg(1, "%zu certificates renewed in %zu hours, at most %zu per hour",
+            n, n ? (size_t)((hours[n-1] - hours[0])/3600 + 1) : 0, peak);
+    free(hours);
+}
+
+int cert_scan(const char *confdir, int validity, int jitter,
+        uint64_t account, bool json, bool plan)
+{
+    int ret = 2;
+    char *idxfile = NULL;
+    state_t *idx = NULL;
+    scan_entry_t *entries = NULL;
+    size_t count = 0, alloc = 0, pending = 0, indexed = 0, due = 0;
+    DIR *dir = opendir(confdir);
+    if (!dir)
+    {
+        warn("failed to open %s", confdir);
+        return ret;
+    }
+
+    if (asprintf(&idxfile, "%s/" CERTIDX_FILE, confdir) < 0)
+    {
+        warnx("cert_scan: asprintf failed");
+        idxfile = NULL;
+        goto out;
+    }
+    idx = state_load(idxfile, false);
+    if (!idx)
+    {
+        goto out;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)))
+    {
+        struct stat st;
+        char *path = NULL;
+        if (de->d_name[0] == '.' || strcmp(de->d_name, "private") == 0)
+        {
+            continue;
+        }
+        if (asprintf(&path, "%s/%s/cert.pem", confdir, de->d_name) < 0)
+        {
+            warnx("cert_scan: asprintf failed");
+            goto out;
+        }
+        int r = stat(path, &st);
+        free(path);
+        scan_status_t status = SCAN_PENDING;
+        if (r < 0)
+        {
+            // only report directories uacme created for a certificate
+            if (errno != ENOENT ||
+                    asprintf(&path, "%s/private/%s/key.pem", confdir,
+                        de->d_name) < 0)
+            {
+                continue;
+            }
+            r = access(path, F_OK);
+            free(path);
+            if (r < 0)
+            {
+                continue;
+            }
+            status = SCAN_MISSING;
+        }
+        else if (!S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+        if (!scan_add(&entries, &count, &alloc, confdir, de->d_name))
+        {
+            goto out;
+        }
+        scan_entry_t *e = entries + count - 1;
+        e->status = status;
+        const char *value = state_get(idx, e->certdir);
+        const char *names = NULL;
+        if (status == SCAN_PENDING && value &&
+                certidx_parse(value, &st, &e->expiration, NULL, &names))
+        {
+            // records are only written for certificates covering the names
+            // they were issued for, the first of which is the directory
+            e->status = SCAN_VALID;
+            e->covered = true;
+            indexed++;
+            if (names && !(e->names = strdup(names)))
+            {
+                warn("cert_scan: strdup failed");
+                goto out;
+            }
+        }
+        else if (status == SCAN_PENDING)
+        {
+            pending++;
+        }
+    }
+    msg(1, "found %zu certificates in %s, %zu indexed in " CERTIDX_FILE,
+            count, confdir, indexed);
+    certidx_compact(idx);
+
+    if (pending > 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t nworkers = ncpu > 0 ? (size_t)ncpu : 1;
+        if (nworkers > SCAN_MAX_WORKERS)
+        {
+            nworkers = SCAN_MAX_WORKERS;
+        }
+        // not worth forking for a handful of certificates
+        if (nworkers > (pending + 15)/16)
+        {
+            nworkers = (pending + 15)/16;
+        }
+        if (nworkers > 1)
+        {
+            msg(1, "parsing %zu certificates with %zu workers", pending,
+                    nworkers);
+            if (!scan_run(entries, count, nworkers))
+            {
+                goto out;
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                if (entries[i].status == SCAN_PENDING)
+                {
+                    scan_parse(entries + i);
+                }
+            }
+        }
+    }
+
+    time_t now = time(NULL);
+    for (size_t i = 0; i < count; i++)
+    {
+        scan_entry_t *e = entries + i;
+        if (e->status == SCAN_VALID)
+        {
+            e->renewal = e->expiration - (time_t)validity*24*3600;
+            if (jitter && e->names)
+            {
+                char **names = names_split(e->names);
+                if (!names)
+                {
+                    goto out;
+                }
+                e->renewal -= cert_jitter((const char * const *)names,
+                        account, jitter);
+                names_free(names);
+            }
+            if (!e->covered)
+            {
+                e->status = SCAN_UNCOVERED;
+            }
+            else if (e->renewal < now)
+            {
+                e->status = SCAN_DUE;
+            }
+        }
+    }
+    if (plan)
+    {
+        scan_plan(entries, count, json);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        scan_entry_t *e = entries + i;
+        if (e->status != SCAN_VALID)
+        {
+            entries[due++] = *e;
+        }
+        else
+        {
+            free(e->certdir);
+            free(e->names);
+        }
+    }
+    count = due;
+    qsort(entries, count, sizeof(scan_entry_t), scan_cmp);
+
+    if (json && !plan)
+    {
+        printf("[");
+    }
+    for (size_t i = 0; i < count && !plan; i++)
+    {
+        scan_report(entries + i, json, i == 0);
+    }
+    if (json && !plan)
+    {
+        printf("%s]\n", count ? "\n" : "");
+    }
+    if (fflush(stdout))
+    {
+        warn("failed to write report");
+        goto out;
+    }
+    msg(1, "%zu certificates due for renewal", count);
+    ret = count ? 0 : 1;
+
+out:
+    for (size_t i = 0; i < count; i++)
+    {
+        free(entries[i].certdir);
+        free(entries[i].names);
+    }
+    free(entries);
+    state_free(idx);
+    free(idxfile);
+    closedir(dir);
+    return ret;
+}
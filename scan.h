@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Checks every certificate directory under confdir and reports the ones
+ * that are missing, unreadable, do not cover their directory name or
+ * expire in less than validity days, plus the offset cert_jitter() gives
+ * them within a window of jitter hours. With plan the report is replaced
+ * by the number of certificates falling due in each hour. Returns 0 if
+ * any certificate is due, 1 if none is and 2 on failure, like the issue
+ * action.
+ */
+int cert_scan(const char *confdir, int validity, int jitter,
+        uint64_t account, bool json, bool plan);
+
+#endif
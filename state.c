@@ -0,0 +1,484 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "state.h"
+
+static size_t state_hash(const char *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 0x100000001b3ULL;
+    }
+    return (size_t)h;
+}
+
+static bool state_rehash(state_t *s)
+{
+    size_t size = 64;
+    while (size < 2*s->alloc)
+    {
+        size *= 2;
+    }
+    size_t *table = calloc(size, sizeof(size_t));
+    if (!table)
+    {
+        warn("state_rehash: calloc failed");
+        return false;
+    }
+    for (size_t i = 0; i < s->count; i++)
+    {
+        size_t h = state_hash(s->keys[i]) & (size - 1);
+        while (table[h])
+        {
+            h = (h + 1) & (size - 1);
+        }
+        table[h] = i + 1;
+    }
+    free(s->table);
+    s->table = table;
+    s->table_size = size;
+    return true;
+}
+
+static ssize_t state_find(const state_t *s, const char *key)
+{
+    if (!s->table_size)
+    {
+        return -1;
+    }
+    size_t h = state_hash(key) & (s->table_size - 1);
+    while (s->table[h])
+    {
+        size_t i = s->table[h] - 1;
+        if (strcmp(s->keys[i], key) == 0)
+        {
+            return i;
+        }
+        h = (h + 1) & (s->table_size - 1);
+    }
+    return -1;
+}
+
+static bool state_add(state_t *s, char *key, char *value)
+{
+    ssize_t i = state_find(s, key);
+    if (i >= 0)
+    {
+        free(key);
+        free(s->values[i]);
+        s->values[i] = value;
+        return true;
+    }
+    if (s->count == s->alloc)
+    {
+        size_t alloc = s->alloc ? 2*s->alloc : 64;
+        char **keys = realloc(s->keys, alloc * sizeof(char *));
+        if (!keys)
+        {
+            warn("state_add: realloc failed");
+            return false;
+        }
+        s->keys = keys;
+        char **values = realloc(s->values, alloc * sizeof(char *));
+        if (!values)
+        {
+            warn("state_add: realloc failed");
+            return false;
+        }
+        s->values = values;
+        s->alloc = alloc;
+        if (!state_rehash(s))
+        {
+            return false;
+        }
+    }
+    s->keys[s->count] = key;
+    s->values[s->count] = value;
+    size_t h = state_hash(key) & (s->table_size - 1);
+    while (s->table[h])
+    {
+        h = (h + 1) & (s->table_size - 1);
+    }
+    s->table[h] = ++s->count;
+    return true;
+}
+
+// Opens and locks PATH.lock, returns its descriptor or -1
+static int state_lock(const char *path)
+{
+    char *lockfile = NULL;
+    if (asprintf(&lockfile, "%s.lock", path) < 0)
+    {
+        warnx("state_lock: asprintf failed");
+        return -1;
+    }
+    int fd = open(lockfile, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        warn("state_lock: failed to open %s", lockfile);
+        free(lockfile);
+        return -1;
+    }
+    struct flock fl =
+    {
+        .l_type = F_WRLCK,
+        .l_whence = SEEK_SET
+    };
+    while (fcntl(fd, F_SETLKW, &fl) < 0)
+    {
+        if (errno != EINTR)
+        {
+            warn("state_lock: failed to lock %s", lockfile);
+            close(fd);
+            fd = -1;
+            break;
+        }
+    }
+    free(lockfile);
+    return fd;
+}
+
+state_t *state_load(const char *path, bool lock)
+{
+    char *line = NULL;
+    size_t len = 0;
+    FILE *f = NULL;
+    state_t *s = calloc(1, sizeof(state_t));
+    if (!s)
+    {
+        warn("state_load: calloc failed");
+        return NULL;
+    }
+    s->lockfd = -1;
+    s->path = strdup(path);
+    if (!s->path)
+    {
+        warn("state_load: strdup failed");
+        goto fail;
+    }
+
+    if (lock && (s->lockfd = state_lock(path)) < 0)
+    {
+        goto fail;
+    }
+
+    f = fopen(path, "r");
+    if (!f)
+    {
+        if (errno == ENOENT)
+        {
+            return s;
+        }
+        warn("state_load: failed to open %s", path);
+        goto fail;
+    }
+    ssize_t r;
+    while ((r = getline(&line, &len, f)) > 0)
+    {
+        if (line[r-1] == '\n')
+        {
+            line[r-1] = 0;
+        }
+        char *tab = strchr(line, '\t');
+        if (!tab)
+        {
+            continue;
+        }
+        char *key = strndup(line, tab - line);
+        char *value = strdup(tab + 1);
+        if (!key || !value)
+        {
+            warn("state_load: strdup failed");
+            free(key);
+            free(value);
+            goto fail;
+        }
+        if (state_find(s, key) >= 0)
+        {
+            s->stale++;
+        }
+        if (!state_add(s, key, value))
+        {
+            free(key);
+            free(value);
+            goto fail;
+        }
+    }
+    free(line);
+    fclose(f);
+    return s;
+
+fail:
+    free(line);
+    if (f) fclose(f);
+    state_free(s);
+    return NULL;
+}
+
+char *state_read(const char *path, const char *key)
+{
+    char *ret = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    size_t keylen = strlen(key);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        if (errno != ENOENT)
+        {
+            warn("state_read: failed to open %s", path);
+        }
+        return NULL;
+    }
+    ssize_t r;
+    while ((r = getline(&line, &len, f)) > 0)
+    {
+        if ((size_t)r > keylen && line[keylen] == '\t' &&
+                strncmp(line, key, keylen) == 0)
+        {
+            if (line[r-1] == '\n')
+            {
+                line[r-1] = 0;
+            }
+            // records appended later supersede this one
+            free(ret);
+            ret = strdup(line + keylen + 1);
+            if (!ret)
+            {
+                warn("state_read: strdup failed");
+                break;
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+const char *state_get(const state_t *s, const char *key)
+{
+    ssize_t i = state_find(s, key);
+    return i < 0 ? NULL : s->values[i];
+}
+
+bool state_set(state_t *s, const char *key, const char *format, ...)
+{
+    char *value = NULL;
+    va_list ap;
+    if (strpbrk(key, "\t\n"))
+    {
+        warnx("state_set: invalid key %s", key);
+        return false;
+    }
+    va_start(ap, format);
+    if (vasprintf(&value, format, ap) < 0)
+    {
+        value = NULL;
+    }
+    va_end(ap);
+    char *k = strdup(key);
+    if (!value || !k)
+    {
+        warnx("state_set: allocation failed");
+        free(value);
+        free(k);
+        return false;
+    }
+    if (strchr(value, '\n'))
+    {
+        warnx("state_set: invalid value for %s", key);
+        free(value);
+        free(k);
+        return false;
+    }
+    if (!state_add(s, k, value))
+    {
+        free(value);
+        free(k);
+        return false;
+    }
+    return true;
+}
+
+bool state_append(const char *path, const char *key, const char *format,
+        ...)
+{
+    bool success = false;
+    char *value = NULL, *line = NULL;
+    int len, fd = -1, lockfd = -1;
+    struct stat st;
+    va_list ap;
+    va_start(ap, format);
+    if (vasprintf(&value, format, ap) < 0)
+    {
+        value = NULL;
+    }
+    va_end(ap);
+    if (!value)
+    {
+        warnx("state_append: vasprintf failed");
+        return false;
+    }
+    if (strpbrk(key, "\t\n") || strchr(value, '\n'))
+    {
+        warnx("state_append: invalid record for %s", key);
+        goto out;
+    }
+    len = asprintf(&line, "%s\t%s\n", key, value);
+    if (len < 0)
+    {
+        line = NULL;
+        warnx("state_append: asprintf failed");
+        goto out;
+    }
+    if ((lockfd = state_lock(path)) < 0)
+    {
+        goto out;
+    }
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+            S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        warn("state_append: failed to open %s", path);
+        goto out;
+    }
+    if (write(fd, line, len) != len || fsync(fd) < 0)
+    {
+        warn("state_append: failed to write %s", path);
+        // a partial record would run into the next one
+        if (ftruncate(fd, st.st_size) < 0)
+        {
+            warn("state_append: failed to truncate %s", path);
+        }
+        goto out;
+    }
+    success = true;
+out:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (lockfd >= 0)
+    {
+        close(lockfd);
+    }
+    free(line);
+    free(value);
+    return success;
+}
+
+void state_del(state_t *s, const char *key)
+{
+    ssize_t i = state_find(s, key);
+    if (i >= 0)
+    {
+        // keep the slot so that the hash table stays valid
+        free(s->values[i]);
+        s->values[i] = NULL;
+    }
+}
+
+bool state_save(state_t *s)
+{
+    bool success = false;
+    char *tmpfile = NULL;
+    FILE *f = NULL;
+    if (asprintf(&tmpfile, "%s.tmp", s->path) < 0)
+    {
+        warnx("state_save: asprintf failed");
+        return false;
+    }
+    f = fopen(tmpfile, "w");
+    if (!f)
+    {
+        warn("state_save: failed to create %s", tmpfile);
+        goto out;
+    }
+    for (size_t i = 0; i < s->count; i++)
+    {
+        if (s->values[i] && fprintf(f, "%s\t%s\n", s->keys[i],
+                    s->values[i]) < 0)
+        {
+            warn("state_save: failed to write %s", tmpfile);
+            goto out;
+        }
+    }
+    if (fflush(f) || fsync(fileno(f)))
+    {
+        warn("state_save: failed to write %s", tmpfile);
+        goto out;
+    }
+    if (fclose(f))
+    {
+        f = NULL;
+        warn("state_save: failed to close %s", tmpfile);
+        goto out;
+    }
+    f = NULL;
+    if (rename(tmpfile, s->path) < 0)
+    {
+        warn("state_save: failed to rename %s to %s", tmpfile, s->path);
+        goto out;
+    }
+    success = true;
+out:
+    if (f)
+    {
+        fclose(f);
+    }
+    if (!success)
+    {
+        unlink(tmpfile);
+    }
+    free(tmpfile);
+    return success;
+}
+
+void state_free(state_t *s)
+{
+    if (!s) return;
+    for (size_t i = 0; i < s->count; i++)
+    {
+        free(s->keys[i]);
+        free(s->values[i]);
+    }
+    if (s->lockfd >= 0)
+    {
+        close(s->lockfd);
+    }
+    free(s->keys);
+    free(s->values);
+    free(s->table);
+    free(s->path);
+    free(s);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Small persistent key/value files, one "KEY<TAB>VALUE" record per line.
+ * Writers serialize on PATH.lock and replace PATH atomically, so readers
+ * never need to lock. state_append() adds a single record at the end of
+ * PATH instead, the last record for a key wins and the ones it supersedes
+ * are counted in stale and dropped by the next state_save().
+ */
+typedef struct state
+{
+    char *path;
+    int lockfd;
+    size_t count;
+    size_t alloc;
+    size_t stale;
+    char **keys;
+    char **values;
+    size_t *table;
+    size_t table_size;
+} state_t;
+
+state_t *state_load(const char *path, bool lock);
+char *state_read(const char *path, const char *key);
+const char *state_get(const state_t *s, const char *key);
+bool state_set(state_t *s, const char *key, const char *format, ...);
+bool state_append(const char *path, const char *key, const char *format,
+        ...);
+void state_del(state_t *s, const char *key);
+bool state_save(state_t *s);
+void state_free(state_t *s);
+
+#endif
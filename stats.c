@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+state_t *stats_load(const char *confdir, bool lock)
+{
+    char *path = NULL;
+    if (asprintf(&path, "%s/" STATS_FILE, confdir) < 0)
+    {
+        warnx("stats_load: asprintf failed");
+        return NULL;
+    }
+    state_t *s = state_load(path, lock);
+    free(path);
+    return s;
+}
+
+static bool stats_parse(const char *value, double *attempts,
+        double *failures, double *ms)
+{
+    return value && sscanf(value, "%lf %lf %lf", attempts, failures, ms) == 3
+        && *attempts > 0 && *failures >= 0 && *failures <= *attempts
+        && *ms >= 0;
+}
+
+long long stats_cost(const state_t *s, const char *ident, const char *type)
+{
+    double attempts, failures, ms;
+    char *key = NULL;
+    if (asprintf(&key, "%s %s", ident, type) < 0)
+    {
+        warnx("stats_cost: asprintf failed");
+        return -1;
+    }
+    bool found = stats_parse(state_get(s, key), &attempts, &failures, &ms) ||
+        stats_parse(state_get(s, type), &attempts, &failures, &ms);
+    free(key);
+    if (!found)
+    {
+        return -1;
+    }
+    double success = (attempts - failures) / attempts;
+    if (success < 0.5)
+    {
+        return STATS_UNRELIABLE;
+    }
+    return (long long)(ms / success);
+}
+
+static bool stats_add(state_t *s, const char *key, bool valid, long long ms)
+{
+    double attempts = 0, failures = 0, avg = 0;
+    stats_parse(state_get(s, key), &attempts, &failures, &avg);
+    double successes = attempts - failures;
+    attempts = attempts * STATS_DECAY + 1;
+    failures = failures * STATS_DECAY + (valid ? 0 : 1);
+    if (valid)
+    {
+        // weighted by the decayed number of earlier successes
+        successes *= STATS_DECAY;
+        avg = (avg * successes + ms) / (successes + 1);
+    }
+    return state_set(s, key, "%.3f %.3f %.0f %lld", attempts, failures, avg,
+            (long long)time(NULL));
+}
+
+bool stats_update(state_t *s, const char *ident, const char *type,
+        bool valid, long long ms)
+{
+    char *key = NULL;
+    if (asprintf(&key, "%s %s", ident, type) < 0)
+    {
+        warnx("stats_update: asprintf failed");
+        return false;
+    }
+    bool ok = stats_add(s, key, valid, ms) && stats_add(s, type, valid, ms);
+    free(key);
+    return ok;
+}
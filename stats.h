@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <limits.h>
+#include <stdbool.h>
+
+#include "state.h"
+
+/*
+ * Validation history of the challenge types kept in CONFDIR/challenges.idx,
+ * with an "IDENT TYPE" record per identifier and a "TYPE" record summing up
+ * all identifiers. A record holds the number of attempts and failures and
+ * the average time successful validations took, from offering the
+ * challenge to the server reporting it valid, all decaying with every new
+ * attempt so that recent behaviour outweighs old one.
+ *
+ * stats_cost() estimates how long a validation of TYPE takes for IDENT,
+ * from the record of the identifier or else from the one of the type: the
+ * average time divided by the rate of success. It returns -1 if there is no
+ * history and STATS_UNRELIABLE if most recent attempts failed.
+ */
+#define STATS_FILE "challenges.idx"
+#define STATS_DECAY 0.8
+#define STATS_UNRELIABLE LLONG_MAX
+
+state_t *stats_load(const char *confdir, bool lock);
+long long stats_cost(const state_t *s, const char *ident, const char *type);
+bool stats_update(state_t *s, const char *ident, const char *type,
+        bool valid, long long ms);
+
+#endif
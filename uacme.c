@@ -19,6 +19,7 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -26,24 +27,44 @@
 #include <libgen.h>
 #include <locale.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "ari.h"
+#include "backoff.h"
 #include "base64.h"
+#include "certidx.h"
 #include "curlwrap.h"
 #include "crypto.h"
+#include "dns.h"
+#include "dropin.h"
+#include "hook.h"
+#include "httpd.h"
 #include "json.h"
 #include "msg.h"
+#include "ondemand.h"
+#include "ratelimit.h"
+#include "scan.h"
+#include "state.h"
+#include "stats.h"
+#include "util.h"
+#include "webroot.h"
 
 #define PRODUCTION_URL "https://acme-v02.api.letsencrypt.org/directory"
 #define STAGING_URL "https://acme-staging-v02.api.letsencrypt.org/directory"
 #define DEFAULT_CONFDIR "/etc/ssl/uacme"
+#define HOOKCAP_FILE "hooks.idx"
+#define ORDER_FILE "order.json"
+#define DAEMON_RETRY 3600
+#define DAEMON_RETRY_MAX 86400
 
 typedef struct acme
 {
@@ -59,11 +80,23 @@ typedef struct acme
     char *body;
     char *type;
     const char *directory;
-    const char *hook;
+    hook_t hook;
     const char *email;
     const char *domain;
     const char * const *names;
     const char *confdir;
+    const char *challenges;
+    const char *webroot;
+    const char *listen;
+    const char *tls_listen;
+    httpd_t *httpd;
+    ondemand_t *ondemand;
+    const char *nsupdate;
+    const char *tsig_key;
+    dns_t *dns;
+    int propagation;
+    bool selfcheck;
+    ratelimit_t *rl;
     char *keydir;
     char *dkeydir;
     char *certdir;
@@ -128,8 +161,14 @@ int acme_get(acme_t *a, const char *url)
         warnx("acme_get: curl_get failed");
         goto out;
     }
-    free(a->nonce);
-    a->nonce = find_header(c->headers, "Replay-Nonce");
+    // a GET does not use up the nonce, and not every response carries a
+    // new one (Boulder only sends it on POST and newNonce responses)
+    char *nonce = find_header(c->headers, "Replay-Nonce");
+    if (nonce)
+    {
+        free(a->nonce);
+        a->nonce = nonce;
+    }
     a->type = find_header(c->headers, "Content-Type");
     if (a->type && strstr(a->type, "json"))
     {
@@ -171,6 +210,62 @@ out:
     return ret;
 }
 
+bool acme_error(acme_t *a)
+{
+    if (!a->json) return false;
+
+    if (a->type && strcasecmp(a->type,
+                "application/problem+json") == 0)
+    {
+        warnx("the server reported the following error:");
+        json_dump(stderr, a->json);
+        if (a->rl && json_compare_string(a->json, "type",
+                    "urn:ietf:params:acme:error:rateLimited") == 0)
+        {
+            char *retry = find_header(a->headers, "Retry-After");
+            time_t until = curl_retry_after(retry);
+            free(retry);
+            ratelimit_block(a->rl, a->kid, a->names,
+                    json_find_string(a->json, "detail"), until);
+        }
+        return true;
+    }
+
+    const json_value_t *e = json_find(a->json, "error");
+    if (e && e->type == JSON_OBJECT)
+    {
+        warnx("the server reported the following error:");
+        json_dump(stderr, e);
+        return true;
+    }
+
+    return false;
+}
+
+// Gets a fresh nonce from the newNonce resource of the directory
+static bool acme_nonce(acme_t *a)
+{
+    const char *url = a->dir ? json_find_string(a->dir, "newNonce") : NULL;
+    if (!url)
+    {
+        warnx("failed to find newNonce URL in directory");
+        return false;
+    }
+
+    msg(2, "fetching new nonce at %s", url);
+    if (204 != acme_get(a, url))
+    {
+        warnx("failed to fetch new nonce at %s", url);
+        acme_error(a);
+        return false;
+    }
+    else if (acme_error(a))
+    {
+        return false;
+    }
+    return true;
+}
+
 int acme_post(acme_t *a, const char *url, const char *format, ...)
 {
     int ret = 0;
@@ -184,7 +279,9 @@ int acme_post(acme_t *a, const char *url, const char *format, ...)
         return 0;
     }
 
-    if (!a->nonce)
+    // the previous response may have come without a nonce, from a proxy
+    // answering with an error for instance
+    if (!a->nonce && !acme_nonce(a))
     {
         warnx("acme_post: need a nonce first");
         return 0;
@@ -303,43 +400,6 @@ out:
     return ret;
 }
 
-int hook_run(const char *prog, const char *method, const char *type,
-        const char *ident, const char *token, const char *auth)
-{
-    int ret = -1;
-    pid_t pid = fork();
-    if (pid < 0)
-    {
-        warn("hook_run: fork failed");
-    }
-    else if (pid > 0) // parent
-    {
-        int status;
-        if (waitpid(pid, &status, 0) < 0)
-        {
-            warn("hook_run: waitpid failed");
-        }
-        else if (WIFEXITED(status))
-        {
-            ret = WEXITSTATUS(status);
-        }
-        else
-        {
-            warnx("hook_run: %s terminated abnormally", prog);
-        }
-    }
-    else // child
-    {
-        if (execl(prog, prog, method, type, ident, token, auth,
-                    (char *)NULL) < 0)
-        {
-            warn("hook_run: failed to execute %s", prog);
-            abort();
-        }
-    }
-    return ret;
-}
-
 bool check_or_mkdir(bool allow_create, const char *dir, mode_t mode)
 {
     if (access(dir, F_OK) < 0)
@@ -402,29 +462,6 @@ char *identifiers(const char * const *names)
     return ids;
 }
 
-bool acme_error(acme_t *a)
-{
-    if (!a->json) return false;
-
-    if (a->type && strcasecmp(a->type,
-                "application/problem+json") == 0)
-    {
-        warnx("the server reported the following error:");
-        json_dump(stderr, a->json);
-        return true;
-    }
-
-    const json_value_t *e = json_find(a->json, "error");
-    if (e && e->type == JSON_OBJECT)
-    {
-        warnx("the server reported the following error:");
-        json_dump(stderr, e);
-        return true;
-    }
-
-    return false;
-}
-
 bool acme_bootstrap(acme_t *a)
 {
     msg(1, "fetching directory at %s", a->directory);
@@ -440,26 +477,10 @@ bool acme_bootstrap(acme_t *a)
     }
     a->dir = a->json;
     a->json = NULL;
+    ari_directory(a->confdir, a->directory,
+            json_find_string(a->dir, "renewalInfo") != NULL);
 
-    const char *url = json_find_string(a->dir, "newNonce");
-    if (!url)
-    {
-        warnx("failed to find newNonce URL in directory");
-        return false;
-    }
-
-    msg(2, "fetching new nonce at %s", url);
-    if (204 != acme_get(a, url))
-    {
-        warnx("failed to fetch new nonce at %s", url);
-        acme_error(a);
-        return false;
-    }
-    else if (acme_error(a))
-    {
-        return false;
-    }
-    return true;
+    return acme_nonce(a);
 }
 
 bool account_new(acme_t *a, bool yes)
@@ -780,6 +801,12 @@ bool account_keychange(acme_t *a, bool never, keytype_t type, int bits)
         else
         {
             msg(1, "account key changed");
+            char *thumbprint = jws_thumbprint(newkey);
+            if (thumbprint)
+            {
+                account_cache(a->confdir, thumbprint);
+                free(thumbprint);
+            }
             success = true;
         }
     }
@@ -818,564 +845,2860 @@ bool account_deactivate(acme_t *a)
     return true;
 }
 
-bool authorize(acme_t *a)
+typedef enum
 {
-    bool success = false;
-    char *thumbprint = NULL;
-    json_value_t *auth = NULL;
-    const json_value_t *auths = json_find(a->order, "authorizations");
-    if (!auths || auths->type != JSON_ARRAY)
+    AUTHZ_SELECT,
+    AUTHZ_ACCEPTED,
+    AUTHZ_STARTED,
+    AUTHZ_VALID,
+    AUTHZ_FAILED
+} authz_state_t;
+
+typedef struct authz
+{
+    json_value_t *json;
+    const char *url;
+    const char *ident;
+    const json_value_t *chlgs;
+    size_t *order;
+    size_t norder;
+    size_t next;
+    const char *chlg_url;
+    const char *type;
+    const char *token;
+    char *key_auth;
+    char key_auth_sha[KEY_AUTH_SHA256_LEN];
+    int hook_id;
+    bool batch;
+    bool builtin;
+    bool queued;
+    bool broken;
+    authz_state_t state;
+    long long started;
+    long long elapsed;
+} authz_t;
+
+static const char *authz_key(const authz_t *z)
+{
+    return z->key_auth ? z->key_auth : z->key_auth_sha;
+}
+
+// Whether challenges of this type are handled in-process, without a hook
+static bool authz_builtin(const acme_t *a, const char *type)
+{
+    if (strcmp(type, "http-01") == 0)
     {
-        warnx("failed to parse authorizations URL");
-        goto out;
+        return a->webroot || a->listen;
     }
-
-    thumbprint = jws_thumbprint(a->key);
-    if (!thumbprint)
+    else if (strcmp(type, "tls-alpn-01") == 0)
     {
-        goto out;
+        return a->tls_listen;
+    }
+    else if (strcmp(type, "dns-01") == 0)
+    {
+        return a->nsupdate;
     }
+    return false;
+}
 
-    for (size_t i=0; i<auths->v.array.size; i++)
+// Runs METHOD for a challenge handled in-process, returning 0 on success
+// like a hook would
+static int authz_builtin_run(const acme_t *a, const authz_t *z,
+        const char *method)
+{
+    if (strcmp(z->type, "tls-alpn-01") == 0)
     {
-        if (auths->v.array.values[i].type != JSON_STRING)
+        if (strcmp(method, "begin") == 0)
         {
-            warnx("failed to parse authorizations URL");
-            goto out;
+            return httpd_put_alpn(a->httpd, z->ident, authz_key(z)) ? 0 : 1;
         }
-        msg(1, "retrieving authorization at %s",
-                auths->v.array.values[i].v.value);
-        if (200 != acme_post(a, auths->v.array.values[i].v.value, ""))
+        return httpd_del_alpn(a->httpd, z->ident) ? 0 : 1;
+    }
+    if (a->httpd && a->listen)
+    {
+        if (strcmp(method, "begin") == 0)
         {
-            warnx("failed to retrieve auth %s",
-                    auths->v.array.values[i].v.value);
-            acme_error(a);
-            goto out;
+            return httpd_put(a->httpd, z->token, authz_key(z)) ? 0 : 1;
         }
-        const char *status = json_find_string(a->json, "status");
-        if (status && strcmp(status, "valid") == 0)
+        return httpd_del(a->httpd, z->token) ? 0 : 1;
+    }
+    if (strcmp(method, "begin") == 0)
+    {
+        return webroot_put(a->webroot, z->token, authz_key(z)) ? 0 : 1;
+    }
+    return webroot_del(a->webroot, z->token) ? 0 : 1;
+}
+
+// Adds or removes the TXT records of the queued dns-01 challenges with
+// one dynamic update per zone. Challenges whose records could not be
+// added go back to selection.
+static bool authz_dns(const acme_t *a, authz_t *authz, size_t count,
+        bool add)
+{
+    bool success = false;
+    size_t n = 0;
+    char **names = calloc(count, sizeof(char *));
+    const char **values = calloc(count, sizeof(char *));
+    size_t *index = calloc(count, sizeof(size_t));
+    bool *done = calloc(count, sizeof(bool));
+    if (!names || !values || !index || !done)
+    {
+        warn("authz_dns: calloc failed");
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        authz_t *z = authz + i;
+        if (!z->queued)
         {
             continue;
         }
-        if (!status || strcmp(status, "pending") != 0)
+        if (asprintf(names + n, "_acme-challenge.%s", z->ident) < 0)
         {
-            warnx("unexpected auth status (%s) at %s",
-                status ? status : "unknown",
-                auths->v.array.values[i].v.value);
-            acme_error(a);
+            names[n] = NULL;
+            warnx("authz_dns: asprintf failed");
             goto out;
         }
-        const json_value_t *ident = json_find(a->json, "identifier");
-        if (json_compare_string(ident, "type", "dns") != 0)
+        values[n] = authz_key(z);
+        index[n++] = i;
+    }
+    if (n == 0)
+    {
+        success = true;
+        goto out;
+    }
+    dns_update(a->dns, add, (const char * const *)names, values, done, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        authz_t *z = authz + index[i];
+        z->queued = false;
+        if (add && !done[i])
         {
-            warnx("no valid identifier in auth %s",
-                    auths->v.array.values[i].v.value);
-            goto out;
+            msg(1, "challenge %s declined", z->type);
+            z->state = AUTHZ_SELECT;
+            z->builtin = false;
         }
-        const char *ident_value = json_find_string(ident, "value");
-        if (!ident_value || strlen(ident_value) <= 0)
+    }
+    success = true;
+out:
+    for (size_t i = 0; names && i < n; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(values);
+    free(index);
+    free(done);
+    return success;
+}
+
+// Puts the challenge types that validated fastest in the past first and
+// the ones that mostly failed last. Types without history keep the place
+// authz_order() gave them, the others are reordered among their places.
+static void authz_rank(const state_t *stats, authz_t *z)
+{
+    size_t *slot = calloc(z->norder + 1, sizeof(size_t));
+    long long *cost = calloc(z->norder + 1, sizeof(long long));
+    if (!slot || !cost)
+    {
+        warn("authz_rank: calloc failed");
+        goto out;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < z->norder; i++)
+    {
+        const char *type = json_find_string(z->chlgs->v.array.values +
+                z->order[i], "type");
+        long long c = stats_cost(stats, z->ident, type);
+        if (c == STATS_UNRELIABLE)
         {
-            warnx("no valid identifier in auth %s",
-                    auths->v.array.values[i].v.value);
-            goto out;
+            msg(2, "%s for %s mostly failed recently", type, z->ident);
         }
-        const json_value_t *chlgs = json_find(a->json, "challenges");
-        if (!chlgs || chlgs->type != JSON_ARRAY)
+        else if (c >= 0)
         {
-            warnx("no challenges in auth %s",
-                    auths->v.array.values[i].v.value);
-            goto out;
+            msg(2, "%s for %s expected to take %lld ms", type, z->ident, c);
         }
-        json_free(auth);
-        auth = a->json;
-        a->json = NULL;
-
-        bool chlg_done = false;
-        for (size_t j=0; j<chlgs->v.array.size && !chlg_done; j++)
+        else
         {
-            if (json_compare_string(chlgs->v.array.values+j,
-                        "status", "pending") == 0)
-            {
-                const char *url = json_find_string(
-                        chlgs->v.array.values+j, "url");
-                const char *type = json_find_string(
-                        chlgs->v.array.values+j, "type");
-                const char *token = json_find_string(
-                        chlgs->v.array.values+j, "token");
-                char *key_auth = NULL;
-                if (!type || !url || !token)
-                {
-                    warnx("failed to parse challenge");
-                    goto out;
-                }
-                if (strcmp(type, "dns-01") == 0 ||
-                        strcmp(type, "tls-alpn-01") == 0)
-                {
-                    key_auth = sha2_base64url(256, "%s.%s", token, thumbprint);
-                }
-                else if (asprintf(&key_auth, "%s.%s", token, thumbprint) < 0)
-                {
-                    key_auth = NULL;
-                }
-                if (!key_auth)
-                {
-                    warnx("failed to generate authorization key");
-                    goto out;
-                }
-                if (a->hook && strlen(a->hook) > 0)
-                {
-                    msg(2, "type=%s", type);
-                    msg(2, "ident=%s", ident_value);
-                    msg(2, "token=%s", token);
-                    msg(2, "key_auth=%s", key_auth);
-                    msg(1, "running %s %s %s %s %s %s", a->hook, "begin",
-                            type, ident_value, token, key_auth);
-                    int r = hook_run(a->hook, "begin", type, ident_value, token,
-                            key_auth);
-                    msg(2, "hook returned %d", r);
-                    if (r < 0)
-                    {
-                        free(key_auth);
-                        goto out;
-                    }
-                    else if (r > 0)
-                    {
-                        msg(1, "challenge %s declined", type);
-                        free(key_auth);
-                        continue;
-                    }
-                }
-                else
-                {
-                    char c = 0;
-                    msg(0, "challenge=%s ident=%s token=%s key_auth=%s",
-                        type, ident_value, token, key_auth);
-                    msg(0, "type 'y' to accept challenge, anything else to skip");
-                    if (scanf(" %c", &c) != 1 || tolower(c) != 'y')
-                    {
-                        free(key_auth);
-                        continue;
-                    }
-                }
-
-                msg(1, "starting challenge at %s", url);
-                if (200 != acme_post(a, url, "{}"))
-                {
-                    warnx("failed to start challenge at %s", url);
-                    acme_error(a);
-                }
-                else while (!chlg_done)
-                {
-                    msg(1, "polling challenge status at %s", url);
-                    if (200 != acme_post(a, url, ""))
-                    {
-                        warnx("failed to poll challenge status at %s", url);
-                        acme_error(a);
-                        break;
-                    }
-                    const char *status = json_find_string(a->json, "status");
-                    if (status && strcmp(status, "valid") == 0)
-                    {
-                        chlg_done = true;
-                    }
-                    else if (!status || (strcmp(status, "processing") != 0 &&
-                            strcmp(status, "pending") != 0))
-                    {
-                        warnx("challenge %s failed with status %s",
-                                url, status ? status : "unknown");
-                        acme_error(a);
-                        break;
-                    }
-                    else
-                    {
-                        msg(2, "challenge %s, waiting 5 seconds", status);
-                        sleep(5);
-                    }
-                }
-                if (a->hook && strlen(a->hook) > 0)
-                {
-                    const char *method = chlg_done ? "done" : "failed";
-                    msg(1, "running %s %s %s %s %s %s", a->hook, method,
-                            type, ident_value, token, key_auth);
-                    hook_run(a->hook, method, type, ident_value, token, key_auth);
-                }
-                free(key_auth);
-                if (!chlg_done)
-                {
-                    goto out;
-                }
-            }
+            continue;
         }
-        if (!chlg_done)
+        slot[n] = i;
+        cost[n++] = c;
+    }
+    // stable insertion sort of the ranked types over their own places
+    for (size_t i = 1; i < n; i++)
+    {
+        size_t o = z->order[slot[i]];
+        long long c = cost[i];
+        size_t k = i;
+        while (k > 0 && cost[k - 1] > c)
         {
-            warnx("no challenge completed");
-            goto out;
+            z->order[slot[k]] = z->order[slot[k - 1]];
+            cost[k] = cost[k - 1];
+            k--;
         }
+        z->order[slot[k]] = o;
+        cost[k] = c;
     }
-
-    success = true;
-
 out:
-    json_free(auth);
-    free(thumbprint);
-    return success;
+    free(slot);
+    free(cost);
 }
 
-bool cert_issue(acme_t *a, bool status_req)
+// Lists the pending (or, when resuming, processing) challenges of the
+// authorization in the order they are to be offered: the order of
+// --challenges if given, otherwise the server's with the types handled
+// in-process first. Types the hook has declared it does not support are
+// left out, as are types not handled in-process if there is no hook but a
+// built-in provider.
+static bool authz_order(const acme_t *a, authz_t *z, bool use_hook,
+        const state_t *stats)
 {
-    bool success = false;
-    char *csr = NULL;
-    char *orderurl = NULL;
-    char *certfile = NULL;
-    char *bakfile = NULL;
-    char *tmpfile = NULL;
-    time_t t = time(NULL);
-    int fd = -1;
-    char *ids = identifiers(a->names);
-    if (!ids)
+    const json_value_t *chlgs = z->chlgs;
+    z->norder = 0;
+    z->order = calloc(chlgs->v.array.size + 1, sizeof(size_t));
+    if (!z->order)
     {
-        warnx("failed to process alternate names");
-        goto out;
+        warn("authz_order: calloc failed");
+        return false;
     }
-
-    const char *url = json_find_string(a->dir, "newOrder");
-    if (!url)
+    const char *pref = a->challenges;
+    do
     {
-        warnx("failed to find newOrder URL in directory");
-        goto out;
+        size_t len = pref ? strcspn(pref, ",") : 0;
+        for (size_t j = 0; j < chlgs->v.array.size; j++)
+        {
+            const json_value_t *chlg = chlgs->v.array.values + j;
+            const char *type = json_find_string(chlg, "type");
+            if (!type || (json_compare_string(chlg, "status", "pending") &&
+                        json_compare_string(chlg, "status", "processing")))
+            {
+                continue;
+            }
+            if (pref && (strlen(type) != len || strncmp(type, pref, len)))
+            {
+                continue;
+            }
+            if (authz_builtin(a, type))
+            {
+                if (!pref)
+                {
+                    // keep the server's order among built-in types
+                    size_t k = z->norder;
+                    while (k > 0 && !authz_builtin(a, json_find_string(
+                                    chlgs->v.array.values + z->order[k - 1],
+                                    "type")))
+                    {
+                        z->order[k] = z->order[k - 1];
+                        k--;
+                    }
+                    z->order[k] = j;
+                    z->norder++;
+                    continue;
+                }
+            }
+            else if (use_hook && !hook_supports(&a->hook, type))
+            {
+                msg(2, "%s does not support %s, skipping",
+                        a->hook.prog, type);
+                continue;
+            }
+            else if (!use_hook && (a->webroot || a->listen ||
+                        a->tls_listen || a->nsupdate))
+            {
+                msg(2, "no provider for %s, skipping", type);
+                continue;
+            }
+            z->order[z->norder++] = j;
+            if (pref)
+            {
+                // only one challenge of each type is expected
+                break;
+            }
+        }
+        pref = pref ? (pref[len] ? pref + len + 1 : NULL) : NULL;
+    } while (pref && z->norder < chlgs->v.array.size);
+    if (!a->challenges && stats)
+    {
+        authz_rank(stats, z);
     }
+    return true;
+}
 
-    msg(1, "creating new order for %s at %s", a->domain, url);
-    if (201 != acme_post(a, url, ids))
+// Moves to the next challenge of the authorization with the given status,
+// returning 1 if there is one, 0 if there are no more and -1 on failure
+static int authz_next(authz_t *z, const char *thumbprint, const char *status)
+{
+    free(z->key_auth);
+    z->key_auth = NULL;
+    while (z->next < z->norder)
     {
-        warnx("failed to create new order at %s", url);
-        acme_error(a);
-        goto out;
+        const json_value_t *chlg = z->chlgs->v.array.values +
+            z->order[z->next++];
+        if (json_compare_string(chlg, "status", status) != 0)
+        {
+            continue;
+        }
+        z->chlg_url = json_find_string(chlg, "url");
+        z->type = json_find_string(chlg, "type");
+        z->token = json_find_string(chlg, "token");
+        if (!z->type || !z->chlg_url || !z->token)
+        {
+            warnx("failed to parse challenge");
+            return -1;
+        }
+        if (strcmp(z->type, "dns-01") == 0 ||
+                strcmp(z->type, "tls-alpn-01") == 0)
+        {
+            if (!key_auth_sha256(z->key_auth_sha, z->token, thumbprint))
+            {
+                warnx("failed to generate authorization key");
+                return -1;
+            }
+        }
+        else if (asprintf(&z->key_auth, "%s.%s", z->token, thumbprint) < 0)
+        {
+            z->key_auth = NULL;
+            warnx("failed to generate authorization key");
+            return -1;
+        }
+        msg(2, "type=%s", z->type);
+        msg(2, "ident=%s", z->ident);
+        msg(2, "token=%s", z->token);
+        msg(2, "key_auth=%s", authz_key(z));
+        return 1;
     }
-    const char *status = json_find_string(a->json, "status");
-    if (!status || (strcmp(status, "pending") && strcmp(status, "ready")))
+    return 0;
+}
+
+// Offers every pending challenge of every authorization to the hook in a
+// single begin-batch request, so that it can for instance update a DNS zone
+// and wait for propagation once per order. Authorizations left without an
+// accepted challenge fall back to individual begin requests.
+static bool authz_begin_batch(acme_t *a, authz_t *authz, size_t count,
+        const char *thumbprint)
+{
+    bool success = false;
+    size_t n = 0, nsha = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        warnx("invalid order status (%s)", status ? status : "unknown");
-        acme_error(a);
-        goto out;
+        n += authz[i].norder;
     }
-    orderurl = find_header(a->headers, "Location");
-    if (!orderurl)
+    hook_chlg_t *chlgs = calloc(n, sizeof(hook_chlg_t));
+    size_t *owner = calloc(n, sizeof(size_t));
+    size_t *index = calloc(n, sizeof(size_t));
+    const char **tokens = calloc(n, sizeof(char *));
+    char (*sha)[KEY_AUTH_SHA256_LEN] = calloc(n, sizeof(*sha));
+    char **key_auth = calloc(n, sizeof(char *));
+    if (!chlgs || !owner || !index || !tokens || !sha || !key_auth)
     {
-        warnx("order location not found");
+        warn("authz_begin_batch: calloc failed");
         goto out;
     }
-    msg(1, "order URL: %s", orderurl);
-    a->order = a->json;
-    a->json = NULL;
 
-    if (strcmp(status, "ready") != 0)
+    n = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        if (!authorize(a))
-        {
-            warnx("failed to authorize order at %s", orderurl);
-            goto out;
-        }
-        while (1)
+        const json_value_t *c = authz[i].chlgs;
+        for (size_t j = 0; j < authz[i].norder; j++)
         {
-            msg(1, "polling order status at %s", orderurl);
-            if (200 != acme_post(a, orderurl, ""))
+            const json_value_t *chlg = c->v.array.values + authz[i].order[j];
+            const char *type = json_find_string(chlg, "type");
+            const char *token = json_find_string(chlg, "token");
+            if (json_compare_string(chlg, "status", "pending") != 0 ||
+                    !type || !token || !json_find_string(chlg, "url") ||
+                    authz_builtin(a, type))
             {
-                warnx("failed to poll order status at %s", orderurl);
-                acme_error(a);
-                goto out;
+                continue;
             }
-            status = json_find_string(a->json, "status");
-            if (status && strcmp(status, "ready") == 0)
+            chlgs[n].type = type;
+            chlgs[n].ident = authz[i].ident;
+            chlgs[n].token = token;
+            if (strcmp(type, "dns-01") == 0 ||
+                    strcmp(type, "tls-alpn-01") == 0)
             {
-                json_free(a->order);
-                a->order = a->json;
-                a->json = NULL;
-                break;
+                tokens[nsha] = token;
+                chlgs[n].auth = sha[nsha++];
             }
-            else if (!status || strcmp(status, "pending") != 0)
+            else if (asprintf(key_auth + n, "%s.%s", token, thumbprint) < 0)
             {
-                warnx("unexpected order status (%s) at %s",
-                        status ? status : "unknown", orderurl);
-                acme_error(a);
+                key_auth[n] = NULL;
+                warnx("failed to generate authorization key");
                 goto out;
             }
             else
             {
-                msg(2, "order pending, waiting 5 seconds");
-                sleep(5);
+                chlgs[n].auth = key_auth[n];
             }
+            owner[n] = i;
+            index[n++] = j;
         }
     }
-
-    msg(1, "generating certificate request");
-    csr = csr_gen(a->names, status_req, a->dkey);
-    if (!csr)
-    {
-        warnx("failed to generate certificate signing request");
-        goto out;
-    }
-
-    const char *finalize = json_find_string(a->order, "finalize");
-    if (!finalize)
+    if (!key_auth_sha256_batch(nsha, tokens, thumbprint, sha))
     {
-        warnx("failed to find finalize URL");
+        warnx("failed to generate authorization key");
         goto out;
     }
 
-    msg(1, "finalizing order at %s", finalize);
-    if (200 != acme_post(a, finalize, "{\"csr\": \"%s\"}", csr))
+    int r = hook_batch(&a->hook, "begin-batch", chlgs, n);
+    if (r < 0)
     {
-        warnx("failed to finalize order at %s", finalize);
-        acme_error(a);
         goto out;
     }
-    else if (acme_error(a))
+    else if (r > 0)
     {
-        goto out;
+        msg(1, "batch declined");
     }
-
-    while (1)
+    for (size_t i = 0; r == 0 && i < n; i++)
     {
-        msg(1, "polling order status at %s", orderurl);
-        if (200 != acme_post(a, orderurl, ""))
-        {
-            warnx("failed to poll order status at %s", orderurl);
-            acme_error(a);
-            goto out;
-        }
-        status = json_find_string(a->json, "status");
-        if (status && strcmp(status, "valid") == 0)
+        authz_t *z = authz + owner[i];
+        if (!chlgs[i].accepted || z->state != AUTHZ_SELECT)
         {
-            json_free(a->order);
-            a->order = a->json;
-            a->json = NULL;
-            break;
+            continue;
         }
-        else if (!status || strcmp(status, "processing") != 0)
+        z->next = index[i];
+        if (authz_next(z, thumbprint, "pending") != 1)
         {
-            warnx("unexpected order status (%s) at %s",
-                    status ? status : "unknown", orderurl);
-            acme_error(a);
             goto out;
         }
-        else
-        {
-            msg(2, "order processing, waiting 5 seconds");
-            sleep(5);
-        }
+        z->state = AUTHZ_ACCEPTED;
+        z->batch = true;
     }
+    success = true;
 
-    const char *certurl = json_find_string(a->order, "certificate");
-    if (!certurl)
+out:
+    for (size_t i = 0; key_auth && i < n; i++)
     {
-        warnx("failed to parse certificate url");
-        goto out;
+        free(key_auth[i]);
     }
+    free(chlgs);
+    free(owner);
+    free(index);
+    free(tokens);
+    free(sha);
+    free(key_auth);
+    return success;
+}
 
-    msg(1, "retrieving certificate at %s", certurl);
-    if (200 != acme_post(a, certurl, ""))
-    {
-        warnx("failed to retrieve certificate at %s", certurl);
-        acme_error(a);
-        goto out;
-    }
-    else if (acme_error(a))
+// Reports the outcome of the challenges accepted by begin-batch with one
+// done-batch and one failed-batch request
+static void authz_end_batch(acme_t *a, authz_t *authz, size_t count)
+{
+    hook_chlg_t *chlgs = calloc(count, sizeof(hook_chlg_t));
+    if (!chlgs)
     {
-        goto out;
+        warn("authz_end_batch: calloc failed");
+        return;
     }
-
-    if (asprintf(&certfile, "%s/cert.pem", a->certdir) < 0)
+    for (int valid = 1; valid >= 0; valid--)
     {
-        certfile = NULL;
-        warnx("cert_issue: vasprintf failed");
-        goto out;
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            authz_t *z = authz + i;
+            if (z->batch && (z->state == AUTHZ_VALID) == valid)
+            {
+                chlgs[n].type = z->type;
+                chlgs[n].ident = z->ident;
+                chlgs[n].token = z->token;
+                chlgs[n].auth = authz_key(z);
+                n++;
+            }
+        }
+        if (n > 0)
+        {
+            hook_batch(&a->hook, valid ? "done-batch" : "failed-batch",
+                    chlgs, n);
+        }
     }
+    free(chlgs);
+}
 
-    if (asprintf(&tmpfile, "%s/cert.pem.tmp", a->certdir) < 0)
+// Waits for the given number of milliseconds, answering http-01
+// validation requests meanwhile if the embedded responder is running
+static void authz_sleep(acme_t *a, int ms)
+{
+    if (a->ondemand)
     {
-        tmpfile = NULL;
-        warnx("cert_issue: vasprintf failed");
-        goto out;
+        // requests for the names being issued join the running job
+        ondemand_serve(a->ondemand, 0, -1);
     }
-
-    if (asprintf(&bakfile, "%s/cert-%llu.pem", a->certdir,
-                (unsigned long long)t) < 0)
+    if (a->httpd)
     {
-        bakfile = NULL;
-        warnx("cert_issue: vasprintf failed");
-        goto out;
+        httpd_serve(a->httpd, ms);
     }
-
-    msg(1, "saving certificate to %s", tmpfile);
-    fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IRGRP|S_IROTH);
-    if (fd < 0)
+    else if (ms > 0)
     {
-        warn("failed to create %s", tmpfile);
-        goto out;
+        struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
     }
+}
 
-    if (write(fd, a->body, strlen(a->body)) != (ssize_t)strlen(a->body))
-    {
-        warn("failed to write to %s", tmpfile);
-        goto out;
-    }
+static void authz_idle(void *arg)
+{
+    authz_sleep((acme_t *)arg, 0);
+}
 
-    if (close(fd) < 0)
+// Fetches the key authorizations of all the accepted http-01 challenges
+// concurrently, as the ACME server will, and fails the challenges whose
+// response does not match instead of starting them. The authorization
+// then stays pending and can be retried rather than becoming invalid.
+static bool authz_selfcheck(acme_t *a, authz_t *authz, size_t count)
+{
+    bool success = false;
+    size_t n = 0;
+    char **urls = calloc(count, sizeof(char *));
+    size_t *index = calloc(count, sizeof(size_t));
+    curldata_t **data = calloc(count, sizeof(curldata_t *));
+    if (!urls || !index || !data)
     {
-        warn("failed to close %s", tmpfile);
+        warn("authz_selfcheck: calloc failed");
         goto out;
     }
-    else
-    {
-        fd = -1;
-    }
-
-    if (link(certfile, bakfile) < 0)
+    for (size_t i = 0; i < count; i++)
     {
-        if (errno != ENOENT)
+        authz_t *z = authz + i;
+        if (z->state != AUTHZ_ACCEPTED || strcmp(z->type, "http-01") != 0)
         {
-            warn("failed to link %s to %s", bakfile, certfile);
+            continue;
+        }
+        if (asprintf(urls + n, "http://%s/.well-known/acme-challenge/%s",
+                    z->ident, z->token) < 0)
+        {
+            urls[n] = NULL;
+            warnx("authz_selfcheck: asprintf failed");
             goto out;
         }
+        index[n++] = i;
     }
-    else
+    if (n == 0)
     {
-        msg(1, "backed up %s as %s", certfile, bakfile);
+        success = true;
+        goto out;
     }
-
-    msg(1, "renaming %s to %s", tmpfile, certfile);
-    if (rename(tmpfile, certfile) < 0)
+    msg(1, "checking %zu http-01 challenge%s", n, n > 1 ? "s" : "");
+    if (!curl_get_many((const char * const *)urls, data, n, 10,
+                authz_idle, a))
     {
-        warn("failed to rename %s to %s", tmpfile, certfile);
-        unlink(bakfile);
         goto out;
     }
-
+    for (size_t i = 0; i < n; i++)
+    {
+        authz_t *z = authz + index[i];
+        curldata_t *c = data[i];
+        if (c)
+        {
+            // trailing whitespace is ignored by ACME servers
+            while (c->body_len > 0 && isspace((unsigned char)c->body[c->body_len - 1]))
+            {
+                c->body[--c->body_len] = 0;
+            }
+        }
+        if (!c || c->code != 200)
+        {
+            warnx("self-check of %s failed: %s", urls[i],
+                    c ? "unexpected HTTP status" : "no response");
+            if (c)
+            {
+                msg(1, "HTTP status %d", c->code);
+            }
+            z->state = AUTHZ_FAILED;
+            z->broken = true;
+        }
+        else if (strcmp(c->body, authz_key(z)) != 0)
+        {
+            warnx("self-check of %s failed: unexpected content", urls[i]);
+            msg(1, "expected \"%s\", got \"%.*s\"", authz_key(z), 100,
+                    c->body);
+            z->state = AUTHZ_FAILED;
+            z->broken = true;
+        }
+        else
+        {
+            msg(1, "self-check of %s succeeded", urls[i]);
+        }
+    }
     success = true;
 out:
-    if (fd >= 0) close(fd);
-    free(bakfile);
-    free(tmpfile);
-    free(certfile);
-    free(csr);
-    free(ids);
-    free(orderurl);
+    for (size_t i = 0; i < n; i++)
+    {
+        free(urls[i]);
+        curldata_free(data[i]);
+    }
+    free(urls);
+    free(index);
+    free(data);
     return success;
 }
 
-bool cert_revoke(acme_t *a, const char *certfile, int reason_code)
+static void authz_start(acme_t *a, authz_t *z)
 {
-    bool success = false;
-    char *certfiledup = NULL;
-    char *revokedfile = NULL;
-    const char *url = NULL;
-    char *crt = cert_der_base64url(certfile);
-    if (!crt)
+    msg(1, "starting challenge at %s", z->chlg_url);
+    if (200 != acme_post(a, z->chlg_url, "{}"))
     {
-        warnx("failed to load %s", certfile);
-        goto out;
+        warnx("failed to start challenge at %s", z->chlg_url);
+        acme_error(a);
+        z->state = AUTHZ_FAILED;
     }
-
-    url = json_find_string(a->dir, "revokeCert");
-    if (!url)
+    else
     {
-        warnx("failed to find revokeCert URL in directory");
-        goto out;
+        z->state = AUTHZ_STARTED;
     }
+}
 
-    msg(1, "revoking %s at %s", certfile, url);
-    if (200 != acme_post(a, url, "{\"certificate\":\"%s\",\"reason\":%d}",
-            crt, reason_code))
+// Starts each accepted dns-01 challenge as soon as its TXT record is
+// visible on all the authoritative name servers of its zone, and the
+// remaining ones anyway once a->propagation seconds have passed
+static bool authz_propagate(acme_t *a, authz_t *authz, size_t count)
+{
+    bool success = false;
+    size_t n = 0, pending;
+    dns_probe_t *probe = NULL;
+    char **names = calloc(count, sizeof(char *));
+    const char **values = calloc(count, sizeof(char *));
+    size_t *index = calloc(count, sizeof(size_t));
+    bool *done = calloc(count, sizeof(bool));
+    if (!names || !values || !index || !done)
     {
-        warnx("failed to revoke %s at %s", certfile, url);
-        acme_error(a);
+        warn("authz_propagate: calloc failed");
         goto out;
     }
-    else if (acme_error(a))
+    for (size_t i = 0; i < count; i++)
     {
-        goto out;
+        authz_t *z = authz + i;
+        if (z->state != AUTHZ_ACCEPTED || strcmp(z->type, "dns-01") != 0)
+        {
+            continue;
+        }
+        if (asprintf(names + n, "_acme-challenge.%s", z->ident) < 0)
+        {
+            names[n] = NULL;
+            warnx("authz_propagate: asprintf failed");
+            goto out;
+        }
+        values[n] = authz_key(z);
+        index[n++] = i;
     }
-    msg(1, "revoked %s", certfile);
-    certfiledup = strdup(certfile);
-    if (!certfiledup)
+    if (n == 0)
     {
-        warnx("strdup failed");
-        certfiledup = NULL;
+        success = true;
         goto out;
     }
-    if (asprintf(&revokedfile, "%s/revoked-%llu.pem", dirname(certfiledup),
-                (unsigned long long)time(NULL)) < 0)
+    msg(1, "waiting up to %d seconds for %zu TXT record%s to propagate",
+            a->propagation, n, n > 1 ? "s" : "");
+    probe = dns_probe((const char * const *)names, values, n);
+    if (!probe)
     {
-        warnx("asprintf failed");
-        revokedfile = NULL;
         goto out;
     }
-    msg(1, "renaming %s to %s", certfile, revokedfile);
-    if (rename(certfile, revokedfile) < 0)
+    time_t deadline = time(NULL) + a->propagation;
+    do
     {
-        warn("failed to rename %s to %s", certfile, revokedfile);
+        // short waits so that the embedded responder keeps answering
+        pending = dns_probe_wait(probe, 250, done);
+        for (size_t i = 0; i < n; i++)
+        {
+            authz_t *z = authz + index[i];
+            if (done[i] && z->state == AUTHZ_ACCEPTED)
+            {
+                authz_start(a, z);
+            }
+        }
+        authz_sleep(a, 0);
+    } while (pending > 0 && time(NULL) < deadline);
+    for (size_t i = 0; i < n; i++)
+    {
+        authz_t *z = authz + index[i];
+        if (z->state == AUTHZ_ACCEPTED)
+        {
+            warnx("%s not visible on all name servers after %d seconds, "
+                    "starting challenge anyway", names[i], a->propagation);
+            authz_start(a, z);
+        }
     }
     success = true;
 out:
-    free(crt);
-    free(revokedfile);
-    free(certfiledup);
+    dns_probe_free(probe);
+    for (size_t i = 0; names && i < n; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(values);
+    free(index);
+    free(done);
     return success;
 }
 
-bool validate_domain_str(const char *s)
+// Records how the challenges the server finished validating fared
+static void authz_stats(const acme_t *a, const authz_t *authz, size_t count)
 {
-    size_t len = 0;
-    for (size_t j = 0; j < strlen(s); j++)
+    bool ok = true;
+    state_t *s = NULL;
+    for (size_t i = 0; i < count; i++)
+    {
+        const authz_t *z = authz + i;
+        if (z->elapsed <= 0)
+        {
+            continue;
+        }
+        if (!s && !(s = stats_load(a->confdir, true)))
+        {
+            return;
+        }
+        ok = ok && stats_update(s, z->ident, z->type,
+                z->state == AUTHZ_VALID, z->elapsed);
+    }
+    if (s && (!ok || !state_save(s)))
+    {
+        warnx("failed to update %s/" STATS_FILE, a->confdir);
+    }
+    state_free(s);
+}
+
+// Authorizations are processed in phases rather than one at a time: all of
+// them are retrieved, challenges are offered to the hook for all of them
+// (concurrently, each hook request is only waited for after all have been
+// submitted), all accepted challenges are started and then polled together.
+bool authorize(acme_t *a)
+{
+    bool success = false;
+    bool use_hook = a->hook.prog && strlen(a->hook.prog) > 0;
+    char *thumbprint = NULL;
+    authz_t *authz = NULL;
+    state_t *stats = NULL;
+    size_t count = 0;
+    const json_value_t *auths = json_find(a->order, "authorizations");
+    if (!auths || auths->type != JSON_ARRAY)
+    {
+        warnx("failed to parse authorizations URL");
+        goto out;
+    }
+
+    thumbprint = jws_thumbprint(a->key);
+    if (!thumbprint)
+    {
+        goto out;
+    }
+
+    authz = calloc(auths->v.array.size, sizeof(authz_t));
+    if (!authz)
+    {
+        warn("authorize: calloc failed");
+        goto out;
+    }
+
+    for (size_t i=0; i<auths->v.array.size; i++)
+    {
+        if (auths->v.array.values[i].type != JSON_STRING)
+        {
+            warnx("failed to parse authorizations URL");
+            goto out;
+        }
+        const char *url = auths->v.array.values[i].v.value;
+        msg(1, "retrieving authorization at %s", url);
+        if (200 != acme_post(a, url, ""))
+        {
+            warnx("failed to retrieve auth %s", url);
+            acme_error(a);
+            goto out;
+        }
+        const char *status = json_find_string(a->json, "status");
+        if (status && strcmp(status, "valid") == 0)
+        {
+            continue;
+        }
+        if (!status || strcmp(status, "pending") != 0)
+        {
+            warnx("unexpected auth status (%s) at %s",
+                status ? status : "unknown", url);
+            acme_error(a);
+            goto out;
+        }
+        const json_value_t *ident = json_find(a->json, "identifier");
+        if (json_compare_string(ident, "type", "dns") != 0)
+        {
+            warnx("no valid identifier in auth %s", url);
+            goto out;
+        }
+        const char *ident_value = json_find_string(ident, "value");
+        if (!ident_value || strlen(ident_value) <= 0)
+        {
+            warnx("no valid identifier in auth %s", url);
+            goto out;
+        }
+        const json_value_t *chlgs = json_find(a->json, "challenges");
+        if (!chlgs || chlgs->type != JSON_ARRAY)
+        {
+            warnx("no challenges in auth %s", url);
+            goto out;
+        }
+        authz_t *z = authz + count++;
+        z->json = a->json;
+        a->json = NULL;
+        z->url = url;
+        z->ident = ident_value;
+        z->chlgs = chlgs;
+        z->hook_id = -1;
+        z->state = AUTHZ_SELECT;
+    }
+
+    if (use_hook && count > 0)
+    {
+        char *cache = NULL;
+        if (asprintf(&cache, "%s/" HOOKCAP_FILE, a->confdir) < 0)
+        {
+            warnx("authorize: asprintf failed");
+            goto out;
+        }
+        hook_capabilities(&a->hook, cache);
+        free(cache);
+    }
+
+    stats = count > 0 ? stats_load(a->confdir, false) : NULL;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!authz_order(a, authz + i, use_hook, stats))
+        {
+            goto out;
+        }
+    }
+
+    if ((a->listen || a->tls_listen) && !a->httpd && count > 0)
+    {
+        a->httpd = httpd_start(a->listen, a->tls_listen);
+        if (!a->httpd)
+        {
+            goto out;
+        }
+    }
+
+    // a challenge already being validated, when resuming an order left by
+    // an interrupted run, is polled rather than started again
+    for (size_t i = 0; i < count; i++)
+    {
+        authz_t *z = authz + i;
+        int r = authz_next(z, thumbprint, "processing");
+        z->next = 0;
+        if (r < 0)
+        {
+            goto out;
+        }
+        else if (r == 0)
+        {
+            continue;
+        }
+        msg(1, "challenge %s for %s is already being validated", z->type,
+                z->ident);
+        z->state = AUTHZ_STARTED;
+        if (strcmp(z->type, "dns-01") == 0 && authz_builtin(a, z->type))
+        {
+            z->builtin = true;
+            z->queued = true;
+        }
+        else if (authz_builtin(a, z->type))
+        {
+            z->builtin = authz_builtin_run(a, z, "begin") == 0;
+        }
+    }
+
+    // validations are timed from the moment challenges are offered
+    long long started = util_now();
+    for (size_t i = 0; i < count; i++)
+    {
+        if (authz[i].state == AUTHZ_SELECT)
+        {
+            authz[i].started = started;
+        }
+    }
+
+    if (a->nsupdate && !a->dns && count > 0)
+    {
+        a->dns = dns_init(a->nsupdate, a->tsig_key);
+        if (!a->dns)
+        {
+            goto out;
+        }
+    }
+
+    if (use_hook && a->hook.batch && count > 0 &&
+            !authz_begin_batch(a, authz, count, thumbprint))
+    {
+        goto out;
+    }
+
+    bool selecting = count > 0;
+    while (selecting)
+    {
+        selecting = false;
+        for (size_t i = 0; i < count; i++)
+        {
+            authz_t *z = authz + i;
+            if (z->state != AUTHZ_SELECT)
+            {
+                continue;
+            }
+            int r = authz_next(z, thumbprint, "pending");
+            if (r < 0)
+            {
+                goto out;
+            }
+            else if (r == 0)
+            {
+                warnx("no challenge completed for %s", z->ident);
+                z->broken = true;
+                goto out;
+            }
+            selecting = true;
+            if (strcmp(z->type, "dns-01") == 0 && authz_builtin(a, z->type))
+            {
+                // added together with the others once all are selected
+                z->state = AUTHZ_ACCEPTED;
+                z->builtin = true;
+                z->queued = true;
+            }
+            else if (authz_builtin(a, z->type))
+            {
+                if (authz_builtin_run(a, z, "begin") == 0)
+                {
+                    z->state = AUTHZ_ACCEPTED;
+                    z->builtin = true;
+                }
+                else
+                {
+                    msg(1, "challenge %s declined", z->type);
+                }
+            }
+            else if (use_hook)
+            {
+                z->hook_id = hook_submit(&a->hook, "begin", z->type,
+                        z->ident, z->token, authz_key(z));
+                if (z->hook_id < 0)
+                {
+                    goto out;
+                }
+            }
+            else
+            {
+                char c = 0;
+                msg(0, "challenge=%s ident=%s token=%s key_auth=%s",
+                    z->type, z->ident, z->token, authz_key(z));
+                msg(0, "type 'y' to accept challenge, anything else to skip");
+                if (scanf(" %c", &c) == 1 && tolower(c) == 'y')
+                {
+                    z->state = AUTHZ_ACCEPTED;
+                }
+            }
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            authz_t *z = authz + i;
+            if (z->hook_id < 0)
+            {
+                continue;
+            }
+            int r = hook_wait(&a->hook, z->hook_id);
+            z->hook_id = -1;
+            if (r < 0)
+            {
+                goto out;
+            }
+            else if (r > 0)
+            {
+                msg(1, "challenge %s declined", z->type);
+            }
+            else
+            {
+                z->state = AUTHZ_ACCEPTED;
+            }
+        }
+        if (a->dns && !authz_dns(a, authz, count, true))
+        {
+            goto out;
+        }
+    }
+
+    if (a->selfcheck && !authz_selfcheck(a, authz, count))
+    {
+        goto out;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        authz_t *z = authz + i;
+        if (z->state == AUTHZ_ACCEPTED && (a->propagation == 0 ||
+                    strcmp(z->type, "dns-01") != 0))
+        {
+            authz_start(a, z);
+        }
+    }
+
+    if (a->propagation > 0 && !authz_propagate(a, authz, count))
+    {
+        goto out;
+    }
+
+    bool pending = true;
+    while (pending)
+    {
+        pending = false;
+        for (size_t i = 0; i < count; i++)
+        {
+            authz_t *z = authz + i;
+            if (z->state != AUTHZ_STARTED)
+            {
+                continue;
+            }
+            // requests can arrive at any time once the challenges started
+            authz_sleep(a, 0);
+            msg(1, "polling challenge status at %s", z->chlg_url);
+            if (200 != acme_post(a, z->chlg_url, ""))
+            {
+                warnx("failed to poll challenge status at %s", z->chlg_url);
+                acme_error(a);
+                z->state = AUTHZ_FAILED;
+                continue;
+            }
+            const char *status = json_find_string(a->json, "status");
+            if (status && strcmp(status, "valid") == 0)
+            {
+                z->state = AUTHZ_VALID;
+            }
+            else if (!status || (strcmp(status, "processing") != 0 &&
+                    strcmp(status, "pending") != 0))
+            {
+                warnx("challenge %s failed with status %s",
+                        z->chlg_url, status ? status : "unknown");
+                acme_error(a);
+                z->state = AUTHZ_FAILED;
+                z->broken = true;
+                if (a->rl)
+                {
+                    ratelimit_failed(a->rl, z->ident);
+                }
+            }
+            else
+            {
+                msg(2, "challenge %s %s", z->chlg_url, status);
+                pending = true;
+            }
+            if (z->started && z->state != AUTHZ_STARTED)
+            {
+                z->elapsed = util_now() - z->started;
+            }
+        }
+        if (pending)
+        {
+            msg(2, "waiting 5 seconds");
+            authz_sleep(a, 5000);
+        }
+    }
+
+    success = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (authz[i].state != AUTHZ_VALID)
+        {
+            success = false;
+        }
+    }
+
+out:
+    state_free(stats);
+    authz_stats(a, authz, count);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (authz[i].state == AUTHZ_VALID)
+        {
+            backoff_passed(a->confdir, authz[i].ident);
+        }
+        else if (authz[i].broken)
+        {
+            backoff_failed(a->confdir, authz[i].ident);
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        authz_t *z = authz + i;
+        if (z->hook_id >= 0 && hook_wait(&a->hook, z->hook_id) == 0)
+        {
+            z->state = AUTHZ_ACCEPTED;
+        }
+        z->hook_id = -1;
+    }
+    if (use_hook && a->hook.batch)
+    {
+        authz_end_batch(a, authz, count);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        authz_t *z = authz + i;
+        if (z->builtin && strcmp(z->type, "dns-01") == 0)
+        {
+            // records queued but never added are left alone
+            z->queued = !z->queued;
+        }
+        else if (z->builtin)
+        {
+            authz_builtin_run(a, z, z->state == AUTHZ_VALID ?
+                    "done" : "failed");
+        }
+        else if (use_hook && z->state != AUTHZ_SELECT && !z->batch)
+        {
+            const char *method = z->state == AUTHZ_VALID ? "done" : "failed";
+            z->hook_id = hook_submit(&a->hook, method, z->type, z->ident,
+                    z->token, authz_key(z));
+        }
+    }
+    if (a->dns)
+    {
+        authz_dns(a, authz, count, false);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        authz_t *z = authz + i;
+        if (z->hook_id >= 0)
+        {
+            hook_wait(&a->hook, z->hook_id);
+        }
+        free(z->key_auth);
+        free(z->order);
+        json_free(z->json);
+    }
+    free(authz);
+    free(thumbprint);
+    return success;
+}
+
+// Validates the names of a certificate ahead of its renewal, so that the
+// order eventually created for it finds every authorization valid and is
+// ready at once. Wildcard names cannot be pre-authorized and are left to
+// the order. The authorizations created through newAuthz are handed to
+// authorize() as if they belonged to an order.
+bool preauthorize(acme_t *a)
+{
+    bool success = false;
+    json_value_t *order = a->order;
+    json_value_t *authz = NULL;
+    size_t count = 0;
+    const char *url = json_find_string(a->dir, "newAuthz");
+    if (!url)
+    {
+        msg(1, "the server does not support pre-authorization");
+        return false;
+    }
+
+    // authorize() is handed an order holding just the authorization URLs,
+    // built directly since they come from the server and are not escaped
+    while (a->names[count])
+    {
+        count++;
+    }
+    authz = calloc(1, sizeof(json_value_t));
+    if (!authz)
+    {
+        warn("preauthorize: calloc failed");
+        return false;
+    }
+    authz->type = JSON_OBJECT;
+    json_value_t *key = authz->v.object.names = calloc(1,
+            sizeof(json_value_t));
+    json_value_t *auths = authz->v.object.values = calloc(1,
+            sizeof(json_value_t));
+    json_value_t *urls = calloc(count + 1, sizeof(json_value_t));
+    if (!key || !auths || !urls ||
+            !(key->v.value = strdup("authorizations")))
+    {
+        warn("preauthorize: allocation failed");
+        free(urls);
+        goto out;
+    }
+    key->type = JSON_STRING;
+    key->parent = authz;
+    auths->type = JSON_ARRAY;
+    auths->parent = authz;
+    auths->v.array.values = urls;
+    authz->v.object.size = 1;
+
+    for (int i = 0; a->names[i]; i++)
+    {
+        const char *name = a->names[i];
+        if (name[0] == '*' && name[1] == '.')
+        {
+            msg(1, "not pre-authorizing wildcard %s", name);
+            continue;
+        }
+        msg(1, "pre-authorizing %s", name);
+        if (201 != acme_post(a, url, "{\"identifier\":"
+                    "{\"type\":\"dns\",\"value\":\"%s\"}}", name))
+        {
+            warnx("failed to pre-authorize %s", name);
+            acme_error(a);
+            goto out;
+        }
+        char *authzurl = find_header(a->headers, "Location");
+        if (!authzurl)
+        {
+            warnx("failed to parse authorization URL");
+            goto out;
+        }
+        json_value_t *v = urls + auths->v.array.size++;
+        v->type = JSON_STRING;
+        v->v.value = authzurl;
+        v->parent = auths;
+    }
+    if (auths->v.array.size == 0)
+    {
+        success = true;
+        goto out;
+    }
+
+    a->order = authz;
+    success = authorize(a);
+out:
+    a->order = order;
+    json_free(authz);
+    return success;
+}
+
+// Returns the renewal information identifier of certdir/cert.pem, or NULL
+// if the CA does not provide renewal information or there is no such file
+static char *ari_cert_id(const acme_t *a, const char *certdir)
+{
+    char *certfile = NULL;
+    char *id = NULL;
+    if (!json_find_string(a->dir, "renewalInfo"))
+    {
+        return NULL;
+    }
+    if (asprintf(&certfile, "%s/cert.pem", certdir) < 0)
+    {
+        warnx("ari_cert_id: asprintf failed");
+        return NULL;
+    }
+    if (access(certfile, R_OK) == 0)
+    {
+        id = cert_ari_id(certfile);
+    }
+    free(certfile);
+    return id;
+}
+
+// Asks the CA when it wants certdir/cert.pem renewed, unless the answer in
+// the cache is still current, and returns true if that time has come. The
+// next time worth checking again is stored in next.
+static bool ari_due(acme_t *a, const char *certdir, time_t *next)
+{
+    time_t now = time(NULL);
+    ari_t ari = {0, 0, 0, 0};
+    if (!ari_lookup(a->confdir, certdir, &ari) || ari.refresh <= now)
+    {
+        const char *base = json_find_string(a->dir, "renewalInfo");
+        char *id = ari_cert_id(a, certdir);
+        char *url = NULL;
+        if (!id)
+        {
+            memset(&ari, 0, sizeof(ari));
+            ari.refresh = now + ARI_RETRY_MAX;
+        }
+        else if (asprintf(&url, "%s%s%s", base,
+                    base[strlen(base) - 1] == '/' ? "" : "/", id) < 0)
+        {
+            url = NULL;
+            warnx("ari_due: asprintf failed");
+            ari.refresh = now + ARI_RETRY;
+        }
+        else
+        {
+            msg(1, "fetching renewal information at %s", url);
+            int r = acme_get(a, url);
+            char *retry = find_header(a->headers, "Retry-After");
+            if (r != 200 || !ari_update(&ari, a->json, retry))
+            {
+                warnx("failed to fetch renewal information at %s", url);
+                acme_error(a);
+                ari.refresh = now + ARI_RETRY;
+            }
+            free(retry);
+        }
+        ari_store(a->confdir, certdir, &ari);
+        free(url);
+        free(id);
+    }
+    if (next)
+    {
+        *next = ari.renew && ari.renew < ari.refresh ?
+            ari.renew : ari.refresh;
+    }
+    if (!ari.renew)
+    {
+        return false;
+    }
+    char buf[0x40];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S %z",
+            localtime(&ari.renew));
+    msg(1, "renewal of %s/cert.pem suggested on %s", certdir, buf);
+    return ari.renew <= now;
+}
+
+// Saves the order in progress to certdir/order.json after every step, so
+// that a run that gets killed or fails can be resumed by the next one
+static void order_save(const acme_t *a, const char *orderurl)
+{
+    char *file = NULL, *tmp = NULL;
+    FILE *f = NULL;
+    if (asprintf(&file, "%s/" ORDER_FILE, a->certdir) < 0 ||
+            asprintf(&tmp, "%s.tmp", file) < 0)
+    {
+        warnx("order_save: asprintf failed");
+        goto out;
+    }
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (fd < 0 || !(f = fdopen(fd, "w")))
+    {
+        warn("failed to create %s", tmp);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        goto out;
+    }
+    fprintf(f, "{\"url\": \"%s\", \"order\": ", orderurl);
+    json_dump(f, a->order);
+    fprintf(f, "}\n");
+    // on disk before it replaces the previous state, or a crash could
+    // leave an empty order.json behind
+    bool synced = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !synced)
+    {
+        warn("failed to write %s", tmp);
+        unlink(tmp);
+    }
+    else if (rename(tmp, file) < 0)
+    {
+        warn("failed to rename %s to %s", tmp, file);
+        unlink(tmp);
+    }
+    else
+    {
+        msg(2, "saved order state to %s", file);
+    }
+out:
+    free(tmp);
+    free(file);
+}
+
+static void order_remove(const acme_t *a)
+{
+    char *file = NULL;
+    if (asprintf(&file, "%s/" ORDER_FILE, a->certdir) < 0)
+    {
+        warnx("order_remove: asprintf failed");
+        return;
+    }
+    if (unlink(file) < 0 && errno != ENOENT)
+    {
+        warn("failed to remove %s", file);
+    }
+    free(file);
+}
+
+static bool order_matches(const json_value_t *order,
+        const char * const *names)
+{
+    const json_value_t *ids = json_find(order, "identifiers");
+    if (!ids || ids->type != JSON_ARRAY)
+    {
+        return false;
+    }
+    const char **values = calloc(ids->v.array.size + 1, sizeof(char *));
+    if (!values)
+    {
+        warn("order_matches: calloc failed");
+        return false;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < ids->v.array.size; i++)
+    {
+        const char *v = json_find_string(ids->v.array.values + i, "value");
+        if (v)
+        {
+            values[n++] = v;
+        }
+    }
+    bool match = names_equal(values, names);
+    free(values);
+    return match;
+}
+
+// Picks up the order left in certdir/order.json by a previous run, if it
+// is still usable, returning its URL with a->order refreshed from the CA
+static char *order_resume(acme_t *a)
+{
+    char *file = NULL, *orderurl = NULL, *buf = NULL;
+    json_value_t *saved = NULL;
+    struct stat st;
+    if (asprintf(&file, "%s/" ORDER_FILE, a->certdir) < 0)
+    {
+        warnx("order_resume: asprintf failed");
+        return NULL;
+    }
+    int fd = open(file, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+        {
+            warn("failed to open %s", file);
+        }
+        goto out;
+    }
+    if (fstat(fd, &st) < 0 || !(buf = calloc(1, st.st_size + 1)) ||
+            read(fd, buf, st.st_size) != st.st_size)
+    {
+        warn("failed to read %s", file);
+        close(fd);
+        goto out;
+    }
+    close(fd);
+    saved = json_parse(buf, st.st_size);
+    const char *url = json_find_string(saved, "url");
+    if (!url || !order_matches(json_find(saved, "order"), a->names))
+    {
+        msg(1, "discarding %s, it is not an order for the same names", file);
+        order_remove(a);
+        goto out;
+    }
+    msg(1, "resuming order at %s", url);
+    if (200 != acme_post(a, url, ""))
+    {
+        warnx("failed to retrieve order at %s, creating a new one", url);
+        acme_error(a);
+        order_remove(a);
+        goto out;
+    }
+    const char *status = json_find_string(a->json, "status");
+    if (!status || !order_matches(a->json, a->names) ||
+            (strcmp(status, "pending") && strcmp(status, "ready") &&
+             strcmp(status, "processing") && strcmp(status, "valid")))
+    {
+        msg(1, "order at %s is %s, creating a new one", url,
+                status ? status : "unusable");
+        order_remove(a);
+        goto out;
+    }
+    if (!(orderurl = strdup(url)))
+    {
+        warn("order_resume: strdup failed");
+        goto out;
+    }
+    json_free(a->order);
+    a->order = a->json;
+    a->json = NULL;
+out:
+    json_free(saved);
+    free(buf);
+    free(file);
+    return orderurl;
+}
+
+// Polls the order until it leaves the given status
+static const char *order_poll(acme_t *a, const char *orderurl,
+        const char *status)
+{
+    while (1)
+    {
+        msg(1, "polling order status at %s", orderurl);
+        if (200 != acme_post(a, orderurl, ""))
+        {
+            warnx("failed to poll order status at %s", orderurl);
+            acme_error(a);
+            return NULL;
+        }
+        json_free(a->order);
+        a->order = a->json;
+        a->json = NULL;
+        const char *s = json_find_string(a->order, "status");
+        if (!s || strcmp(s, status) != 0)
+        {
+            order_save(a, orderurl);
+            return s ? s : "unknown";
+        }
+        msg(2, "order %s, waiting 5 seconds", status);
+        sleep(5);
+    }
+}
+
+bool cert_issue(acme_t *a, bool status_req)
+{
+    bool success = false;
+    char *csr = NULL;
+    char *orderurl = NULL;
+    char *certfile = NULL;
+    char *bakfile = NULL;
+    char *tmpfile = NULL;
+    time_t t = time(NULL);
+    int fd = -1;
+    char *payload = NULL;
+    char *replaces = NULL;
+    char *ids = identifiers(a->names);
+    if (!ids)
+    {
+        warnx("failed to process alternate names");
+        goto out;
+    }
+
+    // tell the CA which certificate this order renews, so that it can
+    // exempt it from rate limits
+    if (a->certdir && (replaces = ari_cert_id(a, a->certdir)))
+    {
+        if (asprintf(&payload, "%.*s,\"replaces\":\"%s\"}",
+                    (int)strlen(ids) - 1, ids, replaces) < 0)
+        {
+            payload = NULL;
+            warnx("cert_issue: asprintf failed");
+            goto out;
+        }
+    }
+
+    const char *status = NULL;
+    orderurl = order_resume(a);
+    if (orderurl)
+    {
+        status = json_find_string(a->order, "status");
+        msg(1, "order URL: %s (%s)", orderurl, status);
+        goto resume;
+    }
+
+    const char *url = json_find_string(a->dir, "newOrder");
+    if (!url)
+    {
+        warnx("failed to find newOrder URL in directory");
+        goto out;
+    }
+
+    msg(1, "creating new order for %s at %s", a->domain, url);
+    int r = acme_post(a, url, payload ? payload : ids);
+    if (r != 201 && payload && json_compare_string(a->json, "type",
+                "urn:ietf:params:acme:error:alreadyReplaced") == 0)
+    {
+        msg(1, "%s/cert.pem was already replaced, ordering without "
+                "replaces", a->certdir);
+        r = acme_post(a, url, ids);
+    }
+    if (r != 201)
+    {
+        warnx("failed to create new order at %s", url);
+        acme_error(a);
+        goto out;
+    }
+    if (a->rl)
+    {
+        ratelimit_order(a->rl, a->kid);
+    }
+    status = json_find_string(a->json, "status");
+    if (!status || (strcmp(status, "pending") && strcmp(status, "ready")))
+    {
+        warnx("invalid order status (%s)", status ? status : "unknown");
+        acme_error(a);
+        goto out;
+    }
+    orderurl = find_header(a->headers, "Location");
+    if (!orderurl)
+    {
+        warnx("order location not found");
+        goto out;
+    }
+    msg(1, "order URL: %s", orderurl);
+    a->order = a->json;
+    a->json = NULL;
+    order_save(a, orderurl);
+
+resume:
+    if (strcmp(status, "pending") == 0)
+    {
+        if (!authorize(a))
+        {
+            warnx("failed to authorize order at %s", orderurl);
+            goto out;
+        }
+        status = order_poll(a, orderurl, "pending");
+        if (!status)
+        {
+            goto out;
+        }
+    }
+
+    if (strcmp(status, "ready") == 0)
+    {
+        msg(1, "generating certificate request");
+        csr = csr_gen(a->names, status_req, a->dkey);
+        if (!csr)
+        {
+            warnx("failed to generate certificate signing request");
+            goto out;
+        }
+
+        const char *finalize = json_find_string(a->order, "finalize");
+        if (!finalize)
+        {
+            warnx("failed to find finalize URL");
+            goto out;
+        }
+
+        msg(1, "finalizing order at %s", finalize);
+        if (200 != acme_post(a, finalize, "{\"csr\": \"%s\"}", csr))
+        {
+            warnx("failed to finalize order at %s", finalize);
+            acme_error(a);
+            goto out;
+        }
+        else if (acme_error(a))
+        {
+            goto out;
+        }
+        status = order_poll(a, orderurl, "ready");
+        if (!status)
+        {
+            goto out;
+        }
+    }
+
+    if (strcmp(status, "processing") == 0)
+    {
+        status = order_poll(a, orderurl, "processing");
+        if (!status)
+        {
+            goto out;
+        }
+    }
+
+    if (strcmp(status, "valid") != 0)
+    {
+        warnx("unexpected order status (%s) at %s", status, orderurl);
+        acme_error(a);
+        if (strcmp(status, "invalid") == 0)
+        {
+            order_remove(a);
+        }
+        goto out;
+    }
+
+    const char *certurl = json_find_string(a->order, "certificate");
+    if (!certurl)
+    {
+        warnx("failed to parse certificate url");
+        goto out;
+    }
+
+    msg(1, "retrieving certificate at %s", certurl);
+    if (200 != acme_post(a, certurl, ""))
+    {
+        warnx("failed to retrieve certificate at %s", certurl);
+        acme_error(a);
+        goto out;
+    }
+    else if (acme_error(a))
+    {
+        goto out;
+    }
+
+    // the CA counts the certificate as issued whether or not it gets saved
+    if (a->rl)
+    {
+        ratelimit_issued(a->rl, a->names);
+    }
+
+    if (asprintf(&certfile, "%s/cert.pem", a->certdir) < 0)
+    {
+        certfile = NULL;
+        warnx("cert_issue: vasprintf failed");
+        goto out;
+    }
+
+    if (asprintf(&tmpfile, "%s/cert.pem.tmp", a->certdir) < 0)
+    {
+        tmpfile = NULL;
+        warnx("cert_issue: vasprintf failed");
+        goto out;
+    }
+
+    if (asprintf(&bakfile, "%s/cert-%llu.pem", a->certdir,
+                (unsigned long long)t) < 0)
+    {
+        bakfile = NULL;
+        warnx("cert_issue: vasprintf failed");
+        goto out;
+    }
+
+    msg(1, "saving certificate to %s", tmpfile);
+    fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IRGRP|S_IROTH);
+    if (fd < 0)
+    {
+        warn("failed to create %s", tmpfile);
+        goto out;
+    }
+
+    if (write(fd, a->body, strlen(a->body)) != (ssize_t)strlen(a->body))
+    {
+        warn("failed to write to %s", tmpfile);
+        goto out;
+    }
+
+    if (close(fd) < 0)
+    {
+        warn("failed to close %s", tmpfile);
+        goto out;
+    }
+    else
+    {
+        fd = -1;
+    }
+
+    if (link(certfile, bakfile) < 0)
+    {
+        if (errno != ENOENT)
+        {
+            warn("failed to link %s to %s", bakfile, certfile);
+            goto out;
+        }
+    }
+    else
+    {
+        msg(1, "backed up %s as %s", certfile, bakfile);
+    }
+
+    msg(1, "renaming %s to %s", tmpfile, certfile);
+    if (rename(tmpfile, certfile) < 0)
+    {
+        warn("failed to rename %s to %s", tmpfile, certfile);
+        unlink(bakfile);
+        goto out;
+    }
+
+    if (!certidx_update(a->confdir, a->certdir, a->names))
+    {
+        warnx("failed to index %s", certfile);
+    }
+    order_remove(a);
+
+    success = true;
+out:
+    if (fd >= 0) close(fd);
+    free(bakfile);
+    free(tmpfile);
+    free(certfile);
+    free(csr);
+    free(ids);
+    free(payload);
+    free(replaces);
+    free(orderurl);
+    return success;
+}
+
+bool cert_revoke(acme_t *a, const char *certfile, int reason_code)
+{
+    bool success = false;
+    char *certfiledup = NULL;
+    char *revokedfile = NULL;
+    const char *url = NULL;
+    char *crt = cert_der_base64url(certfile);
+    if (!crt)
+    {
+        warnx("failed to load %s", certfile);
+        goto out;
+    }
+
+    url = json_find_string(a->dir, "revokeCert");
+    if (!url)
+    {
+        warnx("failed to find revokeCert URL in directory");
+        goto out;
+    }
+
+    msg(1, "revoking %s at %s", certfile, url);
+    if (200 != acme_post(a, url, "{\"certificate\":\"%s\",\"reason\":%d}",
+            crt, reason_code))
+    {
+        warnx("failed to revoke %s at %s", certfile, url);
+        acme_error(a);
+        goto out;
+    }
+    else if (acme_error(a))
+    {
+        goto out;
+    }
+    msg(1, "revoked %s", certfile);
+    certfiledup = strdup(certfile);
+    if (!certfiledup)
+    {
+        warnx("strdup failed");
+        certfiledup = NULL;
+        goto out;
+    }
+    if (asprintf(&revokedfile, "%s/revoked-%llu.pem", dirname(certfiledup),
+                (unsigned long long)time(NULL)) < 0)
+    {
+        warnx("asprintf failed");
+        revokedfile = NULL;
+        goto out;
+    }
+    msg(1, "renaming %s to %s", certfile, revokedfile);
+    if (rename(certfile, revokedfile) < 0)
+    {
+        warn("failed to rename %s to %s", certfile, revokedfile);
+    }
+    success = true;
+out:
+    free(crt);
+    free(revokedfile);
+    free(certfiledup);
+    return success;
+}
+
+bool validate_domain_str(const char *s)
+{
+    size_t len = 0;
+    for (size_t j = 0; j < strlen(s); j++)
     {
         switch (s[j])
         {
-            case '.':
-                if (j == 0)
+            case '.':
+                if (j == 0)
+                {
+                    warnx("'.' not allowed at beginning in %s", s);
+                    return false;
+                }
+                // intentional fallthrough
+            case '_':
+            case '-':
+                len++;
+                continue;
+            case '*':
+                if (j != 0 || s[1] != '.')
+                {
+                    warnx("'*.' only allowed at beginning in %s", s);
+                    return false;
+                }
+                break;
+            default:
+                if (!isupper(s[j]) && !islower(s[j])
+                        && !isdigit(s[j]))
+                {
+                    warnx("invalid character '%c' in %s", s[j], s);
+                    return false;
+                }
+                len++;
+        }
+    }
+    if (len == 0)
+    {
+        warnx("empty name is not allowed");
+        return false;
+    }
+    return true;
+}
+
+typedef struct daemon_cert
+{
+    char *domain;
+    char **names;
+    char *entry;
+    time_t mtime;
+    time_t deadline;
+    time_t due;
+    time_t preauth;
+    int failures;
+} daemon_cert_t;
+
+typedef struct daemon
+{
+    int days;
+    int jitter;
+    int preauth;
+    uint64_t account;
+    bool never;
+    keytype_t type;
+    int bits;
+    bool status_req;
+    const char *dropdir;
+    daemon_cert_t *certs;
+    size_t count;
+    size_t *heap;
+    dropin_t *dropin;
+} daemon_t;
+
+static void daemon_heap_up(daemon_t *d, size_t i)
+{
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (d->certs[d->heap[parent]].due <= d->certs[d->heap[i]].due)
+        {
+            break;
+        }
+        size_t tmp = d->heap[parent];
+        d->heap[parent] = d->heap[i];
+        d->heap[i] = tmp;
+        i = parent;
+    }
+}
+
+static void daemon_heap_down(daemon_t *d, size_t i, size_t n)
+{
+    while (2 * i + 1 < n)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < n &&
+                d->certs[d->heap[child + 1]].due < d->certs[d->heap[child]].due)
+        {
+            child++;
+        }
+        if (d->certs[d->heap[i]].due <= d->certs[d->heap[child]].due)
+        {
+            break;
+        }
+        size_t tmp = d->heap[child];
+        d->heap[child] = d->heap[i];
+        d->heap[i] = tmp;
+        i = child;
+    }
+}
+
+static void daemon_free(daemon_t *d)
+{
+    for (size_t i = 0; i < d->count; i++)
+    {
+        free(d->certs[i].domain);
+        names_free(d->certs[i].names);
+        free(d->certs[i].entry);
+    }
+    free(d->certs);
+    free(d->heap);
+    d->certs = NULL;
+    d->heap = NULL;
+    d->count = 0;
+}
+
+// Finds the names a certificate is to be renewed for, from its expiry.idx
+// record if up to date or from the certificate itself, with the name of
+// its directory first
+static bool daemon_cert_load(const char *confdir, state_t *idx,
+        const char *domain, daemon_cert_t *c)
+{
+    bool success = false;
+    char *certdir = NULL, *certfile = NULL, *names = NULL;
+    const char *value;
+    struct stat st;
+    time_t expiration = 0;
+    size_t n = 0;
+
+    memset(c, 0, sizeof(*c));
+    if (asprintf(&certdir, "%s/%s", confdir, domain) < 0)
+    {
+        certdir = NULL;
+        warnx("daemon_cert_load: asprintf failed");
+        goto out;
+    }
+    if (asprintf(&certfile, "%s/cert.pem", certdir) < 0)
+    {
+        certfile = NULL;
+        warnx("daemon_cert_load: asprintf failed");
+        goto out;
+    }
+    if (stat(certfile, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        goto out;
+    }
+    const char *indexed = NULL;
+    value = idx ? state_get(idx, certdir) : NULL;
+    if (value && certidx_parse(value, &st, &expiration, NULL, &indexed) &&
+            indexed)
+    {
+        names = strdup(indexed);
+        if (!names)
+        {
+            warn("daemon_cert_load: strdup failed");
+            goto out;
+        }
+    }
+    else
+    {
+        char **cn = cert_file_info(certfile, &expiration, &st);
+        if (!cn)
+        {
+            warnx("failed to load %s", certfile);
+            goto out;
+        }
+        // the name of the directory goes first
+        for (size_t i = 0; cn[i]; i++)
+        {
+            const char *x = cn[i];
+            if (x[0] == '*' && x[1] == '.')
+            {
+                x += 2;
+            }
+            if (i > 0 && strcasecmp(x, domain) == 0)
+            {
+                char *tmp = cn[0];
+                cn[0] = cn[i];
+                cn[i] = tmp;
+                break;
+            }
+        }
+        names = names_join((const char * const *)cn);
+        names_free(cn);
+        if (!names)
+        {
+            goto out;
+        }
+    }
+    for (const char *p = names; *p; p++)
+    {
+        n += *p == ',';
+    }
+    c->names = calloc(n + 2, sizeof(char *));
+    if (!c->names)
+    {
+        warn("daemon_cert_load: calloc failed");
+        goto out;
+    }
+    n = 0;
+    for (char *p = names, *tok; (tok = strsep(&p, ",")); )
+    {
+        if (*tok && !(c->names[n++] = strdup(tok)))
+        {
+            warn("daemon_cert_load: strdup failed");
+            goto out;
+        }
+    }
+    c->domain = strdup(domain);
+    if (!c->domain || n == 0)
+    {
+        warnx("failed to load the names of %s", certfile);
+        goto out;
+    }
+    c->deadline = expiration;
+    success = true;
+out:
+    if (!success)
+    {
+        names_free(c->names);
+        free(c->domain);
+        memset(c, 0, sizeof(*c));
+    }
+    free(names);
+    free(certfile);
+    free(certdir);
+    return success;
+}
+
+// Renews c by its deadline, or earlier when the CA suggests it or its
+// suggestion needs refreshing
+static void daemon_schedule(const acme_t *a, daemon_cert_t *c)
+{
+    char *certdir = NULL;
+    ari_t ari = {0, 0, 0, 0};
+    c->due = c->deadline;
+    if (!json_find_string(a->dir, "renewalInfo"))
+    {
+        return;
+    }
+    if (asprintf(&certdir, "%s/%s", a->confdir, c->domain) < 0)
+    {
+        warnx("daemon_schedule: asprintf failed");
+        return;
+    }
+    ari_lookup(a->confdir, certdir, &ari);
+    free(certdir);
+    if (ari.renew && ari.renew < c->due)
+    {
+        c->due = ari.renew;
+    }
+    if (ari.refresh < c->due)
+    {
+        c->due = ari.refresh;
+    }
+}
+
+// Sets the renewal and pre-authorization times of a certificate just loaded
+static void daemon_cert_plan(const acme_t *a, const daemon_t *d,
+        daemon_cert_t *c)
+{
+    c->deadline -= d->days * 24 * 3600 + cert_jitter(
+            (const char * const *)c->names, d->account, d->jitter);
+    daemon_schedule(a, c);
+    if (d->preauth > 0)
+    {
+        c->preauth = c->deadline - d->preauth * 24 * 3600;
+    }
+}
+
+// Finds the names of a certificate in its drop-in entry. It is due at once
+// unless CONFDIR/DOMAIN/cert.pem is there for the same names.
+static bool daemon_entry_load(const acme_t *a, const daemon_t *d,
+        state_t *idx, const char *entry, daemon_cert_t *c)
+{
+    struct stat st;
+    daemon_cert_t t;
+    memset(c, 0, sizeof(*c));
+    if (!(c->names = dropin_read(d->dropdir, entry, &st)))
+    {
+        return false;
+    }
+    for (size_t i = 0; c->names[i]; i++)
+    {
+        if (!validate_domain_str(c->names[i]))
+        {
+            warnx("ignoring %s/%s", d->dropdir, entry);
+            goto fail;
+        }
+    }
+    const char *domain = c->names[0];
+    if (domain[0] == '*' && domain[1] == '.')
+    {
+        domain += 2;
+    }
+    if (!(c->domain = strdup(domain)) || !(c->entry = strdup(entry)))
+    {
+        warn("daemon_entry_load: strdup failed");
+        goto fail;
+    }
+    c->mtime = st.st_mtime;
+    if (daemon_cert_load(a->confdir, idx, c->domain, &t))
+    {
+        if (names_equal((const char * const *)t.names,
+                    (const char * const *)c->names))
+        {
+            c->deadline = t.deadline;
+        }
+        free(t.domain);
+        names_free(t.names);
+    }
+    if (!c->deadline)
+    {
+        msg(1, "%s/%s/cert.pem is to be issued for %s/%s", a->confdir,
+                c->domain, d->dropdir, entry);
+    }
+    return true;
+fail:
+    names_free(c->names);
+    free(c->domain);
+    free(c->entry);
+    memset(c, 0, sizeof(*c));
+    return false;
+}
+
+// Loads all the certificates in confdir, or those of the entries in the
+// drop-in directory, and orders them by renewal time
+static bool daemon_load(acme_t *a, daemon_t *d)
+{
+    bool success = false;
+    char *idxfile = NULL;
+    state_t *idx = NULL;
+    size_t alloc = 0;
+    const char *dirname = d->dropdir ? d->dropdir : a->confdir;
+    DIR *dir = opendir(dirname);
+    if (!dir)
+    {
+        warn("failed to open %s", dirname);
+        return false;
+    }
+    if (asprintf(&idxfile, "%s/" CERTIDX_FILE, a->confdir) < 0)
+    {
+        idxfile = NULL;
+        warnx("daemon_load: asprintf failed");
+        goto out;
+    }
+    idx = state_load(idxfile, false);
+    if (!idx)
+    {
+        goto out;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)))
+    {
+        if (d->dropdir ? !dropin_entry(de->d_name) : de->d_name[0] == '.' ||
+                strcmp(de->d_name, "private") == 0)
+        {
+            continue;
+        }
+        if (d->count == alloc)
+        {
+            size_t n = alloc ? 2 * alloc : 64;
+            daemon_cert_t *tmp = realloc(d->certs, n * sizeof(*tmp));
+            if (!tmp)
+            {
+                warn("daemon_load: realloc failed");
+                goto out;
+            }
+            d->certs = tmp;
+            alloc = n;
+        }
+        daemon_cert_t *c = d->certs + d->count;
+        if (d->dropdir ? daemon_entry_load(a, d, idx, de->d_name, c) :
+                daemon_cert_load(a->confdir, idx, de->d_name, c))
+        {
+            daemon_cert_plan(a, d, c);
+            d->count++;
+        }
+    }
+    certidx_compact(idx);
+    d->heap = calloc(d->count + 1, sizeof(size_t));
+    if (!d->heap)
+    {
+        warn("daemon_load: calloc failed");
+        goto out;
+    }
+    for (size_t i = 0; i < d->count; i++)
+    {
+        d->heap[i] = i;
+        daemon_heap_up(d, i);
+    }
+    msg(1, "managing %zu certificates in %s", d->count, dirname);
+    success = true;
+out:
+    state_free(idx);
+    free(idxfile);
+    closedir(dir);
+    return success;
+}
+
+// Renews one certificate with the account, directory and connections of
+// the daemon
+static bool daemon_issue(acme_t *a, daemon_t *d, daemon_cert_t *c)
+{
+    bool success = false;
+    a->names = (const char * const *)c->names;
+    a->domain = c->domain;
+    if (asprintf(&a->certdir, "%s/%s", a->confdir, c->domain) < 0)
+    {
+        a->certdir = NULL;
+        warnx("daemon_issue: asprintf failed");
+        goto out;
+    }
+    if (asprintf(&a->dkeydir, "%s/private/%s", a->confdir, c->domain) < 0)
+    {
+        a->dkeydir = NULL;
+        warnx("daemon_issue: asprintf failed");
+        goto out;
+    }
+    if (!check_or_mkdir(!d->never, a->dkeydir, S_IRWXU) ||
+            !check_or_mkdir(!d->never, a->certdir,
+                S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH))
+    {
+        goto out;
+    }
+    if (!(a->dkey = key_load(d->never ? PK_NONE : d->type,
+                    d->bits, "%s/key.pem", a->dkeydir)))
+    {
+        goto out;
+    }
+    json_free(a->order);
+    a->order = NULL;
+    success = cert_issue(a, d->status_req);
+out:
+    if (a->dkey)
+    {
+        privkey_deinit(a->dkey);
+        a->dkey = NULL;
+    }
+    free(a->certdir);
+    a->certdir = NULL;
+    free(a->dkeydir);
+    a->dkeydir = NULL;
+    a->names = NULL;
+    a->domain = NULL;
+    return success;
+}
+
+static size_t daemon_heap_find(const daemon_t *d, size_t i)
+{
+    size_t k = 0;
+    while (k < d->count && d->heap[k] != i)
+    {
+        k++;
+    }
+    return k;
+}
+
+// Schedules r, replacing the certificate of the same drop-in entry or,
+// for certificates without one, of the same domain
+static void daemon_put(daemon_t *d, daemon_cert_t *r)
+{
+    size_t i = 0;
+    while (i < d->count && (r->entry ? !d->certs[i].entry ||
+                strcmp(d->certs[i].entry, r->entry) :
+                strcmp(d->certs[i].domain, r->domain)))
+    {
+        i++;
+    }
+    if (i < d->count)
+    {
+        daemon_cert_t *c = d->certs + i;
+        if (!r->entry)
+        {
+            r->entry = c->entry;
+            r->mtime = c->mtime;
+            c->entry = NULL;
+        }
+        free(c->domain);
+        names_free(c->names);
+        free(c->entry);
+        *c = *r;
+        size_t k = daemon_heap_find(d, i);
+        daemon_heap_up(d, k);
+        daemon_heap_down(d, k, d->count);
+        return;
+    }
+    daemon_cert_t *certs = realloc(d->certs, (d->count + 1) * sizeof(*certs));
+    if (certs)
+    {
+        d->certs = certs;
+    }
+    size_t *heap = realloc(d->heap, (d->count + 2) * sizeof(*heap));
+    if (heap)
+    {
+        d->heap = heap;
+    }
+    if (!certs || !heap)
+    {
+        warn("daemon_put: realloc failed");
+        free(r->domain);
+        names_free(r->names);
+        free(r->entry);
+        return;
+    }
+    d->certs[d->count] = *r;
+    d->heap[d->count] = d->count;
+    daemon_heap_up(d, d->count++);
+}
+
+// Stops managing the certificate at index i
+static void daemon_remove(daemon_t *d, size_t i)
+{
+    size_t k = daemon_heap_find(d, i);
+    free(d->certs[i].domain);
+    names_free(d->certs[i].names);
+    free(d->certs[i].entry);
+    d->count--;
+    // the last element of the heap takes the place of the one removed,
+    // then the last certificate takes the place of the one removed
+    if (k < d->count)
+    {
+        d->heap[k] = d->heap[d->count];
+        daemon_heap_up(d, k);
+        daemon_heap_down(d, k, d->count);
+    }
+    if (i < d->count)
+    {
+        d->certs[i] = d->certs[d->count];
+        d->heap[daemon_heap_find(d, d->count)] = i;
+    }
+}
+
+// Starts managing the certificate in domain, or reloads it if already
+// managed, after it was issued on demand
+static void daemon_add(acme_t *a, daemon_t *d, const char *domain)
+{
+    daemon_cert_t r;
+    if (!daemon_cert_load(a->confdir, NULL, domain, &r))
+    {
+        return;
+    }
+    daemon_cert_plan(a, d, &r);
+    daemon_put(d, &r);
+    msg(1, "managing %s", domain);
+}
+
+// Schedules the certificate of a drop-in entry that was written, or stops
+// managing it if the entry is gone
+static void daemon_entry(acme_t *a, daemon_t *d, state_t *idx,
+        const char *entry)
+{
+    daemon_cert_t r;
+    size_t i = 0;
+    while (i < d->count && (!d->certs[i].entry ||
+                strcmp(d->certs[i].entry, entry)))
+    {
+        i++;
+    }
+    if (!daemon_entry_load(a, d, idx, entry, &r))
+    {
+        if (i < d->count)
+        {
+            msg(1, "no longer managing %s", d->certs[i].domain);
+            daemon_remove(d, i);
+        }
+        return;
+    }
+    if (i < d->count && names_equal((const char * const *)r.names,
+                (const char * const *)d->certs[i].names))
+    {
+        // same names, the schedule stands
+        d->certs[i].mtime = r.mtime;
+        free(r.domain);
+        names_free(r.names);
+        free(r.entry);
+        return;
+    }
+    msg(1, "%s %s from %s/%s", i < d->count ? "updating" : "managing",
+            r.domain, d->dropdir, entry);
+    daemon_cert_plan(a, d, &r);
+    daemon_put(d, &r);
+}
+
+typedef struct daemon_key
+{
+    const char *entry;
+    size_t index;
+} daemon_key_t;
+
+static int daemon_key_cmp(const void *x, const void *y)
+{
+    return strcmp(((const daemon_key_t *)x)->entry,
+            ((const daemon_key_t *)y)->entry);
+}
+
+// Checks the whole drop-in directory again, reading only the entries that
+// are new or modified since they were loaded
+static void daemon_rescan(acme_t *a, daemon_t *d)
+{
+    char *idxfile = NULL;
+    state_t *idx = NULL;
+    char **changed = NULL;
+    size_t n = 0, nchanged = 0, alloc = 0;
+    daemon_key_t *keys = calloc(d->count + 1, sizeof(daemon_key_t));
+    bool *seen = calloc(d->count + 1, sizeof(bool));
+    DIR *dir = opendir(d->dropdir);
+    if (!keys || !seen || !dir)
+    {
+        warn("failed to check %s", d->dropdir);
+        goto out;
+    }
+    for (size_t i = 0; i < d->count; i++)
+    {
+        if (d->certs[i].entry)
+        {
+            keys[n].entry = d->certs[i].entry;
+            keys[n++].index = i;
+        }
+    }
+    qsort(keys, n, sizeof(*keys), daemon_key_cmp);
+    struct dirent *de;
+    while ((de = readdir(dir)))
+    {
+        if (!dropin_entry(de->d_name))
+        {
+            continue;
+        }
+        struct stat st;
+        daemon_key_t key = {de->d_name, 0};
+        daemon_key_t *k = bsearch(&key, keys, n, sizeof(*keys),
+                daemon_key_cmp);
+        if (k)
+        {
+            seen[k->index] = true;
+            if (fstatat(dirfd(dir), de->d_name, &st, 0) == 0 &&
+                    st.st_mtime == d->certs[k->index].mtime)
+            {
+                continue;
+            }
+        }
+        if (nchanged == alloc)
+        {
+            alloc = alloc ? 2 * alloc : 64;
+            char **tmp = realloc(changed, (alloc + 1) * sizeof(char *));
+            if (!tmp)
+            {
+                warn("daemon_rescan: realloc failed");
+                goto out;
+            }
+            changed = tmp;
+        }
+        if (!(changed[nchanged] = strdup(de->d_name)))
+        {
+            warn("daemon_rescan: strdup failed");
+            goto out;
+        }
+        changed[++nchanged] = NULL;
+    }
+    // entries that disappeared go first, from the last certificate so
+    // that daemon_remove() only moves certificates already checked
+    for (size_t i = d->count; i-- > 0; )
+    {
+        if (d->certs[i].entry && !seen[i])
+        {
+            msg(1, "no longer managing %s", d->certs[i].domain);
+            daemon_remove(d, i);
+        }
+    }
+    if (asprintf(&idxfile, "%s/" CERTIDX_FILE, a->confdir) < 0)
+    {
+        idxfile = NULL;
+        warnx("daemon_rescan: asprintf failed");
+        goto out;
+    }
+    idx = state_load(idxfile, false);
+    for (size_t i = 0; i < nchanged; i++)
+    {
+        daemon_entry(a, d, idx, changed[i]);
+    }
+out:
+    if (dir)
+    {
+        closedir(dir);
+    }
+    state_free(idx);
+    free(idxfile);
+    names_free(changed);
+    free(seen);
+    free(keys);
+}
+
+// Issues a certificate for names requested on the socket, unless there is
+// already one valid for longer than d->days, and answers the request
+static void daemon_ondemand(acme_t *a, daemon_t *d, char **names)
+{
+    char *certdir = NULL, *certfile = NULL;
+    char error[0x80] = "";
+    const char *domain = names[0];
+    if (domain[0] == '*' && domain[1] == '.')
+    {
+        domain += 2;
+    }
+    for (size_t i = 0; names[i]; i++)
+    {
+        if (!validate_domain_str(names[i]))
+        {
+            snprintf(error, sizeof(error), "invalid name %.64s", names[i]);
+            goto out;
+        }
+    }
+    if (asprintf(&certdir, "%s/%s", a->confdir, domain) < 0)
+    {
+        certdir = NULL;
+        warnx("daemon_ondemand: asprintf failed");
+        goto out;
+    }
+    if (asprintf(&certfile, "%s/cert.pem", certdir) < 0)
+    {
+        certfile = NULL;
+        warnx("daemon_ondemand: asprintf failed");
+        goto out;
+    }
+    if (cert_valid(a->confdir, certdir, (const char * const *)names,
+                d->days, 0))
+    {
+        msg(1, "%s is current", certfile);
+        goto out;
+    }
+    time_t wait = backoff_wait(a->confdir, (const char * const *)names);
+    if (wait > 0)
+    {
+        snprintf(error, sizeof(error), "repeated validation failures, "
+                "retry in %lld seconds", (long long)wait);
+        goto out;
+    }
+    wait = a->rl ? ratelimit_wait(a->rl, a->kid,
+            (const char * const *)names) : 0;
+    if (wait > 0)
+    {
+        snprintf(error, sizeof(error), "rate limited, retry in %lld "
+                "seconds", (long long)wait);
+        goto out;
+    }
+    daemon_cert_t c = {.domain = (char *)domain, .names = names};
+    msg(1, "issuing %s on demand", domain);
+    if (!daemon_issue(a, d, &c))
+    {
+        snprintf(error, sizeof(error), "failed to issue %s", domain);
+        goto out;
+    }
+    daemon_add(a, d, domain);
+out:
+    if (*error || !certfile)
+    {
+        warnx("on-demand request for %s: %s", names[0],
+                *error ? error : "failed");
+    }
+    ondemand_done(a->ondemand, *error ? NULL : certfile,
+            *error ? error : "internal error");
+    free(certfile);
+    free(certdir);
+}
+
+// Validates the names of c through newAuthz ahead of its renewal
+static bool daemon_preauthorize(acme_t *a, daemon_cert_t *c)
+{
+    a->names = (const char * const *)c->names;
+    a->domain = c->domain;
+    bool success = preauthorize(a);
+    a->names = NULL;
+    a->domain = NULL;
+    return success;
+}
+
+// Waits up to wait seconds for one of the signals in set, returning it or
+// -1. With the socket or the drop-in directory the wait is cut in slices
+// of a second checking for signals in between, ending early as soon as
+// there is a new request or changes to the entries. With both, the socket
+// and the inotify descriptor are polled together.
+static int daemon_wait(acme_t *a, daemon_t *d, const sigset_t *set,
+        time_t wait)
+{
+    struct timespec ts = {wait, 0};
+    if (!a->ondemand && !d->dropin)
+    {
+        return sigtimedwait(set, NULL, &ts);
+    }
+    struct timespec zero = {0, 0};
+    time_t end = time(NULL) + wait;
+    int sig;
+    while ((sig = sigtimedwait(set, NULL, &zero)) < 0 && time(NULL) < end)
+    {
+        if (a->ondemand && ondemand_serve(a->ondemand, 1000,
+                    d->dropin ? dropin_fd(d->dropin) : -1))
+        {
+            break;
+        }
+        if (d->dropin && dropin_wait(d->dropin, a->ondemand ? 0 : 1000))
+        {
+            break;
+        }
+    }
+    return sig;
+}
+
+// Renews every certificate in confdir when it gets within d->days of its
+// expiration, sleeping until the next one is due. With d->preauth the
+// names of each certificate are validated that many days earlier, while
+// no renewal is due. With d->dropdir the certificates are those of its
+// entries, rescheduled one by one as they change. SIGHUP reloads the
+// certificates, SIGINT and SIGTERM stop the daemon.
+static int daemon_run(acme_t *a, daemon_t *d)
+{
+    int ret = 2;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0)
+    {
+        warn("daemon_run: sigprocmask failed");
+        return ret;
+    }
+    // watched before loading so that no change in between is missed
+    if (d->dropdir && !(d->dropin = dropin_open(d->dropdir)))
+    {
+        goto out;
+    }
+    if (!daemon_load(a, d))
+    {
+        goto out;
+    }
+    while (1)
+    {
+        time_t now = time(NULL);
+        time_t wait = DAEMON_RETRY;
+        // requests on the socket go before anything scheduled
+        char **names = a->ondemand ? ondemand_next(a->ondemand) : NULL;
+        if (names)
+        {
+            daemon_ondemand(a, d, names);
+            continue;
+        }
+        if (d->count > 0)
+        {
+            daemon_cert_t *c = d->certs + d->heap[0];
+            if (c->due <= now && c->deadline > now && c->failures == 0)
+            {
+                time_t next = c->deadline;
+                char *certdir = NULL;
+                if (asprintf(&certdir, "%s/%s", a->confdir, c->domain) < 0)
                 {
-                    warnx("'.' not allowed at beginning in %s", s);
-                    return false;
+                    certdir = NULL;
+                    warnx("daemon_run: asprintf failed");
+                }
+                bool due = certdir && ari_due(a, certdir, &next);
+                free(certdir);
+                if (!due)
+                {
+                    c->due = next < c->deadline ? next : c->deadline;
+                    daemon_heap_down(d, 0, d->count);
+                    continue;
+                }
+            }
+            // certificates held back by rate limits make way for the
+            // others, which may well fit in their own buckets
+            time_t hold = c->due <= now && a->rl ? ratelimit_wait(a->rl,
+                    a->kid, (const char * const *)c->names) : 0;
+            if (hold > 0)
+            {
+                msg(1, "postponing %s by %lld seconds because of rate "
+                        "limits", c->domain, (long long)hold);
+                c->due = now + hold;
+                daemon_heap_down(d, 0, d->count);
+                continue;
+            }
+            hold = c->due <= now ? backoff_wait(a->confdir,
+                    (const char * const *)c->names) : 0;
+            if (hold > 0)
+            {
+                msg(1, "postponing %s by %lld seconds because of repeated "
+                        "validation failures", c->domain, (long long)hold);
+                c->due = now + hold;
+                daemon_heap_down(d, 0, d->count);
+                continue;
+            }
+            if (c->due <= now)
+            {
+                daemon_cert_t r;
+                msg(1, "renewing %s", c->domain);
+                if (daemon_issue(a, d, c) && daemon_cert_load(a->confdir,
+                            NULL, c->domain, &r))
+                {
+                    r.entry = c->entry;
+                    r.mtime = c->mtime;
+                    free(c->domain);
+                    names_free(c->names);
+                    *c = r;
+                    c->deadline -= d->days * 24 * 3600 + cert_jitter(
+                            (const char * const *)c->names, d->account,
+                            d->jitter);
+                    c->failures = 0;
+                    if (c->deadline <= now)
+                    {
+                        warnx("%s/%s/cert.pem expires within %d days "
+                                "after renewal", a->confdir, c->domain,
+                                d->days);
+                        c->deadline = now + DAEMON_RETRY_MAX;
+                    }
+                    daemon_schedule(a, c);
+                    if (d->preauth > 0)
+                    {
+                        c->preauth = c->deadline - d->preauth * 24 * 3600;
+                    }
+                }
+                else
+                {
+                    time_t retry = DAEMON_RETRY;
+                    for (int i = 0; i < c->failures &&
+                            retry < DAEMON_RETRY_MAX; i++)
+                    {
+                        retry *= 2;
+                    }
+                    c->failures++;
+                    c->due = now + (retry < DAEMON_RETRY_MAX ?
+                            retry : DAEMON_RETRY_MAX);
+                    warnx("failed to renew %s, retrying in %lld seconds",
+                            c->domain, (long long)(c->due - now));
+                }
+                daemon_heap_down(d, 0, d->count);
+                continue;
+            }
+            // pre-authorizations only run while no renewal is due
+            daemon_cert_t *p = NULL;
+            for (size_t i = 0; i < d->count; i++)
+            {
+                daemon_cert_t *x = d->certs + i;
+                if (x->preauth && x->preauth >= x->deadline)
+                {
+                    x->preauth = 0;
+                }
+                else if (x->preauth && (!p || x->preauth < p->preauth))
+                {
+                    p = x;
+                }
+            }
+            if (p && p->preauth <= now)
+            {
+                if (daemon_preauthorize(a, p))
+                {
+                    p->preauth = 0;
+                }
+                else
+                {
+                    p->preauth = now + DAEMON_RETRY;
+                    warnx("failed to pre-authorize %s, retrying in %lld "
+                            "seconds", p->domain, (long long)DAEMON_RETRY);
                 }
-                // intentional fallthrough
-            case '_':
-            case '-':
-                len++;
                 continue;
-            case '*':
-                if (j != 0 || s[1] != '.')
+            }
+            if (p && p->preauth - now < wait)
+            {
+                wait = p->preauth - now;
+            }
+            char buf[0x40];
+            strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S %z",
+                    localtime(&c->due));
+            msg(1, "next renewal: %s on %s", c->domain, buf);
+            // wake up at least hourly to cope with suspend and clock jumps
+            if (c->due - now < wait)
+            {
+                wait = c->due - now;
+            }
+        }
+        int sig = daemon_wait(a, d, &set, wait);
+        if (d->dropin)
+        {
+            char *entry;
+            while (dropin_next(d->dropin, &entry))
+            {
+                if (entry)
                 {
-                    warnx("'*.' only allowed at beginning in %s", s);
-                    return false;
+                    daemon_entry(a, d, NULL, entry);
+                    free(entry);
                 }
-                break;
-            default:
-                if (!isupper(s[j]) && !islower(s[j])
-                        && !isdigit(s[j]))
+                else
                 {
-                    warnx("invalid character '%c' in %s", s[j], s);
-                    return false;
+                    daemon_rescan(a, d);
                 }
-                len++;
+            }
+        }
+        if (sig == SIGHUP)
+        {
+            msg(1, "reloading certificates");
+            daemon_free(d);
+            if (!daemon_load(a, d))
+            {
+                goto out;
+            }
+        }
+        else if (sig == SIGINT || sig == SIGTERM)
+        {
+            msg(1, "terminating on signal %d", sig);
+            ret = 0;
+            goto out;
         }
     }
-    if (len == 0)
-    {
-        warnx("empty name is not allowed");
-        return false;
-    }
-    return true;
+out:
+    daemon_free(d);
+    dropin_close(d->dropin);
+    d->dropin = NULL;
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    return ret;
 }
 
 void usage(const char *progname)
 {
     fprintf(stderr,
-        "usage: %s [-a|--acme-url URL] [-b|--bits BITS] [-c|--confdir DIR]\n"
-        "\t[-d|--days DAYS] [-f|--force] [-h|--hook PROGRAM] [-m|--must-staple]\n"
-        "\t[-n|--never-create] [-s|--staging] [-t|--type RSA | EC]\n"
-        "\t[-v|--verbose ...] [-V|--version] [-y|--yes] [-?|--help]\n"
+        "usage: %s [-A|--preauthorize DAYS] [-a|--acme-url URL]\n"
+        "\t[-b|--bits BITS] [-B|--batch] [-C|--challenges TYPE[,TYPE...]]\n"
+        "\t[-c|--confdir DIR] [-D|--drop-in DIR] [-d|--days DAYS]\n"
+        "\t[-f|--force] [-H|--plan] [-h|--hook PROGRAM] [-J|--jitter HOURS]\n"
+        "\t[-j|--jobs N] [-k|--tsig-key FILE] [-l|--listen [ADDRESS:]PORT]\n"
+        "\t[-L|--tls-listen [ADDRESS:]PORT] [-m|--must-staple]\n"
+        "\t[-N|--nsupdate SERVER[:PORT]] [-n|--never-create]\n"
+        "\t[-p|--persistent] [-P|--propagation SECONDS]\n"
+        "\t[-r|--rate-limit NAME=COUNT/PERIOD[,...]] [-S|--self-check]\n"
+        "\t[-s|--staging] [-T|--timeout SECONDS] [-t|--type RSA | EC]\n"
+        "\t[-U|--socket PATH] [-v|--verbose ...] [-V|--version]\n"
+        "\t[-w|--webroot DIR] [-y|--yes] [-?|--help]\n"
         "\tnew [EMAIL] | update [EMAIL] | deactivate | newkey |\n"
-        "\tissue DOMAIN [ALTNAME ...]] | revoke CERTFILE\n", progname);
+        "\tissue DOMAIN [ALTNAME ...]] | revoke CERTFILE | scan [tsv | json] |\n"
+        "\tdaemon\n",
+        progname);
 }
 
 int main(int argc, char **argv)
@@ -1383,18 +3706,36 @@ int main(int argc, char **argv)
     static struct option options[] =
     {
         {"acme-url",     required_argument, NULL, 'a'},
+        {"batch",        no_argument,       NULL, 'B'},
         {"bits",         required_argument, NULL, 'b'},
+        {"challenges",   required_argument, NULL, 'C'},
         {"confdir",      required_argument, NULL, 'c'},
         {"days",         required_argument, NULL, 'd'},
+        {"drop-in",      required_argument, NULL, 'D'},
         {"force",        no_argument,       NULL, 'f'},
         {"help",         no_argument,       NULL, '?'},
         {"hook",         required_argument, NULL, 'h'},
+        {"jitter",       required_argument, NULL, 'J'},
+        {"jobs",         required_argument, NULL, 'j'},
+        {"listen",       required_argument, NULL, 'l'},
         {"must-staple",  no_argument,       NULL, 'm'},
         {"never-create", no_argument,       NULL, 'n'},
+        {"nsupdate",     required_argument, NULL, 'N'},
+        {"persistent",   no_argument,       NULL, 'p'},
+        {"plan",         no_argument,       NULL, 'H'},
+        {"preauthorize", required_argument, NULL, 'A'},
+        {"propagation",  required_argument, NULL, 'P'},
+        {"rate-limit",   required_argument, NULL, 'r'},
+        {"self-check",   no_argument,       NULL, 'S'},
         {"staging",      no_argument,       NULL, 's'},
+        {"socket",       required_argument, NULL, 'U'},
+        {"timeout",      required_argument, NULL, 'T'},
+        {"tls-listen",   required_argument, NULL, 'L'},
+        {"tsig-key",     required_argument, NULL, 'k'},
         {"type",         required_argument, NULL, 't'},
         {"verbose",      no_argument,       NULL, 'v'},
         {"version",      no_argument,       NULL, 'V'},
+        {"webroot",      required_argument, NULL, 'w'},
         {"yes",          no_argument,       NULL, 'y'},
         {NULL,           0,                 NULL, 0}
     };
@@ -1407,14 +3748,27 @@ int main(int argc, char **argv)
     bool staging = false;
     bool custom_directory = false;
     bool status_req = false;
+    bool initialized = false;
+    bool json = false;
+    bool ari_check = false;
+    bool plan = false;
     int days = 30;
+    int jitter = 0;
+    int preauth = 0;
+    uint64_t account = 0;
     int bits = 0;
     keytype_t type = PK_RSA;
     const char *filename = NULL;
+    const char *ratelimits = NULL;
+    const char *sockpath = NULL;
+    const char *dropdir = NULL;
     acme_t a;
     memset(&a, 0, sizeof(a));
+    srandom(time(NULL) ^ getpid());
     a.directory = PRODUCTION_URL;
     a.confdir = DEFAULT_CONFDIR;
+    a.hook.timeout = HOOK_TIMEOUT;
+    a.hook.jobs = HOOK_JOBS;
 
     if (argc < 2)
     {
@@ -1432,28 +3786,24 @@ int main(int argc, char **argv)
         return ret;
     }
 
-    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
-    {
-        warnx("failed to initialize libcurl");
-        return ret;
-    }
-
-    if (!crypto_init())
-    {
-        warnx("failed to initialize crypto library");
-        curl_global_cleanup();
-        return ret;
-    }
-
     while (1)
     {
         char *endptr;
         int option_index;
-        int c = getopt_long(argc, argv, "a:b:c:d:f?h:mnst:vVy",
+        int c = getopt_long(argc, argv, "A:a:b:BC:c:D:d:f?Hh:J:j:k:l:L:mN:npP:r:SsT:t:U:vVw:y",
                 options, &option_index);
         if (c == -1) break;
         switch (c)
         {
+            case 'A':
+                preauth = strtol(optarg, &endptr, 10);
+                if (*endptr != 0 || preauth < 0)
+                {
+                    warnx("DAYS must be a non-negative integer");
+                    goto out;
+                }
+                break;
+
             case 'a':
                 if (staging)
                 {
@@ -1477,6 +3827,10 @@ int main(int argc, char **argv)
                 a.confdir = optarg;
                 break;
 
+            case 'D':
+                dropdir = optarg;
+                break;
+
             case 'd':
                 days = strtol(optarg, &endptr, 10);
                 if (*endptr != 0 || days <= 0)
@@ -1490,22 +3844,101 @@ int main(int argc, char **argv)
                 force = true;
                 break;
 
+            case 'H':
+                plan = true;
+                break;
+
             case 'h':
-                a.hook = optarg;
+                a.hook.prog = optarg;
+                break;
+
+            case 'J':
+                jitter = strtol(optarg, &endptr, 10);
+                if (*endptr != 0 || jitter < 0)
+                {
+                    warnx("HOURS must be a non-negative integer");
+                    goto out;
+                }
+                break;
+
+            case 'j':
+                a.hook.jobs = strtol(optarg, &endptr, 10);
+                if (*endptr != 0 || a.hook.jobs <= 0)
+                {
+                    warnx("N must be a positive integer");
+                    goto out;
+                }
+                break;
+
+            case 'k':
+                a.tsig_key = optarg;
+                break;
+
+            case 'l':
+                a.listen = optarg;
+                break;
+
+            case 'L':
+#if defined(USE_MBEDTLS)
+                warnx("-L,--tls-listen is not supported with mbedTLS");
+                goto out;
+#else
+                a.tls_listen = optarg;
                 break;
+#endif
 
             case 'm':
                 status_req = true;
                 break;
 
+            case 'N':
+                a.nsupdate = optarg;
+                break;
+
             case 'n':
                 never = true;
                 break;
 
+            case 'p':
+                a.hook.persistent = true;
+                break;
+
+            case 'P':
+                a.propagation = strtol(optarg, &endptr, 10);
+                if (*endptr != 0 || a.propagation < 0)
+                {
+                    warnx("SECONDS must be a non-negative integer");
+                    goto out;
+                }
+                break;
+
+            case 'B':
+                a.hook.batch = true;
+                break;
+
+            case 'r':
+                ratelimits = optarg;
+                break;
+
+            case 'C':
+                if (!*optarg || strspn(optarg, "abcdefghijklmnopqrstuvwxyz"
+                            "0123456789-,") != strlen(optarg))
+                {
+                    warnx("CHALLENGES must be a comma separated list of "
+                            "challenge types");
+                    goto out;
+                }
+                a.challenges = optarg;
+                break;
+
             case 'v':
                 g_loglevel++;
                 break;
 
+            case 'S':
+                a.selfcheck = true;
+                break;
+
             case 's':
                 if (custom_directory)
                 {
@@ -1516,6 +3949,15 @@ int main(int argc, char **argv)
                 a.directory = STAGING_URL;
                 break;
 
+            case 'T':
+                a.hook.timeout = strtol(optarg, &endptr, 10);
+                if (*endptr != 0 || a.hook.timeout < 0)
+                {
+                    warnx("SECONDS must be a non-negative integer");
+                    goto out;
+                }
+                break;
+
             case 't':
                 if (strcasecmp(optarg, "RSA") == 0)
                 {
@@ -1532,10 +3974,18 @@ int main(int argc, char **argv)
                 }
                 break;
 
+            case 'U':
+                sockpath = optarg;
+                break;
+
              case 'V':
                 version = true;
                 break;
 
+            case 'w':
+                a.webroot = optarg;
+                break;
+
             case 'y':
                 yes = true;
                 break;
@@ -1662,48 +4112,202 @@ int main(int argc, char **argv)
             goto out;
         }
     }
+    else if (strcmp(action, "daemon") == 0)
+    {
+        if (optind < argc)
+        {
+            usage(basename(argv[0]));
+            goto out;
+        }
+    }
+    else if (strcmp(action, "scan") == 0)
+    {
+        if (optind < argc)
+        {
+            if (strcmp(argv[optind], "json") == 0)
+            {
+                json = true;
+            }
+            else if (strcmp(argv[optind], "tsv") != 0)
+            {
+                usage(basename(argv[0]));
+                goto out;
+            }
+            optind++;
+        }
+        if (optind < argc)
+        {
+            usage(basename(argv[0]));
+            goto out;
+        }
+    }
     else
     {
         usage(basename(argv[0]));
         goto out;
     }
 
-    time_t now = time(NULL);
-    char buf[0x100];
-    setlocale(LC_TIME, "C");
-    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S %z", localtime(&now));
-    msg(1, "version " PACKAGE_VERSION " starting on %s", buf);
+    if (g_loglevel > 0)
+    {
+        time_t now = time(NULL);
+        char buf[0x100];
+        setlocale(LC_TIME, "C");
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S %z",
+                localtime(&now));
+        msg(1, "version " PACKAGE_VERSION " starting on %s", buf);
+    }
 
-    if (a.hook && access(a.hook, R_OK | X_OK) < 0)
+    if (a.hook.prog && access(a.hook.prog, R_OK | X_OK) < 0)
     {
-        warn("%s", a.hook);
+        warn("%s", a.hook.prog);
         goto out;
     }
 
-    if (asprintf(&a.keydir, "%s/private", a.confdir) < 0)
+    if (a.webroot && a.listen)
     {
-        a.keydir = NULL;
-        warnx("asprintf failed");
+        warnx("-w,--webroot is incompatible with -l,--listen");
+        goto out;
+    }
+
+    if (a.webroot && access(a.webroot, W_OK | X_OK) < 0)
+    {
+        warn("%s", a.webroot);
+        goto out;
+    }
+
+    if (a.tsig_key && !a.nsupdate)
+    {
+        warnx("-k,--tsig-key requires -N,--nsupdate");
+        goto out;
+    }
+
+    if (plan && strcmp(action, "scan") != 0)
+    {
+        warnx("-H,--plan only applies to scan");
+        goto out;
+    }
+
+    if (preauth && strcmp(action, "daemon") != 0)
+    {
+        warnx("-A,--preauthorize only applies to daemon");
+        goto out;
+    }
+
+    if (sockpath && strcmp(action, "daemon") != 0)
+    {
+        warnx("-U,--socket only applies to daemon");
+        goto out;
+    }
+
+    if (dropdir && strcmp(action, "daemon") != 0)
+    {
+        warnx("-D,--drop-in only applies to daemon");
+        goto out;
+    }
+
+    if (jitter)
+    {
+        account = account_hash(a.confdir);
+    }
+
+    if ((strcmp(action, "issue") == 0 || strcmp(action, "daemon") == 0) &&
+            !(a.rl = ratelimit_init(a.confdir, ratelimits)))
+    {
+        goto out;
+    }
+
+    if (strcmp(action, "scan") == 0)
+    {
+        ret = cert_scan(a.confdir, days, jitter, account, json, plan);
         goto out;
     }
 
     if (a.domain)
     {
-        if (asprintf(&a.dkeydir, "%s/private/%s", a.confdir, a.domain) < 0)
+        if (asprintf(&a.certdir, "%s/%s", a.confdir, a.domain) < 0)
         {
-            a.dkeydir = NULL;
+            a.certdir = NULL;
             warnx("asprintf failed");
             goto out;
         }
 
-        if (asprintf(&a.certdir, "%s/%s", a.confdir, a.domain) < 0)
+        // Most runs from cron find the certificate still current, so check
+        // that before initializing libcurl and the crypto library or loading
+        // any key. With an up to date expiry.idx this is a single stat() of
+        // cert.pem, plus reading the cached account thumbprint with -J.
+        // The renewal time suggested by the CA is cached in renewal.idx
+        // too, and only fetched again when the CA asks for it.
+        msg(1, "checking existence and expiration of %s/cert.pem", a.certdir);
+        if (cert_valid(a.confdir, a.certdir, a.names, days,
+                    cert_jitter(a.names, account, jitter)))
         {
-            a.certdir = NULL;
+            ari_t ari = {0, 0, 0, 0};
+            time_t now = time(NULL);
+            if (force)
+            {
+                msg(1, "forcing reissue of %s/cert.pem", a.certdir);
+            }
+            else if ((!ari_lookup(a.confdir, a.certdir, &ari) ||
+                        ari.refresh <= now) &&
+                    !ari_unsupported(a.confdir, a.directory))
+            {
+                msg(1, "renewal information for %s/cert.pem is stale",
+                        a.certdir);
+                ari_check = true;
+            }
+            else if (ari.renew && ari.renew <= now)
+            {
+                msg(1, "%s/cert.pem is due for renewal as suggested by "
+                        "the CA", a.certdir);
+            }
+            else
+            {
+                msg(1, "skipping %s/cert.pem", a.certdir);
+                ret = 1;
+                goto out;
+            }
+        }
+
+        // names that keep failing validation are left alone for a while,
+        // without even contacting the CA
+        time_t wait = force ? 0 : backoff_wait(a.confdir, a.names);
+        if (wait > 0)
+        {
+            warnx("not issuing %s/cert.pem after repeated validation "
+                    "failures, retry in %lld seconds", a.certdir,
+                    (long long)wait);
+            goto out;
+        }
+
+        if (asprintf(&a.dkeydir, "%s/private/%s", a.confdir, a.domain) < 0)
+        {
+            a.dkeydir = NULL;
             warnx("asprintf failed");
             goto out;
         }
     }
 
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+    {
+        warnx("failed to initialize libcurl");
+        goto out;
+    }
+
+    if (!crypto_init())
+    {
+        warnx("failed to initialize crypto library");
+        curl_global_cleanup();
+        goto out;
+    }
+    initialized = true;
+
+    if (asprintf(&a.keydir, "%s/private", a.confdir) < 0)
+    {
+        a.keydir = NULL;
+        warnx("asprintf failed");
+        goto out;
+    }
+
     bool is_new = strcmp(action, "new") == 0;
     if (!check_or_mkdir(is_new && !never, a.confdir,
                 S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH))
@@ -1722,6 +4326,19 @@ int main(int argc, char **argv)
         goto out;
     }
 
+    // the public thumbprint is cached for the jitter of later runs, which
+    // must not need the private key
+    char *thumbprint = jws_thumbprint(a.key);
+    if (thumbprint)
+    {
+        uint64_t h = account_cache(a.confdir, thumbprint);
+        if (jitter)
+        {
+            account = h;
+        }
+        free(thumbprint);
+    }
+
     if (strcmp(action, "new") == 0)
     {
         if (acme_bootstrap(&a) && account_new(&a, yes))
@@ -1771,26 +4388,28 @@ int main(int argc, char **argv)
             goto out;
         }
 
-        msg(1, "checking existence and expiration of %s/cert.pem", a.certdir);
-        if (cert_valid(a.certdir, a.names, days))
+        if (!acme_bootstrap(&a))
         {
-            if (force)
+            goto out;
+        }
+        if (ari_check && !ari_due(&a, a.certdir, NULL))
+        {
+            msg(1, "skipping %s/cert.pem", a.certdir);
+            ret = 1;
+        }
+        else if (account_retrieve(&a))
+        {
+            time_t wait = ratelimit_wait(a.rl, a.kid, a.names);
+            if (wait > 0)
             {
-                msg(1, "forcing reissue of %s/cert.pem", a.certdir);
+                warnx("not issuing %s/cert.pem to stay within rate limits, "
+                        "retry in %lld seconds", a.certdir, (long long)wait);
             }
-            else
+            else if (cert_issue(&a, status_req))
             {
-                msg(1, "skipping %s/cert.pem", a.certdir);
-                ret = 1;
-                goto out;
+                ret = 0;
             }
         }
-
-        if (acme_bootstrap(&a) && account_retrieve(&a)
-                && cert_issue(&a, status_req))
-        {
-            ret = 0;
-        }
     }
     else if (strcmp(action, "revoke") == 0)
     {
@@ -1800,8 +4419,24 @@ int main(int argc, char **argv)
             ret = 0;
         }
     }
+    else if (strcmp(action, "daemon") == 0)
+    {
+        daemon_t d = {days, jitter, preauth, account, never, type, bits,
+            status_req, dropdir, NULL, 0, NULL, NULL};
+        // the socket only takes requests once the account is ready
+        if (acme_bootstrap(&a) && account_retrieve(&a) &&
+                (!sockpath || (a.ondemand = ondemand_start(sockpath))))
+        {
+            ret = daemon_run(&a, &d);
+        }
+    }
 
 out:
+    hook_fini(&a.hook);
+    httpd_stop(a.httpd);
+    ondemand_stop(a.ondemand);
+    dns_free(a.dns);
+    ratelimit_free(a.rl);
     if (a.key) privkey_deinit(a.key);
     if (a.dkey) privkey_deinit(a.dkey);
     json_free(a.json);
@@ -1816,8 +4451,12 @@ out:
     free(a.keydir);
     free(a.dkeydir);
     free(a.certdir);
-    crypto_deinit();
-    curl_global_cleanup();
+    if (initialized)
+    {
+        crypto_deinit();
+        curl_fini();
+        curl_global_cleanup();
+    }
     exit(ret);
 }
 
@@ -20,6 +20,12 @@ CHALLENGE_PATH="${UACME_CHALLENGE_PATH:-'/var/www/.well-known/acme-challenge'}"
 ARGS=5
 E_BADARGS=85
 
+if test "$1" = "capabilities"
+then
+    echo http-01
+    exit 0
+fi
+
 if test $# -ne "$ARGS"
 then
     echo "Usage: `basename $0` method type ident token auth" 1>&2
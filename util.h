@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __UTIL_H__
+#define __UTIL_H__
+
+#include <stdbool.h>
+
+/*
+ * Helpers shared by the event loops: util_nonblock() makes a descriptor
+ * non-blocking and close-on-exec, util_now() reads CLOCK_MONOTONIC in
+ * milliseconds and util_left() turns a deadline taken from it into a
+ * poll() timeout, 0 once it has passed.
+ */
+bool util_nonblock(int fd);
+long long util_now(void);
+int util_left(long long deadline);
+
+#endif
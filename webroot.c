@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "webroot.h"
+
+#define WEBROOT_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+// Tokens are base64url strings, anything else could escape the directory
+static bool webroot_token(const char *token)
+{
+    if (!*token || strspn(token, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                "abcdefghijklmnopqrstuvwxyz0123456789-_") != strlen(token))
+    {
+        warnx("invalid challenge token '%s'", token);
+        return false;
+    }
+    return true;
+}
+
+static bool webroot_write(int fd, const char *auth)
+{
+    size_t len = strlen(auth);
+    while (len > 0)
+    {
+        ssize_t r = write(fd, auth, len);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        auth += r;
+        len -= r;
+    }
+    // the web server must be able to read it regardless of umask
+    return fchmod(fd, WEBROOT_MODE) == 0;
+}
+
+#if defined(O_TMPFILE)
+// Writes an unnamed file in dir and links it as path once complete.
+// Returns 1 on success, 0 if the filesystem does not support O_TMPFILE
+// and -1 on failure.
+static int webroot_tmpfile(const char *dir, const char *path,
+        const char *auth)
+{
+    char proc[64];
+    int ret = -1;
+    int fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, WEBROOT_MODE);
+    if (fd < 0)
+    {
+        if (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)
+        {
+            return 0;
+        }
+        warn("failed to create file in %s", dir);
+        return -1;
+    }
+    if (!webroot_write(fd, auth))
+    {
+        warn("failed to write %s", path);
+        goto out;
+    }
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) < 0 &&
+            (errno != EEXIST || unlink(path) < 0 ||
+             linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) < 0))
+    {
+        // without /proc the file cannot be linked, fall back to rename
+        ret = errno == ENOENT ? 0 : -1;
+        if (ret < 0)
+        {
+            warn("failed to link %s", path);
+        }
+        goto out;
+    }
+    ret = 1;
+out:
+    close(fd);
+    return ret;
+}
+#endif
+
+bool webroot_put(const char *dir, const char *token, const char *auth)
+{
+    bool success = false;
+    char *path = NULL;
+    char *tmp = NULL;
+    int fd = -1;
+
+    if (!webroot_token(token))
+    {
+        return false;
+    }
+    if (asprintf(&path, "%s/%s", dir, token) < 0)
+    {
+        warnx("webroot_put: asprintf failed");
+        path = NULL;
+        goto out;
+    }
+    msg(1, "writing challenge file %s", path);
+
+#if defined(O_TMPFILE)
+    int r = webroot_tmpfile(dir, path, auth);
+    if (r != 0)
+    {
+        success = r > 0;
+        goto out;
+    }
+#endif
+
+    if (asprintf(&tmp, "%s/.%s.XXXXXX", dir, token) < 0)
+    {
+        warnx("webroot_put: asprintf failed");
+        tmp = NULL;
+        goto out;
+    }
+    fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        warn("failed to create %s", tmp);
+        goto out;
+    }
+    if (!webroot_write(fd, auth))
+    {
+        warn("failed to write %s", tmp);
+        goto out;
+    }
+    if (rename(tmp, path) < 0)
+    {
+        warn("failed to rename %s to %s", tmp, path);
+        goto out;
+    }
+    success = true;
+
+out:
+    if (fd >= 0)
+    {
+        close(fd);
+        if (!success)
+        {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(path);
+    return success;
+}
+
+bool webroot_del(const char *dir, const char *token)
+{
+    char *path = NULL;
+    if (!webroot_token(token))
+    {
+        return false;
+    }
+    if (asprintf(&path, "%s/%s", dir, token) < 0)
+    {
+        warnx("webroot_del: asprintf failed");
+        return false;
+    }
+    msg(1, "removing challenge file %s", path);
+    bool success = unlink(path) == 0 || errno == ENOENT;
+    if (!success)
+    {
+        warn("failed to remove %s", path);
+    }
+    free(path);
+    return success;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2019 Nicola Di Lieto <nicola.dilieto@gmail.com>
+ *
+ * This file is part of uacme.
+ *
+ * uacme is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * uacme is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBROOT_H__
+#define __WEBROOT_H__
+
+#include <stdbool.h>
+
+/*
+ * Built-in http-01 challenge provider: the key authorization is written
+ * to DIR/TOKEN, where DIR is the directory served by the web server as
+ * http://IDENT/.well-known/acme-challenge/. Files are made visible
+ * atomically and complete, so the server never serves a partial one.
+ */
+bool webroot_put(const char *dir, const char *token, const char *auth);
+bool webroot_del(const char *dir, const char *token);
+
+#endif